@@ -8,7 +8,11 @@
 #cmakedefine SYSTEM_DEBUG 1
 #cmakedefine SYSTEM_VERBOSE_DEBUG 0
 #cmakedefine HEAP_DEBUG 0
+/* Record heap allocations into a ring buffer, see heap_v1.dump_trace(). */
+#cmakedefine HEAP_TRACE 0
 #cmakedefine MEMORY_DEBUG 1
+/* Manage physical frames with a buddy allocator instead of the first-fit scanner. */
+#cmakedefine FRAMES_BUDDY 1
 #cmakedefine BOOTIMAGE_DEBUG 0
 #cmakedefine DWARF_DEBUG 0
 /* Overarching tools debugging enabler, disable to turn off all tools debugging prints. */
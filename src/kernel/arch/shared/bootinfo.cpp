@@ -44,6 +44,7 @@ enum bootrec_tag_e
     bootrec_virtual_mapping, // initial virtual-to-physical mapping
     bootrec_command_line,    // command line info
     bootrec_device_tree,
+    bootrec_memory_node,     // NUMA node of a physical memory range
     end
 };
 
@@ -85,6 +86,14 @@ public:
     char* cmdline;
 };
 
+class bootrec_memory_node_t : public bootrec_t
+{
+public:
+    uint64_t start;
+    uint64_t length;
+    uint32_t node;
+};
+
 union bootrec_info_t
 {
     bootrec_t*            rec;
@@ -92,6 +101,7 @@ union bootrec_info_t
     bootrec_mmap_entry_t* memmap;
     bootrec_vmap_entry_t* vmemmap;
     bootrec_cmdline_t*    cmdline;
+    bootrec_memory_node_t* memory_node;
     char*                 generic;
 };
 
@@ -244,6 +254,30 @@ bool bootinfo_t::get_cmdline(const char*& cmdline)
     return false;
 }
 
+uint32_t bootinfo_t::memory_node(uint64_t addr, uint64_t& span_end)
+{
+    bootrec_info_t info;
+    span_end = ~0ULL;
+    info.generic = reinterpret_cast<char*>(this + 1);
+    while (info.generic < free)
+    {
+        if (info.rec->tag == bootrec_memory_node)
+        {
+            uint64_t end = info.memory_node->start + info.memory_node->length;
+            if ((addr >= info.memory_node->start) && (addr < end))
+            {
+                span_end = end;
+                return info.memory_node->node;
+            }
+            // Uncovered addresses extend up to the next node range.
+            if ((info.memory_node->start > addr) && (info.memory_node->start < span_end))
+                span_end = info.memory_node->start;
+        }
+        info.generic += info.rec->size;
+    }
+    return 0;
+}
+
 bootinfo_t::mmap_iterator bootinfo_t::mmap_begin()
 {
     bootrec_info_t info;
@@ -382,6 +416,25 @@ bool bootinfo_t::append_cmdline(const char* cmdline)
     return true;
 }
 
+bool bootinfo_t::append_memory_node(uint64_t start, uint64_t size, uint32_t node)
+{
+    size_t entry_size = sizeof(bootrec_memory_node_t);
+
+    if (will_overflow(entry_size))
+        return false;
+
+    bootrec_memory_node_t* rec = new(free) bootrec_memory_node_t;
+    rec->tag = bootrec_memory_node;
+    rec->size = entry_size;
+
+    rec->start = start;
+    rec->length = size;
+    rec->node = node;
+
+    free += entry_size;
+    return true;
+}
+
 address_t bootinfo_t::find_usable_physical_memory_top()
 {
     address_t top = 0;
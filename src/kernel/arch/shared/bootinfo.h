@@ -161,6 +161,13 @@ public:
 //     bool get_module(const char* name, module_info_t& mod);
     bool get_cmdline(const char*& cmdline);
 
+    /**
+     * Find the NUMA node of physical address @a addr.
+     * @param[out] span_end End of the range of addresses starting at @a addr which belong to the same node.
+     * @return Node number, or 0 if no node information covers @a addr.
+     */
+    uint32_t memory_node(uint64_t addr, uint64_t& span_end);
+
     mmap_iterator mmap_begin();
     mmap_iterator mmap_end();
     
@@ -175,6 +182,7 @@ public:
     bool append_mmap(multiboot_t::mmap_entry_t* entry);
     bool append_vmap(address_t vstart, address_t pstart, size_t size);
     bool append_cmdline(const char* cmdline);
+    bool append_memory_node(uint64_t start, uint64_t size, uint32_t node);
 
     address_t find_usable_physical_memory_top();
     address_t find_highmem_range_of_at_least(size_t bytes);
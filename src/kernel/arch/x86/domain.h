@@ -9,7 +9,7 @@
 #pragma once
 
 #include "types.h"
-#include "doubly_linked_list.h"
+#include "rbtree.h"
 
 /**
 DCB is taken mostly verbatim from Nemesis, here's the original diagram:
@@ -40,17 +40,25 @@ DCB is taken mostly verbatim from Nemesis, here's the original diagram:
 </pre>
 */
 
-struct region_list_t : public dl_link_t<region_list_t>
+/**
+ * Physical memory region allocated to a domain. Regions never overlap, so the tree of them is keyed by start address
+ * alone.
+ */
+struct memory_region_t : public rbtree_link_t<memory_region_t>
 {
     address_t  start;         /* Start of physical memory region         */
     size_t     n_phys_frames; /* No of *physical* frames it extends      */
     size_t     frame_width;   /* Logical frame width within region       */
+};
 
-    region_list_t() : dl_link_t<region_list_t>() {
-        init(this);
-    }
+struct memory_region_traits_t
+{
+    static bool less(const memory_region_t* a, const memory_region_t* b) { return a->start < b->start; }
+    static void update(memory_region_t*) {}
 };
 
+typedef intrusive_rbtree_t<memory_region_t, memory_region_traits_t> memory_region_tree_t;
+
 struct dcb_rw_t;
 struct ramtab_entry_t; // defined by mmu_mod
 
@@ -63,7 +71,7 @@ struct dcb_ro_t
     uint32_t min_phys_frame_count;
     uint32_t max_phys_frame_count;
     ramtab_entry_t* ramtab;
-    region_list_t memory_region_list;
+    memory_region_tree_t memory_regions;
 };
 
 /**
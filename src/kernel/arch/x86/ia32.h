@@ -50,6 +50,7 @@ static const size_t    FRAME_WIDTH = 12;
 // Custom types
 #define IA32_PAGE_SWAPPED        (1<<9)
 #define IA32_PAGE_COW            (1<<10)
+#define IA32_PAGE_MIGRATING      (1<<11) // write access taken away by mmu protect_frame until remap_frame
 
 // CR0 register
 #define IA32_CR0_PE (1 <<  0)   /**< enable protected mode                                       */
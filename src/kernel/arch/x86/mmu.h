@@ -35,6 +35,7 @@
 #pragma once
 
 #include "types.h"
+#include "macros.h"
 #include "ia32.h"
 #include "cpu.h"
 // #include "x86_protection_domain.h"
@@ -60,6 +61,7 @@ public:
     static inline address_t get_pagefault_address(void);
     static inline physical_address_t get_active_pagetable(void);
     static inline void set_active_pagetable(physical_address_t page_dir_physical);
+    static inline void switch_address_space(physical_address_t page_dir_physical, uint32_t asn);
 //     static void set_active_pagetable(x86_protection_domain_t& pdom);
 };
 
@@ -180,6 +182,19 @@ inline void ia32_mmu_t::set_active_pagetable(physical_address_t page_dir_physica
     asm volatile ("movl %0, %%cr3\n" :: "r"(page_dir_physical));
 }
 
+/**
+ * Switch to the address space @a asn on the page directory @a page_dir_physical.
+ *
+ * PCIDs are only available in IA-32e mode, so on 32 bit the TLB is untagged and a CR3 load flushes all non-global
+ * entries. All domains share one page directory, so CR3 is only loaded if it actually changes, and @a asn is unused.
+ */
+inline void ia32_mmu_t::switch_address_space(physical_address_t page_dir_physical, uint32_t asn)
+{
+    UNUSED(asn);
+    if (get_active_pagetable() != page_dir_physical)
+        set_active_pagetable(page_dir_physical);
+}
+
 // inline void ia32_mmu_t::set_active_pagetable(x86_protection_domain_t& pdom)
 // {
 //     set_active_pagetable(pdom.physical_page_directory);
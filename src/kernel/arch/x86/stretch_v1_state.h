@@ -31,6 +31,7 @@ struct state_t : public dl_link_t<state_t>
     mmu_v1::closure_t*               mmu;
     stretch_v1::closure_t            closure;
     sid_t                            sid;
+    uint32_t                         sid_gen;      // Generation of the sid, tells rights on this stretch from stale ones
     
     memory_v1::address               base;
     memory_v1::size                  size;
@@ -0,0 +1,52 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+
+/**
+ * Bit scanning operations on 32 bit words.
+ *
+ * Use gcc builtins, which compile to a single bsf/bsr instruction on x86.
+ */
+class bit_ops
+{
+public:
+    /**
+     * @return index of the least significant set bit in @p word. @p word must not be zero.
+     */
+    static inline int find_first_set(uint32_t word)
+    {
+        return __builtin_ctz(word);
+    }
+
+    /**
+     * @return index of the most significant set bit in @p word. @p word must not be zero.
+     */
+    static inline int find_last_set(uint32_t word)
+    {
+        return 31 - __builtin_clz(word);
+    }
+
+    /**
+     * @return index of the least significant clear bit in @p word. @p word must not be all ones.
+     */
+    static inline int find_first_zero(uint32_t word)
+    {
+        return __builtin_ctz(~word);
+    }
+
+    /**
+     * @return mask with bits @p bit and above set.
+     */
+    static inline uint32_t bits_from(int bit)
+    {
+        return (bit < 32) ? (~0U << bit) : 0;
+    }
+};
@@ -0,0 +1,453 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+
+/**
+ * Tree links of an intrusive red-black tree node. Node types inherit from rbtree_link_t<Node>.
+ */
+template <class Node>
+struct rbtree_link_t
+{
+    Node* parent;
+    Node* left;
+    Node* right;
+    bool  red;
+};
+
+/**
+ * Intrusive red-black tree, it never allocates: nodes are owned by the caller.
+ *
+ * Traits supply the ordering and, for augmented trees, the per-subtree data:
+ *   static bool less(const Node* a, const Node* b);
+ *   static void update(Node* n); // recompute n's subtree data from n and its children, may do nothing
+ *
+ * update() is called on every node whose subtree changes during insert() and remove(). If the caller changes
+ * data of a node in place it calls update_path() on it; a key may be changed in place only if that keeps the order.
+ */
+template <class Node, class Traits>
+class intrusive_rbtree_t
+{
+public:
+    intrusive_rbtree_t() : root_(nullptr), size_(0) {}
+
+    Node*  root() const { return root_; }
+    size_t size() const { return size_; }
+    bool   is_empty() const { return root_ == nullptr; }
+
+    Node* first() const { return root_ ? minimum(root_) : nullptr; }
+    Node* last() const { return root_ ? maximum(root_) : nullptr; }
+
+    static Node* next(Node* n)
+    {
+        if (n->right)
+            return minimum(n->right);
+        while (n->parent && (n == n->parent->right))
+            n = n->parent;
+        return n->parent;
+    }
+
+    static Node* prev(Node* n)
+    {
+        if (n->left)
+            return maximum(n->left);
+        while (n->parent && (n == n->parent->left))
+            n = n->parent;
+        return n->parent;
+    }
+
+    void insert(Node* n)
+    {
+        Node* parent = nullptr;
+        Node** link = &root_;
+
+        while (*link)
+        {
+            parent = *link;
+            link = Traits::less(n, parent) ? &parent->left : &parent->right;
+        }
+
+        n->parent = parent;
+        n->left = n->right = nullptr;
+        n->red = true;
+        *link = n;
+        ++size_;
+
+        update_path(n);
+        insert_fixup(n);
+    }
+
+    void remove(Node* z)
+    {
+        Node* x;
+        Node* x_parent;
+        bool removed_red = z->red;
+
+        if (!z->left)
+        {
+            x = z->right;
+            x_parent = z->parent;
+            transplant(z, x);
+        }
+        else if (!z->right)
+        {
+            x = z->left;
+            x_parent = z->parent;
+            transplant(z, x);
+        }
+        else
+        {
+            // Two children: the successor y takes z's place.
+            Node* y = minimum(z->right);
+            removed_red = y->red;
+            x = y->right;
+
+            if (y->parent == z)
+                x_parent = y;
+            else
+            {
+                x_parent = y->parent;
+                transplant(y, x);
+                y->right = z->right;
+                y->right->parent = y;
+            }
+
+            transplant(z, y);
+            y->left = z->left;
+            y->left->parent = y;
+            y->red = z->red;
+        }
+
+        --size_;
+        update_path(x_parent);
+
+        if (!removed_red)
+            remove_fixup(x, x_parent);
+    }
+
+    /**
+     * Recompute subtree data from @a n up to the root.
+     */
+    void update_path(Node* n)
+    {
+        for (; n; n = n->parent)
+            Traits::update(n);
+    }
+
+    bool fulfills_invariant() const
+    {
+        if (!root_)
+            return size_ == 0;
+        if (root_->red || root_->parent)
+            return false;
+
+        size_t count = 0;
+        if (black_height(root_, count) < 0)
+            return false;
+        if (count != size_)
+            return false;
+
+        for (Node* n = first(), *after; n && ((after = next(n)) != nullptr); n = after)
+        {
+            if (Traits::less(after, n))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    static Node* minimum(Node* n)
+    {
+        while (n->left)
+            n = n->left;
+        return n;
+    }
+
+    static Node* maximum(Node* n)
+    {
+        while (n->right)
+            n = n->right;
+        return n;
+    }
+
+    static bool is_red(Node* n) { return n && n->red; }
+
+    void replace_child(Node* parent, Node* old_child, Node* new_child)
+    {
+        if (!parent)
+            root_ = new_child;
+        else if (parent->left == old_child)
+            parent->left = new_child;
+        else
+            parent->right = new_child;
+    }
+
+    void transplant(Node* u, Node* v)
+    {
+        replace_child(u->parent, u, v);
+        if (v)
+            v->parent = u->parent;
+    }
+
+    void rotate_left(Node* x)
+    {
+        Node* y = x->right;
+        x->right = y->left;
+        if (y->left)
+            y->left->parent = x;
+        y->parent = x->parent;
+        replace_child(x->parent, x, y);
+        y->left = x;
+        x->parent = y;
+
+        Traits::update(x);
+        Traits::update(y);
+    }
+
+    void rotate_right(Node* x)
+    {
+        Node* y = x->left;
+        x->left = y->right;
+        if (y->right)
+            y->right->parent = x;
+        y->parent = x->parent;
+        replace_child(x->parent, x, y);
+        y->right = x;
+        x->parent = y;
+
+        Traits::update(x);
+        Traits::update(y);
+    }
+
+    void insert_fixup(Node* n)
+    {
+        while (is_red(n->parent))
+        {
+            Node* parent = n->parent;
+            Node* grandparent = parent->parent;
+
+            if (parent == grandparent->left)
+            {
+                Node* uncle = grandparent->right;
+                if (is_red(uncle))
+                {
+                    parent->red = uncle->red = false;
+                    grandparent->red = true;
+                    n = grandparent;
+                    continue;
+                }
+                if (n == parent->right)
+                {
+                    rotate_left(parent);
+                    n = parent;
+                    parent = n->parent;
+                }
+                parent->red = false;
+                grandparent->red = true;
+                rotate_right(grandparent);
+            }
+            else
+            {
+                Node* uncle = grandparent->left;
+                if (is_red(uncle))
+                {
+                    parent->red = uncle->red = false;
+                    grandparent->red = true;
+                    n = grandparent;
+                    continue;
+                }
+                if (n == parent->left)
+                {
+                    rotate_right(parent);
+                    n = parent;
+                    parent = n->parent;
+                }
+                parent->red = false;
+                grandparent->red = true;
+                rotate_left(grandparent);
+            }
+        }
+        root_->red = false;
+    }
+
+    void remove_fixup(Node* x, Node* parent)
+    {
+        while ((x != root_) && !is_red(x))
+        {
+            if (x == parent->left)
+            {
+                Node* w = parent->right;
+                if (is_red(w))
+                {
+                    w->red = false;
+                    parent->red = true;
+                    rotate_left(parent);
+                    w = parent->right;
+                }
+                if (!is_red(w->left) && !is_red(w->right))
+                {
+                    w->red = true;
+                    x = parent;
+                    parent = x->parent;
+                    continue;
+                }
+                if (!is_red(w->right))
+                {
+                    w->left->red = false;
+                    w->red = true;
+                    rotate_right(w);
+                    w = parent->right;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                w->right->red = false;
+                rotate_left(parent);
+                x = root_;
+            }
+            else
+            {
+                Node* w = parent->left;
+                if (is_red(w))
+                {
+                    w->red = false;
+                    parent->red = true;
+                    rotate_right(parent);
+                    w = parent->left;
+                }
+                if (!is_red(w->left) && !is_red(w->right))
+                {
+                    w->red = true;
+                    x = parent;
+                    parent = x->parent;
+                    continue;
+                }
+                if (!is_red(w->left))
+                {
+                    w->right->red = false;
+                    w->red = true;
+                    rotate_left(w);
+                    w = parent->left;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                w->left->red = false;
+                rotate_right(parent);
+                x = root_;
+            }
+        }
+        if (x)
+            x->red = false;
+    }
+
+    /**
+     * Black height of the subtree at @a n, or -1 if it breaks a red-black or link rule.
+     */
+    static int black_height(Node* n, size_t& count)
+    {
+        if (!n)
+            return 1;
+        ++count;
+
+        if ((n->left && (n->left->parent != n)) || (n->right && (n->right->parent != n)))
+            return -1;
+        if (n->red && (is_red(n->left) || is_red(n->right)))
+            return -1;
+
+        int left = black_height(n->left, count);
+        int right = black_height(n->right, count);
+        if ((left < 0) || (left != right))
+            return -1;
+
+        return left + (n->red ? 0 : 1);
+    }
+
+    Node*  root_;
+    size_t size_;
+};
+
+/**
+ * Red-black tree of values of type V, ordered by operator <. Nodes are allocated with new.
+ */
+template <typename V>
+class rbtree_t
+{
+    struct node_t : public rbtree_link_t<node_t>
+    {
+        V value;
+        node_t(const V& v) : value(v) {}
+    };
+
+    struct traits_t
+    {
+        static bool less(const node_t* a, const node_t* b) { return a->value < b->value; }
+        static void update(node_t*) {}
+    };
+
+    intrusive_rbtree_t<node_t, traits_t> tree;
+
+    node_t* find(const V& v) const
+    {
+        node_t* n = tree.root();
+        while (n)
+        {
+            if (v < n->value)
+                n = n->left;
+            else if (n->value < v)
+                n = n->right;
+            else
+                return n;
+        }
+        return nullptr;
+    }
+
+public:
+    rbtree_t() {}
+    rbtree_t(const rbtree_t&) = delete;
+    rbtree_t& operator =(const rbtree_t&) = delete;
+
+    ~rbtree_t()
+    {
+        while (node_t* n = tree.root())
+        {
+            tree.remove(n);
+            delete n;
+        }
+    }
+
+    size_t size() const { return tree.size(); }
+
+    void insert(const V& v)
+    {
+        tree.insert(new node_t(v));
+    }
+
+    /**
+     * Look up the value equal to @a v and copy it to @a v.
+     */
+    bool search(V& v) const
+    {
+        node_t* n = find(v);
+        if (!n)
+            return false;
+        v = n->value;
+        return true;
+    }
+
+    void remove(const V& v)
+    {
+        node_t* n = find(v);
+        if (!n)
+            return;
+        tree.remove(n);
+        delete n;
+    }
+
+    bool fulfills_invariant() const { return tree.fulfills_invariant(); }
+};
@@ -0,0 +1,251 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Discover NUMA nodes of physical memory and record them in the bootinfo page.
+//
+#include "bootinfo.h"
+#include "default_console.h"
+#include "macros.h"
+#include "memutils.h"
+
+//======================================================================================================================
+// ACPI System Resource Affinity Table
+//======================================================================================================================
+
+struct acpi_rsdp_t
+{
+    char     signature[8];      // "RSD PTR "
+    uint8_t  checksum;
+    char     oem_id[6];
+    uint8_t  revision;
+    uint32_t rsdt_address;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t  extended_checksum;
+    uint8_t  reserved[3];
+} PACKED;
+
+struct acpi_sdt_header_t
+{
+    char     signature[4];
+    uint32_t length;
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem_id[6];
+    char     oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} PACKED;
+
+struct acpi_srat_t
+{
+    acpi_sdt_header_t header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+} PACKED;
+
+struct acpi_srat_entry_t
+{
+    uint8_t type;
+    uint8_t length;
+} PACKED;
+
+struct acpi_srat_memory_t : public acpi_srat_entry_t
+{
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t size;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} PACKED;
+
+static const uint8_t  SRAT_MEMORY_AFFINITY = 1;
+static const uint32_t SRAT_MEMORY_ENABLED  = 1 << 0;
+
+static bool checksum_valid(const void* table, size_t size)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(table);
+    uint8_t sum = 0;
+    while (size--)
+        sum += *p++;
+    return sum == 0;
+}
+
+static acpi_rsdp_t* scan_rsdp(address_t start, address_t end)
+{
+    for (address_t p = start; p < end; p += 16)
+    {
+        acpi_rsdp_t* rsdp = reinterpret_cast<acpi_rsdp_t*>(p);
+        if (memutils::is_memory_equal(rsdp->signature, "RSD PTR ", 8) && checksum_valid(rsdp, 20))
+            return rsdp;
+    }
+    return 0;
+}
+
+/**
+ * RSDP is in the first KiB of the EBDA or in the BIOS area.
+ */
+static acpi_rsdp_t* find_rsdp()
+{
+    address_t ebda = address_t(*reinterpret_cast<uint16_t*>(0x40e)) << 4;
+    acpi_rsdp_t* rsdp = 0;
+
+    if (ebda)
+        rsdp = scan_rsdp(ebda, ebda + 1*KiB);
+    if (!rsdp)
+        rsdp = scan_rsdp(0xe0000, 0x100000);
+    return rsdp;
+}
+
+static acpi_srat_t* find_srat(acpi_rsdp_t* rsdp)
+{
+    // Prefer XSDT, as long as it is addressable.
+    bool xsdt = (rsdp->revision >= 2) && rsdp->xsdt_address && (rsdp->xsdt_address < (1ULL << 32));
+    acpi_sdt_header_t* root = reinterpret_cast<acpi_sdt_header_t*>(xsdt ? address_t(rsdp->xsdt_address) : rsdp->rsdt_address);
+
+    if (!root || !checksum_valid(root, root->length))
+        return 0;
+
+    size_t entry_size = xsdt ? 8 : 4;
+    size_t n_entries = (root->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    const char* entries = reinterpret_cast<const char*>(root + 1);
+
+    for (size_t i = 0; i < n_entries; ++i)
+    {
+        uint64_t addr = xsdt ? *reinterpret_cast<const uint64_t*>(entries + i * entry_size)
+                             : *reinterpret_cast<const uint32_t*>(entries + i * entry_size);
+        if (addr >= (1ULL << 32))
+            continue;
+
+        acpi_sdt_header_t* table = reinterpret_cast<acpi_sdt_header_t*>(address_t(addr));
+        if (memutils::is_memory_equal(table->signature, "SRAT", 4) && checksum_valid(table, table->length))
+            return reinterpret_cast<acpi_srat_t*>(table);
+    }
+    return 0;
+}
+
+static size_t parse_srat(bootinfo_t* bi, acpi_srat_t* srat)
+{
+    size_t n_ranges = 0;
+    const char* p = reinterpret_cast<const char*>(srat + 1);
+    const char* end = reinterpret_cast<const char*>(srat) + srat->header.length;
+
+    while (p + sizeof(acpi_srat_entry_t) <= end)
+    {
+        const acpi_srat_entry_t* entry = reinterpret_cast<const acpi_srat_entry_t*>(p);
+        if (entry->length == 0)
+            break;
+
+        if (entry->type == SRAT_MEMORY_AFFINITY)
+        {
+            const acpi_srat_memory_t* mem = static_cast<const acpi_srat_memory_t*>(entry);
+            if ((mem->flags & SRAT_MEMORY_ENABLED) && mem->size)
+            {
+                kconsole << "SRAT: node " << mem->proximity_domain << " memory at " << mem->base << ", " << mem->size << " bytes" << endl;
+                if (bi->append_memory_node(mem->base, mem->size, mem->proximity_domain))
+                    ++n_ranges;
+            }
+        }
+        p += entry->length;
+    }
+    return n_ranges;
+}
+
+//======================================================================================================================
+// Synthetic node map
+//======================================================================================================================
+
+/**
+ * Parse a size with an optional K, M or G suffix, advancing @a p past it.
+ */
+static uint64_t parse_size(const char*& p)
+{
+    uint64_t size = 0;
+    while ((*p >= '0') && (*p <= '9'))
+        size = size * 10 + (*p++ - '0');
+
+    switch (*p)
+    {
+        case 'K': size <<= 10; ++p; break;
+        case 'M': size <<= 20; ++p; break;
+        case 'G': size <<= 30; ++p; break;
+    }
+    return size;
+}
+
+/**
+ * "numa=<size>,<size>,..." splits physical memory from address 0 into nodes of the given sizes, the last node
+ * extends to the end of memory. For testing NUMA policies on machines without SRAT.
+ */
+static size_t parse_cmdline_nodes(bootinfo_t* bi)
+{
+    const char* cmdline;
+    const char* p = 0;
+
+    if (!bi->get_cmdline(cmdline))
+        return 0;
+
+    for (const char* s = cmdline; *s; ++s)
+    {
+        if (((s == cmdline) || (s[-1] == ' ')) && memutils::is_memory_equal(s, "numa=", 5))
+        {
+            p = s + 5;
+            break;
+        }
+    }
+    if (!p)
+        return 0;
+
+    uint64_t start = 0;
+    uint32_t node = 0;
+    for (;;)
+    {
+        uint64_t size = parse_size(p);
+        bool last = (*p != ',') || (size == 0);
+        if (last)
+            size = ~0ULL - start;
+
+        kconsole << "numa: node " << node << " memory at " << start << ", " << size << " bytes" << endl;
+        if (!bi->append_memory_node(start, size, node))
+            break;
+        ++node;
+        if (last)
+            break;
+
+        start += size;
+        ++p;
+    }
+    return node;
+}
+
+/**
+ * Record NUMA nodes of physical memory in the bootinfo page, from the command line if given there, otherwise
+ * from ACPI SRAT. Without either all memory is on node 0.
+ */
+void discover_memory_nodes(bootinfo_t* bi)
+{
+    if (parse_cmdline_nodes(bi))
+        return;
+
+    acpi_rsdp_t* rsdp = find_rsdp();
+    if (!rsdp)
+        return;
+
+    acpi_srat_t* srat = find_srat(rsdp);
+    if (!srat)
+    {
+        kconsole << "No ACPI SRAT, assuming uniform memory" << endl;
+        return;
+    }
+
+    kconsole << "Found " << parse_srat(bi, srat) << " NUMA memory ranges in ACPI SRAT" << endl;
+}
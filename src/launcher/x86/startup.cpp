@@ -33,6 +33,7 @@ static void parse_cmdline(bootinfo_t* bi)
         // "debug"
         // "noapic"
         // "maxmem="
+        // "numa=" (see memory_nodes.cpp)
 
 /*#define PARSENUM(name, var, msg, massage...)            \
         if ((p = strstr(mbi->cmdline, name"=")) != NULL)    \
@@ -194,6 +195,7 @@ static void prepare_infopage()
 }
 
 extern timer_v1::closure_t* init_timer(); // YIKES external declaration! FIXME
+extern void discover_memory_nodes(bootinfo_t* bi);
 
 /**
  * Get the system going.
@@ -215,6 +217,7 @@ extern "C" void arch_prepare()
     parse_cmdline(bi);
     prepare_infopage(); // <-- init domain info page
     check_cpu_features(); // cmdline might affect used CPU feats? (i.e. noacpi flag)
+    discover_memory_nodes(bi);
     
     // TODO: CREATE INITIAL MEMORY MAPPINGS PROPERLY HERE
     // TEMPORARY: just map all mem 0..min(16Mb, RAMtop) to 1-1 mapping? for simplicity
@@ -7,8 +7,9 @@
 // (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 #include "heap.h"
+#include "bit_ops.h"
 #include "memory.h"
-#include "debugger.h"
+#include "memutils.h"
 #include "logger.h"
 #include "default_console.h"
 #include "panic.h"
@@ -24,8 +25,6 @@
 #define HEAP_MAGIC        0xfa11dead
 #define MIN_HEAP_OVERHEAD (sizeof(heap_rec_t)*3)
 
-#define OTHER_INDEX (COUNT-1)
-
 #define WORD_SIZE (sizeof(uint64_t))
 static inline size_t BLOCK_ALIGN(size_t _x) { return ((_x)+WORD_SIZE) & -(WORD_SIZE); }
 #define _S(_x) (_x * WORD_SIZE)
@@ -36,6 +35,9 @@ static inline size_t BLOCK_ALIGN(size_t _x) { return ((_x)+WORD_SIZE) & -(WORD_S
 #define SMALL_LIMIT _S(16)
 #define LARGE_LIMIT _S(1296)
 #define SMALL_INDEX(x) ((x-1) / WORD_SIZE)
+#define LARGE_GRANULE_WIDTH 6
+#define LOG_BASE_WIDTH 13 // log2 of LARGE_LIMIT, first logarithmic free list starts above it
+#define MAX_ALLOCATION (~size_t(0) >> 1) // Larger requests can't be rounded up and fitted with headers without wrapping
 
 const memory_v1::size heap_t::all_sizes[heap_t::COUNT] =
 {
@@ -44,9 +46,24 @@ const memory_v1::size heap_t::all_sizes[heap_t::COUNT] =
     
     _S(19),  _S(23),  _S(28),  _S(34),  _S(41),  _S(49),  _S(59),   _S(71),
     _S(85),  _S(102), _S(122), _S(146), _S(175), _S(210), _S(252),  _S(302),
-    _S(362), _S(434), _S(521), _S(625), _S(750), _S(900), _S(1080), _S(1296),
-    
-    ~0U
+    _S(362), _S(434), _S(521), _S(625), _S(750), _S(900), _S(1080), _S(1296)
+};
+
+/**
+ * Smallest large size class covering the start of each 64-byte granule up to LARGE_LIMIT.
+ * Size classes are at least 24 bytes apart, so at most two more steps are needed from there.
+ */
+const uint8_t heap_t::large_index[] =
+{
+     0,  8, 16, 18, 19, 20, 21, 22, 23, 24, 24, 25, 25, 26, 26, 26, 27, 27,
+    27, 28, 28, 28, 29, 29, 29, 29, 29, 30, 30, 30, 30, 30, 31, 31, 31, 31,
+    31, 31, 32, 32, 32, 32, 32, 32, 32, 32, 33, 33, 33, 33, 33, 33, 33, 33,
+    33, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 34, 35, 35, 35, 35, 35, 35,
+    35, 35, 35, 35, 35, 35, 35, 36, 36, 36, 36, 36, 36, 36, 36, 36, 36, 36,
+    36, 36, 36, 36, 37, 37, 37, 37, 37, 37, 37, 37, 37, 37, 37, 37, 37, 37,
+    37, 37, 37, 37, 37, 38, 38, 38, 38, 38, 38, 38, 38, 38, 38, 38, 38, 38,
+    38, 38, 38, 38, 38, 38, 38, 38, 38, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39
 };
 
 inline heap_t::heap_rec_t* heap_t::prev_block(heap_rec_t* rec)
@@ -59,42 +76,69 @@ inline heap_t::heap_rec_t* heap_t::next_block(heap_rec_t* rec)
     return reinterpret_cast<heap_rec_t*>(reinterpret_cast<char*>(rec + 1) + rec->size);
 }
 
+inline heap_t::heap_rec_t*& heap_t::prev_free(heap_rec_t* rec)
+{
+    return *reinterpret_cast<heap_rec_t**>(rec + 1);
+}
+
+/**
+ * A block is free if its successor's boundary tag holds its size instead of HEAP_MAGIC.
+ * Zero-sized null_malloc and end markers are never free, this also stops us from looking past the end marker.
+ */
+inline bool heap_t::is_free(heap_rec_t* rec)
+{
+    return (rec->size != 0) && (next_block(rec)->prev != HEAP_MAGIC);
+}
+
 void heap_t::init(address_t start, address_t end)//, heap_v1_closure* heap_closure)
 {
     start_address = start;
     end_address   = end;
+    segments_size = 0;
 
     kconsole << "Initializing heap (" << start << ".." << end << ")." << endl;
 
-    for (int i = 0; i < COUNT; ++i)
+    for (int i = 0; i < FREE_LISTS; ++i)
         blocks[i] = NULL;
+    for (int i = 0; i < BITMAP_WORDS; ++i)
+        free_bitmap[i] = 0;
+    free_words = 0;
+
+    // First entry of the initial segment is null_malloc marker.
+    null_malloc = init_segment(start, end);
+}
 
-    // First entry is null_malloc marker.
-    heap_rec_t* null_m = reinterpret_cast<heap_rec_t*>(start);
-    null_m->prev = HEAP_MAGIC;
-    null_m->size = 0;
-    null_m->index = -1;
-    null_m->heap = this;// heap_closure;
+/**
+ * Lay out a heap segment: start marker, all free space in the segment and end marker.
+ * @return the start marker.
+ */
+heap_t::heap_rec_t* heap_t::init_segment(address_t start, address_t end)
+{
+    ASSERT(end - start >= MIN_HEAP_OVERHEAD + MIN_FRAG);
 
-    null_malloc = null_m;
+    // First entry is start marker, it is always "allocated" so nothing coalesces past it.
+    heap_rec_t* start_rec = reinterpret_cast<heap_rec_t*>(start);
+    start_rec->prev = HEAP_MAGIC;
+    start_rec->size = 0;
+    start_rec->index = -1;
+    start_rec->heap = this;// heap_closure;
 
-    // Second entry is all free space in the heap.
-    heap_rec_t* rec = null_m + 1;
+    // Second entry is all free space in the segment.
+    heap_rec_t* rec = start_rec + 1;
     rec->prev = HEAP_MAGIC;
     rec->size = (end - start) - MIN_HEAP_OVERHEAD;
-    rec->index = OTHER_INDEX;
-    rec->next = NULL;
-    
-    blocks[OTHER_INDEX] = rec;
-    
+    link_free(rec);
+
     // Third entry is end marker.
     heap_rec_t* end_rec = next_block(rec);
     end_rec->prev = rec->size;
     end_rec->size = 0;
     end_rec->index = 0;
-    
-    ASSERT(reinterpret_cast<char*>(end_rec) == reinterpret_cast<char*>(end_address) - sizeof(heap_rec_t));
+
+    ASSERT(reinterpret_cast<char*>(end_rec) == reinterpret_cast<char*>(end) - sizeof(heap_rec_t));
     ASSERT(prev_block(end_rec) == rec);
+
+    return start_rec;
 }
 
 // heap_t::~heap_t()
@@ -103,6 +147,10 @@ void heap_t::init(address_t start, address_t end)//, heap_v1_closure* heap_closu
     //Print leak summary.
 // }
 
+/**
+ * @return size class for an allocation of @a size bytes, or the logarithmic free list if it is bigger than
+ * all size classes. Sizes of 4GiB and above all share the last logarithmic list, which is searched for a fit.
+ */
 int heap_t::find_index(size_t size)
 {
     if (size <= SMALL_LIMIT)
@@ -111,149 +159,149 @@ int heap_t::find_index(size_t size)
     }
     else if (size <= LARGE_LIMIT)
     {
-        int mi;
-        int lo = SMALL_BLOCKS;
-        int hi = OTHER_INDEX-1;
-
-        for (; lo + 4 < hi;)
-        {
-            mi = (lo + hi) / 2;
-            if (size == all_sizes[mi])
-            {
-                return mi;
-            }
-            else if (size < all_sizes[mi])
-                hi = mi;
-            else
-                lo = mi;
-        }
-        for(mi = lo; mi <= hi; mi++)
-        {
-            if (size <= all_sizes[mi])
-            {
-                return mi;
-            }
-        }
+        int index = large_index[(size - 1) >> LARGE_GRANULE_WIDTH];
+        while (all_sizes[index] < size)
+            ++index;
+        return index;
     }
-    return OTHER_INDEX;
+    if (uint64_t(size) > 0xffffffffULL)
+        return FREE_LISTS - 1;
+    return COUNT + bit_ops::find_last_set(size) - LOG_BASE_WIDTH;
 }
 
-void heap_t::coalesce()
+/**
+ * Free blocks are binned by the largest size class that they can fully satisfy, so that any block on list @a index
+ * is big enough for an allocation of class @a index.
+ */
+int heap_t::free_list_index(size_t size)
 {
-    int32_t index;
-
-    for (index = 0; index <= OTHER_INDEX; ++index)
-        coalesce_merge_blocks(index);
-
-    for (index = 0; index <= OTHER_INDEX; ++index)
-        coalesce_move_blocks(index);
+    int index = find_index(size);
+    if ((index < COUNT) && (all_sizes[index] > size))
+        --index;
+    return index;
 }
 
-void heap_t::coalesce_merge_blocks(int32_t index)
+/**
+ * @return the first non-empty free list at or above @a index, or -1 if there is none.
+ */
+int heap_t::find_free_list(int index)
 {
-    heap_rec_t* before_block;
-    heap_rec_t* after_block;
-    heap_rec_t* free_block;
-    heap_rec_t** ptr;
+    if (index >= FREE_LISTS)
+        return -1;
 
-    for (ptr = &blocks[index]; (free_block = *ptr); )
+    int word = index / 32;
+    uint32_t bits = free_bitmap[word] & bit_ops::bits_from(index % 32);
+
+    if (!bits)
     {
-        if (free_block->prev != HEAP_MAGIC) // previous block is unallocated indeed!
-        {
-            before_block = prev_block(free_block);
-            if (next_block(before_block) != free_block)
-                PANIC("Out of sanity!");
-                
-            before_block->size += free_block->size + sizeof(heap_rec_t);
-            after_block = next_block(free_block);
-            after_block->prev = before_block->size;
-            
-            *ptr = free_block->next;
-        }
-        else
-        {
-            ptr = &(free_block->next);
-        }
+        uint32_t words = free_words & bit_ops::bits_from(word + 1);
+        if (!words)
+            return -1;
+        word = bit_ops::find_first_set(words);
+        bits = free_bitmap[word];
     }
+
+    return word * 32 + bit_ops::find_first_set(bits);
 }
 
-void heap_t::coalesce_move_blocks(int32_t index)
+void heap_t::link_free(heap_rec_t* rec)
 {
-    heap_rec_t* free_block;
-    heap_rec_t** ptr;
+    int index = free_list_index(rec->size);
+
+    rec->index = index;
+    rec->next = blocks[index];
+    prev_free(rec) = NULL;
+    if (blocks[index])
+        prev_free(blocks[index]) = rec;
+    blocks[index] = rec;
+
+    free_bitmap[index / 32] |= 1U << (index % 32);
+    free_words |= 1U << (index / 32);
+}
 
-    for (ptr = &blocks[index]; (free_block = *ptr); )
+void heap_t::unlink_free(heap_rec_t* rec)
+{
+    int index = rec->index;
+
+    if (prev_free(rec))
+        prev_free(rec)->next = rec->next;
+    else
+        blocks[index] = rec->next;
+
+    if (rec->next)
+        prev_free(rec->next) = prev_free(rec);
+
+    if (!blocks[index])
     {
-        int new_index = find_index(free_block->size);
-        if (new_index != free_block->index)
-        {
-            *ptr = free_block->next;
-            new_index = OTHER_INDEX; // FIXME: hack to make get_new_block_internal find this block even if it's in
-            // a smaller free list than "all sizes"... redo this properly
-            free_block->next = blocks[new_index];
-            blocks[new_index] = free_block;
-            free_block->index = new_index;
-        }
-        else
-        {
-            ptr = &(free_block->next);
-        }
+        free_bitmap[index / 32] &= ~(1U << (index % 32));
+        if (!free_bitmap[index / 32])
+            free_words &= ~(1U << (index / 32));
     }
 }
 
-heap_t::heap_rec_t* heap_t::get_new_block_internal(size_t size, int index)
+heap_t::heap_rec_t* heap_t::get_new_block(size_t size, int index)
 {
-    heap_rec_t* free_block;
+    heap_rec_t* free_block = NULL;
     heap_rec_t* allocated_block;
-    heap_rec_t** ptr;
+    int list;
 
-    for (ptr = &blocks[OTHER_INDEX]; (free_block = *ptr); ptr = &(free_block->next))
+    if (index < COUNT)
+    {
+        // Any block on a list at or above the size class is big enough.
+        size = all_sizes[index];
+        list = find_free_list(index);
+        if (list >= 0)
+            free_block = blocks[list];
+    }
+    else
     {
-        if (free_block->size >= size)
+        // Any block on a list above this power of two is big enough, otherwise look for a fit on its own list.
+        list = find_free_list(index + 1);
+        if (list >= 0)
+            free_block = blocks[list];
+        else
         {
-            if (free_block->size - size >= MIN_FRAG)
-            {
-                // Allocate from the end of free_block
-                allocated_block = reinterpret_cast<heap_rec_t*>(reinterpret_cast<char*>(free_block) + free_block->size - size);
-                allocated_block->size = size;
-                allocated_block->index = index;
-                
-                free_block->size -= size + sizeof(heap_rec_t);
-                allocated_block->prev = free_block->size;
-                
-                return allocated_block;
-            }
-            
-            // Too small to split - take all.
-            free_block->index = index;
-            *ptr = free_block->next;
-
-            return free_block;
+            for (free_block = blocks[index]; free_block; free_block = free_block->next)
+                if (free_block->size >= size)
+                    break;
         }
     }
-    
-    return NULL;
-}
 
-heap_t::heap_rec_t* heap_t::get_new_block(size_t size, int index)
-{
-    heap_rec_t* new_free_block;
+    // Out of space, heap_mod grows stretch-backed heaps with expand() and retries.
+    if (!free_block)
+        return NULL;
 
-    if (index != OTHER_INDEX)
-        size = all_sizes[index];
+    unlink_free(free_block);
+
+    if (free_block->size - size >= MIN_FRAG)
+    {
+        // Allocate from the end of free_block and put the remainder back.
+        allocated_block = reinterpret_cast<heap_rec_t*>(reinterpret_cast<char*>(free_block) + free_block->size - size);
+        allocated_block->size = size;
+        allocated_block->index = index;
+
+        free_block->size -= size + sizeof(heap_rec_t);
+        allocated_block->prev = free_block->size;
+        link_free(free_block);
 
-    if ((new_free_block = get_new_block_internal(size, index)))
-        return new_free_block;
+        return allocated_block;
+    }
 
-    // coalesce some blocks to free up unfragmented space.
-    coalesce();
+    // Too small to split - take all.
+    free_block->index = index;
+    return free_block;
+}
 
-    if ((new_free_block = get_new_block_internal(size, index)))
-        return new_free_block;
+void* heap_t::allocate_index(size_t size, int index)
+{
+    heap_rec_t* free_block = get_new_block(size, index);
+    if (!free_block)
+        return NULL;
 
-    // TODO: grow heap if still no space (by approx size + half the current size: flesh out the right numbers)
+    free_block->heap = this;
+    next_block(free_block)->prev = HEAP_MAGIC;
 
-    return 0;
+    return free_block + 1;
 }
 
 void *heap_t::allocate(size_t size)
@@ -267,37 +315,104 @@ void *heap_t::allocate(size_t size)
     kconsole << "Heap check before allocate(" << size << ")" << endl;
     check_integrity();
 #endif
-    int index;
-    heap_rec_t* free_block;
-
     if (size == 0)
         return null_malloc;
+    if (size > MAX_ALLOCATION)
+        return NULL;
 
     size = BLOCK_ALIGN(size);
-    index = find_index(size);
-    free_block = blocks[index];
-    
-    if ((!free_block) || (index == OTHER_INDEX))
-    {
-        free_block = get_new_block(size, index);
-        if (!free_block)
-            return NULL;
-    }
-    else
-    {
-        blocks[index] = free_block->next;
-    }
-    
-    free_block->heap = this;
-    next_block(free_block)->prev = HEAP_MAGIC;
+    void* result = allocate_index(size, find_index(size));
 
 #if HEAP_DEBUG
     kconsole << "Heap check after allocate(" << size << ")" << endl;
     check_integrity();
 #endif
 
-    logger::trace() << "heap_t::allocate(" << size << ") returning " << (free_block + 1);
-    return free_block + 1;
+    logger::trace() << "heap_t::allocate(" << size << ") returning " << result;
+    return result;
+}
+
+/**
+ * Cut allocated block @a rec down to @a size bytes, returning the tail to the free lists if it is big enough
+ * to form a block of its own.
+ */
+void heap_t::split_block(heap_rec_t* rec, size_t size)
+{
+    if (rec->size - size >= MIN_FRAG)
+    {
+        heap_rec_t* tail = reinterpret_cast<heap_rec_t*>(reinterpret_cast<char*>(rec + 1) + size);
+        tail->prev = HEAP_MAGIC;
+        tail->size = rec->size - size - sizeof(heap_rec_t);
+        tail->index = rec->index;
+        tail->heap = this;
+        rec->size = size;
+        free(tail + 1);
+    }
+
+    // Index only matters for magazines, any block is big enough for the class it is binned under.
+    rec->index = free_list_index(rec->size);
+}
+
+/**
+ * Allocate a block big enough to contain an aligned block of @a size bytes with at least a minimal fragment in front
+ * of it, then cut the leading and trailing slack off and free it, which also merges it with any free neighbours.
+ */
+void* heap_t::allocate_aligned(size_t size, size_t alignment)
+{
+    ASSERT(has_lock());
+    ASSERT((alignment & (alignment - 1)) == 0);
+
+    if (alignment <= WORD_SIZE)
+        return allocate(size);
+    if (size == 0)
+        size = 1;
+    if ((size > MAX_ALLOCATION) || (alignment > MAX_ALLOCATION - size))
+        return NULL;
+
+    size = BLOCK_ALIGN(size);
+    size_t raw_size = size + alignment + MIN_FRAG;
+    void* raw = allocate_index(raw_size, find_index(raw_size));
+    if (!raw)
+        return NULL;
+
+    heap_rec_t* rec = reinterpret_cast<heap_rec_t*>(raw) - 1;
+    heap_rec_t* end_rec = next_block(rec);
+    address_t payload = reinterpret_cast<address_t>(raw);
+    address_t aligned = align_up(payload, alignment);
+
+    if (aligned != payload)
+    {
+        // The leading fragment must be big enough to hold a free block.
+        aligned = align_up(payload + MIN_FRAG, alignment);
+
+        heap_rec_t* lead = rec;
+        rec = reinterpret_cast<heap_rec_t*>(aligned) - 1;
+        rec->prev = HEAP_MAGIC;
+        rec->size = reinterpret_cast<char*>(end_rec) - reinterpret_cast<char*>(aligned);
+        rec->index = lead->index;
+        rec->heap = this;
+        lead->size = reinterpret_cast<char*>(rec) - reinterpret_cast<char*>(lead + 1);
+        free(lead + 1);
+    }
+
+    split_block(rec, size);
+
+    logger::trace() << "heap_t::allocate_aligned(" << size << ", " << alignment << ") returning " << rec + 1;
+    return rec + 1;
+}
+
+size_t heap_t::allocate_batch(int index, void** out, size_t count)
+{
+    ASSERT(has_lock());
+    ASSERT((index >= 0) && (index < SMALL_BLOCKS));
+
+    size_t n;
+    for (n = 0; n < count; ++n)
+    {
+        if (!(out[n] = allocate_index(all_sizes[index], index)))
+            break;
+    }
+    return n;
 }
 
 void heap_t::free(void *p)
@@ -308,22 +423,36 @@ void heap_t::free(void *p)
     check_integrity();
 #endif
     heap_rec_t* to_free;
-    heap_rec_t* nextblock;
+    heap_rec_t* neighbour;
 
     // Exit gracefully for null pointers.
     if ((p == NULL) || (p == null_malloc))
     {
         return;
     }
-    
+
     to_free = reinterpret_cast<heap_rec_t*>(p) - 1;
     logger::trace() << "heap_t::free(" << p << ") freeing " << to_free;
-    nextblock = next_block(to_free);
-    
-    to_free->next = blocks[to_free->index];
-    blocks[to_free->index] = to_free;
 
-    nextblock->prev = to_free->size;
+    // Merge with the following block if it is free.
+    neighbour = next_block(to_free);
+    if (is_free(neighbour))
+    {
+        unlink_free(neighbour);
+        to_free->size += neighbour->size + sizeof(heap_rec_t);
+    }
+
+    // Merge into the preceding block if it is free.
+    if (to_free->prev != HEAP_MAGIC)
+    {
+        neighbour = prev_block(to_free);
+        unlink_free(neighbour);
+        neighbour->size += to_free->size + sizeof(heap_rec_t);
+        to_free = neighbour;
+    }
+
+    link_free(to_free);
+    next_block(to_free)->prev = to_free->size;
     
 #if HEAP_DEBUG
     kconsole << "Heap check after free(" << p << ")" << endl;
@@ -331,87 +460,126 @@ void heap_t::free(void *p)
 #endif
 }
 
-void* heap_t::realloc(void *ptr, size_t size)
+void heap_t::free_batch(void** out, size_t count)
 {
-    debugger_t::checkpoint("heap_t::realloc");
-    UNUSED(size);
-    return ptr;
+    for (size_t n = 0; n < count; ++n)
+        free(out[n]);
 }
 
-void heap_t::expand(size_t new_size)
+int heap_t::small_class(size_t size)
 {
-/*
-#if HEAP_DEBUG
-    check_integrity();
-#endif
-    // Sanity check.
-    ASSERT(new_size > size());
+    if ((size == 0) || (size > SMALL_LIMIT))
+        return -1;
+    size = BLOCK_ALIGN(size);
+    return (size <= SMALL_LIMIT) ? SMALL_INDEX(size) : -1;
+}
+
+int heap_t::block_class(void* p)
+{
+    if (p == null_malloc)
+        return -1;
+    return (reinterpret_cast<heap_rec_t*>(p) - 1)->index;
+}
 
-    kconsole << "Heap expanding from " << int(size()) << " to " << int(new_size) << endl;
+size_t heap_t::block_size(void* p)
+{
+    if (p == null_malloc)
+        return 0;
+    return (reinterpret_cast<heap_rec_t*>(p) - 1)->size;
+}
 
-    // Get the nearest following page boundary.
-    new_size = page_align_up<size_t>(new_size);
+void* heap_t::realloc(void* ptr, size_t size)
+{
+    ASSERT(has_lock());
 
-    // Make sure we are not overreaching ourselves.
-    ASSERT(start_address + new_size <= max_address);
+    if ((ptr == NULL) || (ptr == null_malloc))
+        return allocate(size);
 
-    // This should always be on a page boundary.
-    uint32_t old_size = size();
+    if (size == 0)
+    {
+        free(ptr);
+        return null_malloc;
+    }
+    if (size > MAX_ALLOCATION)
+        return NULL;
+
+    size = BLOCK_ALIGN(size);
+    heap_rec_t* rec = reinterpret_cast<heap_rec_t*>(ptr) - 1;
 
-    uint32_t i = old_size;
-    while(i < new_size)
+    if (size > rec->size)
     {
-        nucleus.mem_mgr().page_frame_allocator().alloc_frame(nucleus.mem_mgr().get_kernel_directory()->mapping(start_address+i), is_kernel);
-        i += PAGE_SIZE;
+        // Try to grow into the following free block.
+        heap_rec_t* next = next_block(rec);
+        if (!is_free(next) || (rec->size + sizeof(heap_rec_t) + next->size < size))
+        {
+            void* moved = allocate(size);
+            if (moved)
+            {
+                memutils::copy_memory(moved, ptr, rec->size);
+                free(ptr);
+            }
+            logger::trace() << "heap_t::realloc(" << ptr << ", " << size << ") moved to " << moved;
+            return moved;
+        }
+
+        unlink_free(next);
+        rec->size += next->size + sizeof(heap_rec_t);
+        next_block(rec)->prev = HEAP_MAGIC;
     }
 
-    end_address = start_address + new_size;
-#if HEAP_DEBUG
-    check_integrity();
-#endif
-*/
+    split_block(rec, size);
+
+    logger::trace() << "heap_t::realloc(" << ptr << ", " << size << ") resized in place";
+    return ptr;
 }
 
-size_t heap_t::contract(size_t new_size)
+void heap_t::expand(address_t start, address_t end)
 {
-/*
+    ASSERT(has_lock());
+    kconsole << "Heap expanding by " << int(end - start) << " bytes at " << start << endl;
+
+    init_segment(start, end);
+    segments_size += end - start;
+
 #if HEAP_DEBUG
     check_integrity();
 #endif
-    // Sanity check.
-    ASSERT(new_size < size());
-
-    // get the nearest following page boundary.
-    new_size = page_align_up<size_t>(new_size);
+}
 
-    // Don't contract too far.
-    if (new_size < HEAP_MIN_SIZE)
-        new_size = HEAP_MIN_SIZE;
+bool heap_t::segment_is_free(address_t start, address_t end)
+{
+    ASSERT(has_lock());
+    heap_rec_t* rec = reinterpret_cast<heap_rec_t*>(start) + 1;
+    return is_free(rec) && (rec->size == (end - start) - MIN_HEAP_OVERHEAD);
+}
 
-    // Not gonna contract anymore anyway
-    if (size() == HEAP_MIN_SIZE)
-        return size();
+void heap_t::contract(address_t start, address_t end)
+{
+    ASSERT(segment_is_free(start, end));
+    kconsole << "Heap contracting by " << int(end - start) << " bytes at " << start << endl;
 
-    kconsole << "Heap contracting from " << int(size()) << " to " << int(new_size) << endl;
+    unlink_free(reinterpret_cast<heap_rec_t*>(start) + 1);
+    segments_size -= end - start;
+}
 
-    // Make sure we are not overreaching ourselves.
-    ASSERT(new_size > 0);
+void heap_t::free_list_stats(uint64_t* lengths, size_t* free_bytes, size_t* largest_free)
+{
+    ASSERT(has_lock());
 
-    uint32_t old_size = size();
+    *free_bytes = 0;
+    *largest_free = 0;
 
-    uint32_t i = new_size;
-    while(i < old_size)
+    for (int index = 0; index < FREE_LISTS; ++index)
     {
-        nucleus.mem_mgr().page_frame_allocator().free_frame(nucleus.mem_mgr().get_kernel_directory()->mapping(start_address+i));
-        i += PAGE_SIZE;
+        lengths[index] = 0;
+        for (heap_rec_t* rec = blocks[index]; rec; rec = rec->next)
+        {
+            ++lengths[index];
+            *free_bytes += rec->size;
+            if (rec->size > *largest_free)
+                *largest_free = rec->size;
+        }
     }
-
-    end_address = start_address + new_size;
-#if HEAP_DEBUG
-    check_integrity();
-#endif
-*/
-    return new_size;
 }
 
 void heap_t::check_integrity()
@@ -432,7 +600,7 @@ void heap_t::check_integrity()
     while (this_header)
     {
         kconsole << "Heap: checking block " << this_header << endl;
-        if (this_header->index > OTHER_INDEX)
+        if (this_header->index >= FREE_LISTS)
         {
             kconsole << LIGHTRED << "Heap integrity check: free list index " << this_header->index << " in block " << this_header << " is invalid." << endl;
             PANIC("Heap corruption!");
@@ -472,7 +640,23 @@ void heap_t::check_integrity()
         if (next_header >= end)
             next_header = NULL;
     }
-    //TODO: check free-lists
+
+    for (int index = 0; index < FREE_LISTS; ++index)
+    {
+        if (!blocks[index] != !(free_bitmap[index / 32] & (1U << (index % 32))))
+        {
+            kconsole << LIGHTRED << "Heap integrity check: free bitmap does not match free list " << index << endl;
+            PANIC("Heap corruption!");
+        }
+        for (heap_rec_t* rec = blocks[index]; rec; rec = rec->next)
+        {
+            if ((rec->index != index) || !is_free(rec) || (rec->next && (prev_free(rec->next) != rec)))
+            {
+                kconsole << LIGHTRED << "Heap integrity check: free block " << rec << " on list " << index << " is invalid." << endl;
+                PANIC("Heap corruption!");
+            }
+        }
+    }
     //TODO: add block checksums for debug heap - should be an instance parameter!
     kconsole << "<= Heap: completed heap check." << endl;
 #endif
@@ -45,15 +45,52 @@ public:
      */
     void* allocate(size_t size);
 
+    /**
+     * Allocates a contiguous region of memory @a size in size, starting at an address which is a multiple of
+     * @a alignment. @a alignment must be a power of two, alignments up to the natural heap block alignment
+     * (including 0) are served by @a allocate. Slack around the aligned block is returned to the free lists.
+     * @return start address of the allocated memory block.
+     */
+    void* allocate_aligned(size_t size, size_t alignment);
+
     /**
      * Releases a block allocated with @a allocate.
      * Releasing a NULL pointer is safe and has no effect.
      */
     void free(void* p);
 
+    /**
+     * Carve up to @a count blocks of small size class @a index out of the heap in one go and store them in @a blocks.
+     * Used to refill the per-VCPU magazines in heap_mod.
+     * @return number of blocks actually allocated.
+     */
+    size_t allocate_batch(int index, void** blocks, size_t count);
+
+    /**
+     * Release @a count blocks previously allocated with @a allocate or @a allocate_batch.
+     */
+    void free_batch(void** blocks, size_t count);
+
+    /**
+     * @return small size class index for an allocation of @a size bytes, or -1 if it is not a small allocation.
+     */
+    static int small_class(size_t size);
+
+    /**
+     * @return size class index of the allocated block @a p, or -1 for the null_malloc marker.
+     */
+    int block_class(void* p);
+
+    /**
+     * @return usable size of the allocated block @a p, or 0 for the null_malloc marker.
+     */
+    size_t block_size(void* p);
+
     /**
      * Reallocate memory block starting at @a ptr to be of size @a size.
-     * @return start address of the memory block.
+     * The block is shrunk or grown in place into a following free block if possible, otherwise it is moved.
+     * @return start address of the memory block, or NULL if there is not enough memory, in which case
+     * the original block is left intact.
      */
     void* realloc(void* ptr, size_t size);
 
@@ -67,27 +104,53 @@ public:
      */
     inline size_t size()
     {
-        return end_address - start_address;
+        return end_address - start_address + segments_size;
     }
 
-private:
     /**
-     * Increase the size of the heap, by requesting pages to be allocated.
-     * Heap size increases from @a size to the nearest page boundary above @a new_size.
+     * Increase the size of the heap by adding memory region from @a start to @a end as a separate heap segment.
+     * The segment is bracketed by marker blocks, so its blocks never coalesce with blocks of other segments.
+     */
+    void expand(address_t start, address_t end);
+
+    /**
+     * @return true if heap segment from @a start to @a end, added by @a expand, has no allocated blocks.
      */
-    void expand(size_t new_size);
+    bool segment_is_free(address_t start, address_t end);
 
     /**
-     * Decrease the size of the heap, by requesting pages to be deallocated.
-     * Heap size decreases from @a size to the nearest page boundary above @a new_size.
-     * @returns the new size (end_address minus start_address) which is not guaranteed to be the
-     * same as @a new_size.
+     * Decrease the size of the heap by removing an unused heap segment from @a start to @a end, previously added
+     * by @a expand. The memory can be released once this returns.
      */
-    size_t contract(size_t new_size);
+    void contract(address_t start, address_t end);
 
+    /**
+     * Walk the free lists, storing the number of blocks on each of them in @a lengths (FREE_LISTS entries),
+     * total size of free blocks in @a free_bytes and size of the largest free block in @a largest_free.
+     * Heap must be locked.
+     */
+    void free_list_stats(uint64_t* lengths, size_t* free_bytes, size_t* largest_free);
+
+private:
     int find_index(size_t size);
+    void* allocate_index(size_t size, int index);
+
+public:
+    static const int SMALL_BLOCKS = 16;
+    static const int LARGE_BLOCKS = 24;
+    static const int COUNT = (SMALL_BLOCKS + LARGE_BLOCKS);
+
+    /**
+     * Blocks bigger than the largest size class are kept on logarithmically spaced free lists, one per power of two.
+     */
+    static const int LOG_BLOCKS = 19;
+    static const int FREE_LISTS = (COUNT + LOG_BLOCKS);
 
 private:
+    /**
+     * Block header. Free blocks are kept on doubly linked free lists: the forward link is kept in the header,
+     * the back link in the first word of the block payload (minimum payload is one word, so it always fits).
+     */
     struct heap_rec_t
     {
         memory_v1::size  prev;  // either a magic or size of previous block (backlink).
@@ -101,19 +164,29 @@ private:
 
     static heap_rec_t* prev_block(heap_rec_t* rec);
     static heap_rec_t* next_block(heap_rec_t* rec);
+    static heap_rec_t*& prev_free(heap_rec_t* rec);
+    static bool is_free(heap_rec_t* rec);
+    int free_list_index(size_t size);
+    int find_free_list(int index);
+    void link_free(heap_rec_t* rec);
+    void unlink_free(heap_rec_t* rec);
     heap_rec_t* get_new_block(size_t size, int index);
-    heap_rec_t* get_new_block_internal(size_t size, int index);
-
-    void coalesce();
-    void coalesce_merge_blocks(int32_t index);
-    void coalesce_move_blocks(int32_t index);
+    void split_block(heap_rec_t* rec, size_t size);
+    heap_rec_t* init_segment(address_t start, address_t end);
 
-    static const int SMALL_BLOCKS = 16;
-    static const int LARGE_BLOCKS = 24;
-    static const int COUNT = (SMALL_BLOCKS + LARGE_BLOCKS + 1);
     static const memory_v1::size all_sizes[COUNT];
+    static const uint8_t large_index[];
+    static const int BITMAP_WORDS = (FREE_LISTS + 31) / 32;
+
+    heap_rec_t* blocks[FREE_LISTS];
+
+    /**
+     * Two-level occupancy bitmap of the free lists: bit i of free_bitmap[w] is set if free list 32*w+i is not empty,
+     * bit w of free_words is set if free_bitmap[w] is not zero.
+     */
+    uint32_t free_words;
+    uint32_t free_bitmap[BITMAP_WORDS];
 
-    heap_rec_t* blocks[COUNT];
     heap_rec_t* null_malloc;
 
     /**
@@ -121,7 +194,11 @@ private:
      */
     address_t start_address;
     /**
-     * The end of our currently allocated space. May be expanded if heap type supports it.
+     * The end of our initial space.
      */
     address_t end_address;
+    /**
+     * Total size of segments added with @a expand.
+     */
+    size_t segments_size;
 };
@@ -11,73 +11,901 @@
 #include "heap_factory_v1_impl.h"
 #include "heap_v1_interface.h"
 #include "heap_v1_impl.h"
+#include "stretch_allocator_v1_interface.h"
+#include "stretch_v1_interface.h"
+#include "vcpu_v1_interface.h"
 #include "heap.h"
 #include "memory.h"
+#include "memutils.h"
+#include "atomic.h"
+#include "vcpu_lock.h"
+#include "algorithm"
 #include "default_console.h"
 #include "exceptions.h"
 #include "panic.h"
+#include "time_macros.h"
+#include "config.h" // for HEAP_TRACE
 
 //======================================================================================================================
 // heap_v1 implementation
 //======================================================================================================================
 
+/**
+ * Magazine is a stack of small blocks of one size class, already carved out of the backing heap_t.
+ * Allocating from or freeing into a magazine does not touch the heap free lists.
+ * Empty magazines are refilled and full magazines drained in batches of MAGAZINE_BATCH blocks.
+ */
+#define MAGAZINE_SIZE  32
+#define MAGAZINE_BATCH (MAGAZINE_SIZE/2)
+
+struct magazine_t
+{
+    size_t count;
+    void*  rounds[MAGAZINE_SIZE];
+};
+
+/**
+ * Stretch-backed heaps grow by adding whole stretches as new heap segments. The segment descriptor lives at the
+ * start of the stretch, the rest of it is handed to heap_t.
+ */
+#define HEAP_GROW_MIN (64*KiB)
+
+struct heap_segment_t
+{
+    heap_segment_t*        next;
+    stretch_v1::closure_t* stretch;
+    address_t              start;
+    address_t              end;
+};
+
+/**
+ * Allocation trace is a ring buffer of compact records of the heap operations, which can be dumped to the console
+ * and replayed on the host with the heap_bench tool from src/tests.
+ */
+#define HEAP_TRACE_SIZE 1024
+#define HEAP_TRACE_MAX_SIZE ((1U << 30) - 1) // Record size field saturates at this, replays see at least 1GiB
+
+enum heap_trace_op_e
+{
+    trace_allocate,
+    trace_allocate_aligned,
+    trace_free
+};
+
+struct heap_trace_record_t
+{
+    uint64_t           timestamp;
+    memory_v1::address address;
+    uint32_t           size : 30;
+    uint32_t           op : 2;
+};
+
+struct heap_trace_t
+{
+    address_t           head; //!< Total number of records written, bumped atomically.
+    heap_trace_record_t records[HEAP_TRACE_SIZE];
+};
+
+/**
+ * Magazines and allocation counters are kept per VCPU and merged when the statistics are read. A heap is not private
+ * to a domain, the root heap for one is handed to every frames_mod client, so a VCPU claims a slot of its own the
+ * first time it takes the heap lock. From then on only that VCPU touches the slot, with its activations off so that
+ * no other thread of its domain gets in between, and magazine hits take no lock. Refills and drains take the lock.
+ * Callers without a VCPU yet, or left without a slot, share one more slot that is only used under the heap lock.
+ */
+#define HEAP_VCPUS 4
+
+struct heap_vcpu_t
+{
+    vcpu_v1::closure_t* vcpu; //!< Owner, set once under the heap lock. NULL for free slots and the shared one.
+    magazine_t magazines[heap_t::SMALL_BLOCKS];
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    int64_t live_bytes;  //!< Signed, blocks may be freed on a different VCPU than the one they were allocated on.
+    uint64_t allocations[heap_t::FREE_LISTS];
+};
+
 struct heap_v1::state_t
 {
     heap_v1::closure_t closure;
     heap_t* heap;
+    memory_v1::size raw_size;
+    heap_vcpu_t vcpus[HEAP_VCPUS];
+    heap_vcpu_t shared;
+    int64_t peak_bytes; //!< Heap-wide, updated under the heap lock.
+#if HEAP_TRACE
+    heap_trace_t trace;
+#endif
+
+    // Stretch-backed heaps only.
+    stretch_v1::closure_t* stretch;
+    stretch_allocator_v1::closure_t* allocator;
+    protection_domain_v1::id owner;
+    heap_segment_t* segments;
+    heap_segment_t* spare; // Free segment kept back from shrinking
+    bool growing;
 };
 
-static memory_v1::address heap_v1_allocate(heap_v1::closure_t* self, memory_v1::size size)
+/**
+ * @return slot of the calling VCPU, or NULL if it has none. Slots are never given up, so no lock is needed.
+ */
+static inline heap_vcpu_t* current_vcpu(heap_v1::state_t* state)
+{
+    vcpu_v1::closure_t* vcpu = PVS(vcpu);
+    if (vcpu)
+    {
+        for (int v = 0; v < HEAP_VCPUS; ++v)
+        {
+            if (state->vcpus[v].vcpu == vcpu)
+                return &state->vcpus[v];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return slot of the calling VCPU, claiming a free one if it has none yet, or the shared slot. Heap must be locked.
+ */
+static heap_vcpu_t* locked_vcpu(heap_v1::state_t* state)
+{
+    vcpu_v1::closure_t* vcpu = PVS(vcpu);
+    if (!vcpu)
+        return &state->shared;
+
+    heap_vcpu_t* free_slot = NULL;
+    for (int v = 0; v < HEAP_VCPUS; ++v)
+    {
+        if (state->vcpus[v].vcpu == vcpu)
+            return &state->vcpus[v];
+        if (!free_slot && !state->vcpus[v].vcpu)
+            free_slot = &state->vcpus[v];
+    }
+
+    if (!free_slot)
+        return &state->shared;
+
+    free_slot->vcpu = vcpu;
+    return free_slot;
+}
+
+static void init_vcpu(heap_vcpu_t& vcpu)
+{
+    vcpu.vcpu = NULL;
+    for (int i = 0; i < heap_t::SMALL_BLOCKS; ++i)
+        vcpu.magazines[i].count = 0;
+    vcpu.cache_hits = 0;
+    vcpu.cache_misses = 0;
+    vcpu.live_bytes = 0;
+    for (int i = 0; i < heap_t::FREE_LISTS; ++i)
+        vcpu.allocations[i] = 0;
+}
+
+static void init_vcpus(heap_v1::state_t* state)
+{
+    for (int v = 0; v < HEAP_VCPUS; ++v)
+        init_vcpu(state->vcpus[v]);
+    init_vcpu(state->shared);
+    state->peak_bytes = 0;
+}
+
+static inline void trace_op(heap_v1::state_t* state, heap_trace_op_e op, memory_v1::size size, void* p)
+{
+#if HEAP_TRACE
+    // Magazine hits trace without the heap lock, each gets a record of its own.
+    heap_trace_record_t& rec = state->trace.records[atomic_ops::faa(&state->trace.head, 1) % HEAP_TRACE_SIZE];
+    // Time module is not available while the heap is being set up.
+    rec.timestamp = PVS(time) ? NOW() : 0;
+    rec.address = reinterpret_cast<memory_v1::address>(p);
+    rec.size = std::min<memory_v1::size>(size, HEAP_TRACE_MAX_SIZE);
+    rec.op = op;
+#else
+    UNUSED(state);
+    UNUSED(op);
+    UNUSED(size);
+    UNUSED(p);
+#endif
+}
+
+/**
+ * Return blocks cached in the magazines of @a vcpu to the backing heap. Heap must be locked, and activations of the
+ * owning VCPU off.
+ */
+static void drain_magazines(heap_v1::state_t* state, heap_vcpu_t* vcpu)
+{
+    for (int i = 0; i < heap_t::SMALL_BLOCKS; ++i)
+    {
+        magazine_t& mag = vcpu->magazines[i];
+        state->heap->free_batch(mag.rounds, mag.count);
+        mag.count = 0;
+    }
+}
+
+/**
+ * Account for block @a p handed out to the client. Size class counters are only bumped for new allocations,
+ * pass negative @a index for a resized block.
+ */
+static inline void count_allocation(heap_v1::state_t* state, heap_vcpu_t* vcpu, void* p, int index)
+{
+    vcpu->live_bytes += state->heap->block_size(p);
+    if (index >= 0)
+        ++vcpu->allocations[index];
+}
+
+/**
+ * Raise the heap-wide peak to the bytes live now. Heap must be locked. The peak is only sampled when the lock is
+ * taken, so it may miss by what the magazines hand out without it.
+ */
+static void update_peak(heap_v1::state_t* state)
+{
+    int64_t live_bytes = state->shared.live_bytes;
+    for (int v = 0; v < HEAP_VCPUS; ++v)
+        live_bytes += state->vcpus[v].live_bytes;
+    state->peak_bytes = std::max(state->peak_bytes, live_bytes);
+}
+
+/**
+ * Allocate from the backing heap and account for the block in @a vcpu. Heap must be locked.
+ * Small allocations (@a index is not negative) are made through the magazines of @a vcpu, others are aligned to
+ * @a alignment.
+ */
+static void* heap_v1_allocate_from_heap(heap_v1::state_t* state, heap_vcpu_t* vcpu, memory_v1::size size, memory_v1::size alignment, int index, heap_trace_op_e op)
+{
+    void* res = 0;
+
+    if (index >= 0)
+    {
+        // Another thread of the VCPU may have refilled the magazine since the unlocked check. Hits and misses of
+        // the shared slot are only counted here.
+        magazine_t& mag = vcpu->magazines[index];
+        if (vcpu == &state->shared)
+        {
+            if (mag.count > 0)
+                ++vcpu->cache_hits;
+            else
+                ++vcpu->cache_misses;
+        }
+
+        // Refill the magazine if it is empty and hand out the last block.
+        if (mag.count == 0)
+            mag.count = state->heap->allocate_batch(index, mag.rounds, MAGAZINE_BATCH);
+        if (mag.count > 0)
+            res = mag.rounds[--mag.count];
+    }
+    else
+    {
+        res = state->heap->allocate_aligned(size, alignment);
+    }
+
+    if (!res)
+    {
+        // Cached blocks may be exactly what is needed to satisfy the request, give them back and retry.
+        // Magazines of other VCPUs are theirs alone and keep their blocks.
+        drain_magazines(state, vcpu);
+        if (vcpu != &state->shared)
+            drain_magazines(state, &state->shared);
+        res = state->heap->allocate_aligned(size, alignment);
+    }
+
+    if (res)
+    {
+        count_allocation(state, vcpu, res, state->heap->block_class(res));
+        update_peak(state);
+        trace_op(state, op, size, res);
+    }
+
+    return res;
+}
+
+static void* heap_v1_allocate_locked(heap_v1::state_t* state, memory_v1::size size, memory_v1::size alignment, int index, heap_trace_op_e op)
 {
 #if !SMP
-    ASSERT(!self->d_state->heap->has_lock());
+    ASSERT(!state->heap->has_lock());
 #endif
-    lockable_scope_lock_t lock(*self->d_state->heap);
+    vcpu_lock_t activations(PVS(vcpu));
+    lockable_scope_lock_t lock(*state->heap);
+    heap_vcpu_t* vcpu = locked_vcpu(state);
     void* res = 0;
 
     // This mega-ugly is here because we behave differently before and after the exceptions module is instantiated...
     if (PVS(exceptions))
     {
         OS_TRY {
-            res = self->d_state->heap->allocate(size);
+            res = heap_v1_allocate_from_heap(state, vcpu, size, alignment, index, op);
         }
         OS_FINALLY {
             lock.unlock();
+            activations.unlock();
         }
         OS_ENDTRY
-
-        if (!res)
-            OS_RAISE((exception_support_v1::id)"heap_v1.no_memory", NULL);
     }
     else
     {
-        // Cannot RAISE here at all!
-        res = self->d_state->heap->allocate(size);
+        res = heap_v1_allocate_from_heap(state, vcpu, size, alignment, index, op);
+    }
+
+    return res;
+}
+
+/**
+ * Add a new stretch to a stretch-backed heap, big enough to satisfy allocation of @a size bytes.
+ * The stretch allocator may well allocate from this same heap, so the heap must not be locked here.
+ */
+static bool heap_v1_grow(heap_v1::state_t* state, memory_v1::size size)
+{
+    // Don't recurse if the stretch allocator itself runs out of heap.
+    if (!state->allocator || state->growing)
+        return false;
+
+    memory_v1::size grow = size + sizeof(heap_segment_t) + HEAP_MIN_SIZE;
+    grow = std::max(grow, std::max<memory_v1::size>(state->heap->size() / 2, HEAP_GROW_MIN));
+    grow = page_align_up(grow);
+
+    state->growing = true;
+    stretch_v1::closure_t* stretch = state->allocator->create(grow, stretch_v1::rights(stretch_v1::right_read));
+    state->growing = false;
+
+    if (!stretch)
+        return false;
+
+    if (state->owner != NULL_PDID)
+        stretch->set_rights(state->owner, stretch_v1::rights(stretch_v1::right_read).add(stretch_v1::right_write));
+
+    memory_v1::size stretch_size;
+    memory_v1::address base = stretch->info(&stretch_size);
+
+    heap_segment_t* segment = reinterpret_cast<heap_segment_t*>(base);
+    segment->stretch = stretch;
+    segment->start = base + sizeof(heap_segment_t);
+    segment->end = base + stretch_size;
+
+    vcpu_lock_t activations(PVS(vcpu));
+    lockable_scope_lock_t lock(*state->heap);
+    segment->next = state->segments;
+    state->segments = segment;
+    state->heap->expand(segment->start, segment->end);
+
+    return true;
+}
+
+/**
+ * @return link to the grown segment holding @a p, or NULL if it is in the initial heap region.
+ */
+static heap_segment_t** segment_link(heap_v1::state_t* state, void* p)
+{
+    address_t addr = reinterpret_cast<address_t>(p);
+    for (heap_segment_t** segment = &state->segments; *segment; segment = &(*segment)->next)
+    {
+        if ((addr >= (*segment)->start) && (addr < (*segment)->end))
+            return segment;
+    }
+    return NULL;
+}
+
+/**
+ * Called with the heap locked after @a p was given back to heap_t. If that left its segment completely free,
+ * take the segment out of the heap and put it on the @a release list, keeping one spare free segment to avoid
+ * thrashing when allocations hover around a segment boundary.
+ * Blocks cached in the magazines keep their segment in use until they are drained back to the heap.
+ */
+static void heap_v1_shrink(heap_v1::state_t* state, void* p, heap_segment_t** release)
+{
+    heap_segment_t** link = segment_link(state, p);
+    if (!link)
+        return;
+
+    heap_segment_t* seg = *link;
+    if ((seg == state->spare) || !state->heap->segment_is_free(seg->start, seg->end))
+        return;
+
+    // The spare may have been allocated from since, then this one takes its place.
+    if (!state->spare || !state->heap->segment_is_free(state->spare->start, state->spare->end))
+    {
+        state->spare = seg;
+        return;
+    }
+
+    state->heap->contract(seg->start, seg->end);
+    *link = seg->next;
+    seg->next = *release;
+    *release = seg;
+}
+
+/**
+ * Give segments taken out of the heap by heap_v1_shrink back to the stretch allocator, with the heap unlocked.
+ */
+static void heap_v1_release(heap_v1::state_t* state, heap_segment_t* release)
+{
+    while (release)
+    {
+        heap_segment_t* seg = release;
+        release = seg->next;
+        state->allocator->destroy_stretch(seg->stretch);
+    }
+}
+
+/**
+ * Small allocations are served from the magazines of the calling VCPU without the heap lock when they hit.
+ */
+static memory_v1::address heap_v1_allocate(heap_v1::closure_t* self, memory_v1::size size)
+{
+    heap_v1::state_t* state = self->d_state;
+    heap_vcpu_t* vcpu = current_vcpu(state);
+    int index = heap_t::small_class(size);
+
+    if ((index >= 0) && vcpu)
+    {
+        vcpu_lock_t activations(vcpu->vcpu);
+        magazine_t& mag = vcpu->magazines[index];
+        if (likely(mag.count > 0))
+        {
+            ++vcpu->cache_hits;
+            void* res = mag.rounds[--mag.count];
+            count_allocation(state, vcpu, res, index);
+            trace_op(state, trace_allocate, size, res);
+            return reinterpret_cast<memory_v1::address>(res);
+        }
+        ++vcpu->cache_misses;
+    }
+
+    void* res = heap_v1_allocate_locked(state, size, 0, index, trace_allocate);
+
+    if (!res && heap_v1_grow(state, size))
+        res = heap_v1_allocate_locked(state, size, 0, index, trace_allocate);
+
+    // Cannot RAISE here before the exceptions module is instantiated!
+    if (!res && PVS(exceptions))
+        OS_RAISE((exception_support_v1::id)"heap_v1.no_memory", NULL);
+
+    return reinterpret_cast<memory_v1::address>(res);
+}
+
+/**
+ * Aligned blocks bypass the magazines on allocation, but are freed like any other block.
+ */
+static memory_v1::address heap_v1_allocate_aligned(heap_v1::closure_t* self, memory_v1::size size, memory_v1::size alignment)
+{
+    heap_v1::state_t* state = self->d_state;
+
+    void* res = heap_v1_allocate_locked(state, size, alignment, -1, trace_allocate_aligned);
+
+    if (!res && heap_v1_grow(state, size + alignment))
+        res = heap_v1_allocate_locked(state, size, alignment, -1, trace_allocate_aligned);
+
+    // Cannot RAISE here before the exceptions module is instantiated!
+    if (!res && PVS(exceptions))
+        OS_RAISE((exception_support_v1::id)"heap_v1.no_memory", NULL);
+
+    return reinterpret_cast<memory_v1::address>(res);
+}
+
+static void* heap_v1_reallocate_locked(heap_v1::state_t* state, void* p, memory_v1::size size)
+{
+#if !SMP
+    ASSERT(!state->heap->has_lock());
+#endif
+    vcpu_lock_t activations(PVS(vcpu));
+    lockable_scope_lock_t lock(*state->heap);
+    heap_vcpu_t* vcpu = locked_vcpu(state);
+    memory_v1::size old_size = state->heap->block_size(p);
+    void* res = state->heap->realloc(p, size);
+
+    if (!res)
+    {
+        drain_magazines(state, vcpu);
+        if (vcpu != &state->shared)
+            drain_magazines(state, &state->shared);
+        res = state->heap->realloc(p, size);
     }
 
+    if (res)
+    {
+        vcpu->live_bytes -= old_size;
+        count_allocation(state, vcpu, res, -1);
+        update_peak(state);
+        trace_op(state, trace_free, 0, p);
+        trace_op(state, trace_allocate, size, res);
+    }
+
+    return res;
+}
+
+/**
+ * Blocks are resized by the backing heap directly, magazines only see them again when they are freed.
+ */
+static memory_v1::address heap_v1_reallocate(heap_v1::closure_t* self, memory_v1::address ptr, memory_v1::size size)
+{
+    heap_v1::state_t* state = self->d_state;
+    void* p = reinterpret_cast<void*>(ptr);
+
+    if (!p)
+        return heap_v1_allocate(self, size);
+
+    void* res = heap_v1_reallocate_locked(state, p, size);
+
+    if (!res && heap_v1_grow(state, size))
+        res = heap_v1_reallocate_locked(state, p, size);
+
+    // Cannot RAISE here before the exceptions module is instantiated!
+    if (!res && PVS(exceptions))
+        OS_RAISE((exception_support_v1::id)"heap_v1.no_memory", NULL);
+
     return reinterpret_cast<memory_v1::address>(res);
 }
 
+/**
+ * Small blocks go to the magazines of the calling VCPU without the heap lock while there is room. Size and class in
+ * the header of an allocated block only change through its owner, so they can be read unlocked.
+ */
 static void heap_v1_free(heap_v1::closure_t* self, memory_v1::address ptr)
 {
+    heap_v1::state_t* state = self->d_state;
+    heap_vcpu_t* vcpu = current_vcpu(state);
+    void* p = reinterpret_cast<void*>(ptr);
+
+    if (!p)
+        return;
+
+    int index = state->heap->block_class(p);
+    bool small = (index >= 0) && (index < heap_t::SMALL_BLOCKS);
+
+    if (small && vcpu)
+    {
+        vcpu_lock_t activations(vcpu->vcpu);
+        magazine_t& mag = vcpu->magazines[index];
+        if (likely(mag.count < MAGAZINE_SIZE))
+        {
+            ++vcpu->cache_hits;
+            vcpu->live_bytes -= state->heap->block_size(p);
+            trace_op(state, trace_free, 0, p);
+            mag.rounds[mag.count++] = p;
+            return;
+        }
+    }
+
+    heap_segment_t* release = NULL;
+
 #if !SMP
-    ASSERT(!self->d_state->heap->has_lock());
+    ASSERT(!state->heap->has_lock());
 #endif
-    lockable_scope_lock_t lock(*self->d_state->heap);
-    self->d_state->heap->free(reinterpret_cast<void*>(ptr));
+    {
+        vcpu_lock_t activations(PVS(vcpu));
+        lockable_scope_lock_t lock(*state->heap);
+        vcpu = locked_vcpu(state);
+        vcpu->live_bytes -= state->heap->block_size(p);
+        trace_op(state, trace_free, 0, p);
+
+        if (small)
+        {
+            magazine_t& mag = vcpu->magazines[index];
+            if (likely(mag.count < MAGAZINE_SIZE))
+            {
+                ++vcpu->cache_hits;
+                mag.rounds[mag.count++] = p;
+                return;
+            }
+            ++vcpu->cache_misses;
+
+            // Magazine is full, drain the older half of it back to the heap.
+            state->heap->free_batch(mag.rounds, MAGAZINE_BATCH);
+            if (state->segments)
+            {
+                for (size_t i = 0; i < MAGAZINE_BATCH; ++i)
+                    heap_v1_shrink(state, mag.rounds[i], &release);
+            }
+            for (size_t i = MAGAZINE_BATCH; i < MAGAZINE_SIZE; ++i)
+                mag.rounds[i - MAGAZINE_BATCH] = mag.rounds[i];
+            mag.count = MAGAZINE_SIZE - MAGAZINE_BATCH;
+            mag.rounds[mag.count++] = p;
+        }
+        else
+        {
+            state->heap->free(p);
+            if (state->segments)
+                heap_v1_shrink(state, p, &release);
+        }
+    }
+
+    heap_v1_release(state, release);
 }
 
 static void heap_v1_check(heap_v1::closure_t* self, bool /*check_free_blocks*/)
 {
+    vcpu_lock_t activations(PVS(vcpu));
     lockable_scope_lock_t lock(*self->d_state->heap);
     self->d_state->heap->check_integrity();
 }
 
+static uint64_t heap_v1_cache_stats(heap_v1::closure_t* self, uint64_t* misses)
+{
+    uint64_t hits = self->d_state->shared.cache_hits;
+    *misses = self->d_state->shared.cache_misses;
+    for (int v = 0; v < HEAP_VCPUS; ++v)
+    {
+        hits += self->d_state->vcpus[v].cache_hits;
+        *misses += self->d_state->vcpus[v].cache_misses;
+    }
+    return hits;
+}
+
+/**
+ * Merge per-VCPU counters and walk the free lists. Blocks cached in the magazines count as allocated.
+ * Other VCPUs keep counting without the lock meanwhile, so the merged counters are a snapshot that may be slightly off.
+ * The sequences are allocated from PVS(heap), which may be this very heap, so they are filled in only after
+ * the heap lock is released.
+ */
+static heap_v1::statistics heap_v1_stats(heap_v1::closure_t* self)
+{
+    heap_v1::state_t* state = self->d_state;
+    heap_v1::statistics s;
+    uint64_t lengths[heap_t::FREE_LISTS];
+    size_t free_bytes, largest_free;
+
+    uint64_t allocations[heap_t::FREE_LISTS] = { 0 };
+    int64_t live_bytes = 0, peak_bytes = 0;
+
+    {
+        vcpu_lock_t activations(PVS(vcpu));
+        lockable_scope_lock_t lock(*state->heap);
+        state->heap->free_list_stats(lengths, &free_bytes, &largest_free);
+
+        for (int v = 0; v <= HEAP_VCPUS; ++v)
+        {
+            heap_vcpu_t& vcpu = (v < HEAP_VCPUS) ? state->vcpus[v] : state->shared;
+            live_bytes += vcpu.live_bytes;
+            for (int i = 0; i < heap_t::FREE_LISTS; ++i)
+                allocations[i] += vcpu.allocations[i];
+        }
+
+        update_peak(state);
+        peak_bytes = state->peak_bytes;
+    }
+
+    s.live_bytes = live_bytes;
+    s.peak_bytes = peak_bytes;
+    s.free_bytes = free_bytes;
+    s.largest_free = largest_free;
+    s.fragmentation = free_bytes ? 100 - largest_free * 100 / free_bytes : 0;
+    s.free_lists.assign(lengths, lengths + heap_t::FREE_LISTS);
+    s.allocations.assign(allocations, allocations + heap_t::FREE_LISTS);
+
+    return s;
+}
+
+static void heap_v1_dump_trace(heap_v1::closure_t* self)
+{
+#if HEAP_TRACE
+    static const char op_names[] = { 'A', 'L', 'F' };
+    heap_trace_t& trace = self->d_state->trace;
+    address_t first = (trace.head > HEAP_TRACE_SIZE) ? trace.head - HEAP_TRACE_SIZE : 0;
+
+    kconsole << "heap_trace: begin " << self << endl;
+    for (address_t i = first; i < trace.head; ++i)
+    {
+        heap_trace_record_t& rec = trace.records[i % HEAP_TRACE_SIZE];
+        kconsole << "heap_trace: " << op_names[rec.op] << " " << uint32_t(rec.size) << " " << rec.address << " " << rec.timestamp << endl;
+    }
+    kconsole << "heap_trace: end" << endl;
+#else
+    kconsole << __FUNCTION__ << ": heap " << self << " built without HEAP_TRACE." << endl;
+#endif
+}
+
+static void heap_v1_reset(heap_v1::closure_t* self)
+{
+    kconsole << __FUNCTION__ << ": heap " << self << " does not support reset." << endl;
+}
+
+/**
+ * Give all grown segments back to the stretch allocator. Raw heap memory is owned by whoever created the heap.
+ */
+static void heap_v1_destroy(heap_v1::closure_t* self)
+{
+    heap_v1::state_t* state = self->d_state;
+
+    heap_v1_release(state, state->segments);
+    state->segments = NULL;
+    state->spare = NULL;
+}
+
 static const heap_v1::ops_t heap_v1_methods =
 {
     heap_v1_allocate,
+    heap_v1_allocate_aligned,
+    heap_v1_reallocate,
     heap_v1_free,
-    heap_v1_check
+    heap_v1_check,
+    heap_v1_cache_stats,
+    heap_v1_stats,
+    heap_v1_dump_trace,
+    heap_v1_reset,
+    heap_v1_destroy
+};
+
+//======================================================================================================================
+// arena heap_v1 implementation
+//======================================================================================================================
+
+/**
+ * Arena heaps hand out memory by bumping a pointer through chunks obtained from the parent heap.
+ * Blocks carry no headers and cannot be freed individually, reset() and destroy() release them all at once.
+ * The first chunk is allocated together with the arena state and is kept over reset().
+ */
+#define ARENA_ALIGN (sizeof(uint64_t))
+
+struct arena_chunk_t
+{
+    arena_chunk_t* next;
+};
+
+struct arena_state_t
+{
+    heap_v1::closure_t  closure;
+    heap_v1::closure_t* parent;
+    memory_v1::size     chunk_size;
+    arena_chunk_t*      chunks;    //!< Additional chunks, the first one follows arena state.
+    address_t           top;
+    address_t           end;
+    address_t           last;      //!< Most recently allocated block, the only one that can be resized.
+    memory_v1::size     allocated; //!< Bytes handed out since the last reset.
+    memory_v1::size     peak;
+};
+
+static inline arena_state_t* arena_state(heap_v1::closure_t* self)
+{
+    return reinterpret_cast<arena_state_t*>(self->d_state);
+}
+
+static bool arena_new_chunk(arena_state_t* state, memory_v1::size size)
+{
+    memory_v1::size chunk_size = std::max<memory_v1::size>(size + sizeof(arena_chunk_t) + ARENA_ALIGN, state->chunk_size);
+    arena_chunk_t* chunk = reinterpret_cast<arena_chunk_t*>(state->parent->allocate(chunk_size));
+    if (!chunk)
+        return false;
+
+    chunk->next = state->chunks;
+    state->chunks = chunk;
+    state->top = reinterpret_cast<address_t>(chunk + 1);
+    state->end = reinterpret_cast<address_t>(chunk) + chunk_size;
+    return true;
+}
+
+static void arena_free_chunks(arena_state_t* state)
+{
+    while (state->chunks)
+    {
+        arena_chunk_t* chunk = state->chunks;
+        state->chunks = chunk->next;
+        state->parent->free(reinterpret_cast<memory_v1::address>(chunk));
+    }
+}
+
+static memory_v1::address arena_v1_allocate_aligned(heap_v1::closure_t* self, memory_v1::size size, memory_v1::size alignment)
+{
+    arena_state_t* state = arena_state(self);
+    alignment = std::max<memory_v1::size>(alignment, ARENA_ALIGN);
+    address_t block = align_up(state->top, alignment);
+
+    // A new chunk must hold the block, its alignment slack and the chunk header without wrapping around.
+    if (size > ~memory_v1::size(0) - alignment - sizeof(arena_chunk_t) - ARENA_ALIGN)
+        return 0;
+
+    if ((block > state->end) || (size > state->end - block))
+    {
+        // Parent heap raises no_memory itself, if it can.
+        if (!arena_new_chunk(state, size + alignment))
+            return 0;
+        block = align_up(state->top, alignment);
+    }
+
+    state->top = block + size;
+    state->last = block;
+    state->allocated += size;
+    state->peak = std::max(state->peak, state->allocated);
+    return block;
+}
+
+static memory_v1::address arena_v1_allocate(heap_v1::closure_t* self, memory_v1::size size)
+{
+    return arena_v1_allocate_aligned(self, size, ARENA_ALIGN);
+}
+
+/**
+ * Arena blocks have no headers, so only the most recently allocated block can be resized: in place if it still fits
+ * in the chunk, otherwise by copying it to a new chunk.
+ */
+static memory_v1::address arena_v1_reallocate(heap_v1::closure_t* self, memory_v1::address ptr, memory_v1::size size)
+{
+    arena_state_t* state = arena_state(self);
+
+    if (!ptr)
+        return arena_v1_allocate(self, size);
+
+    if (ptr != state->last)
+    {
+        kconsole << __FUNCTION__ << ": arena " << self << " can only resize the last allocated block." << endl;
+        return 0;
+    }
+
+    memory_v1::size old_size = state->top - ptr;
+    if (size <= state->end - ptr)
+    {
+        state->top = ptr + size;
+        state->allocated = state->allocated - old_size + size;
+        state->peak = std::max(state->peak, state->allocated);
+        return ptr;
+    }
+
+    memory_v1::address block = arena_v1_allocate(self, size);
+    if (block)
+        memutils::copy_memory(block, ptr, old_size);
+    return block;
+}
+
+static void arena_v1_free(heap_v1::closure_t*, memory_v1::address)
+{
+}
+
+static void arena_v1_check(heap_v1::closure_t*, bool)
+{
+}
+
+static uint64_t arena_v1_cache_stats(heap_v1::closure_t*, uint64_t* misses)
+{
+    *misses = 0;
+    return 0;
+}
+
+/**
+ * Arenas do not track individual blocks, everything handed out since the last reset is live.
+ */
+static heap_v1::statistics arena_v1_stats(heap_v1::closure_t* self)
+{
+    arena_state_t* state = arena_state(self);
+    heap_v1::statistics s;
+
+    s.live_bytes = state->allocated;
+    s.peak_bytes = state->peak;
+    s.free_bytes = state->end - state->top;
+    s.largest_free = s.free_bytes;
+    s.fragmentation = 0;
+
+    return s;
+}
+
+static void arena_v1_dump_trace(heap_v1::closure_t* self)
+{
+    kconsole << __FUNCTION__ << ": arena " << self << " does not trace allocations." << endl;
+}
+
+static void arena_v1_reset(heap_v1::closure_t* self)
+{
+    arena_state_t* state = arena_state(self);
+    arena_free_chunks(state);
+    state->top = reinterpret_cast<address_t>(state + 1);
+    state->end = state->top + state->chunk_size;
+    state->last = 0;
+    state->allocated = 0;
+}
+
+static void arena_v1_destroy(heap_v1::closure_t* self)
+{
+    arena_state_t* state = arena_state(self);
+    arena_free_chunks(state);
+    state->parent->free(reinterpret_cast<memory_v1::address>(state));
+}
+
+static const heap_v1::ops_t arena_v1_methods =
+{
+    arena_v1_allocate,
+    arena_v1_allocate_aligned,
+    arena_v1_reallocate,
+    arena_v1_free,
+    arena_v1_check,
+    arena_v1_cache_stats,
+    arena_v1_stats,
+    arena_v1_dump_trace,
+    arena_v1_reset,
+    arena_v1_destroy
 };
 
 //======================================================================================================================
@@ -89,7 +917,7 @@ static heap_v1::closure_t* heap_factory_v1_create_raw(heap_factory_v1::closure_t
     kconsole << __FUNCTION__ << ": at " << where << " with " << int(size) << " bytes." << endl;
 
     size = page_align_up(size);
-    if (size < HEAP_MIN_SIZE - sizeof(heap_v1::state_t))
+    if (size < HEAP_MIN_SIZE + sizeof(heap_v1::state_t) + sizeof(heap_t))
     {
         kconsole << __FUNCTION__ << ": too small heap requested, not allocating!" << endl;
         return 0;
@@ -99,6 +927,17 @@ static heap_v1::closure_t* heap_factory_v1_create_raw(heap_factory_v1::closure_t
 
     heap_v1::closure_t* ret = &state->closure;
     closure_init(ret, &heap_v1_methods, state);
+    init_vcpus(state);
+#if HEAP_TRACE
+    state->trace.head = 0;
+#endif
+    state->raw_size = size;
+    state->stretch = NULL;
+    state->allocator = NULL;
+    state->owner = NULL_PDID;
+    state->segments = NULL;
+    state->spare = NULL;
+    state->growing = false;
 
     address_t end = where + size;
     address_t start = where + sizeof(heap_v1::state_t) + sizeof(heap_t);
@@ -110,27 +949,66 @@ static heap_v1::closure_t* heap_factory_v1_create_raw(heap_factory_v1::closure_t
 
 static memory_v1::address heap_factory_v1_where(heap_factory_v1::closure_t* self, heap_v1::closure_t* heap, memory_v1::size* size)
 {
-    return 0;
+    *size = heap->d_state->raw_size;
+    return reinterpret_cast<memory_v1::address>(heap->d_state);
 }
 
 /**
  * Realize is used to turn a 'raw' heap into a stretch-based one, and requires that the given stretch maps exactly over
- * the frames of the original heap.
+ * the frames of the original heap. A realized heap grows by getting more stretches from @a allocator, readable by
+ * everyone and writable by @a owner, and gives them back when they are no longer used.
  */
-static heap_v1::closure_t* heap_factory_v1_realize(heap_factory_v1::closure_t* self, heap_v1::closure_t* raw_heap, stretch_v1::closure_t* stretch)
+static heap_v1::closure_t* heap_factory_v1_realize(heap_factory_v1::closure_t* self, heap_v1::closure_t* raw_heap, stretch_v1::closure_t* stretch, stretch_allocator_v1::closure_t* allocator, protection_domain_v1::id owner)
 {
-    // switch heap type to 'stretch'
-    // clear out all stretches
-    // map given stretch as a single stretch
-    // replace ops with stretch based ones
+    memory_v1::size heap_size;
+    memory_v1::address heap_start = heap_factory_v1_where(self, raw_heap, &heap_size);
+
+    memory_v1::size stretch_size;
+    memory_v1::address stretch_start = stretch->info(&stretch_size);
+
+    if ((stretch_start > heap_start) || (stretch_start + stretch_size < heap_start + heap_size))
+    {
+        kconsole << __FUNCTION__ << ": stretch " << stretch_start << " does not cover heap " << heap_start << endl;
+        return raw_heap;
+    }
+
+    heap_v1::state_t* state = raw_heap->d_state;
+    state->stretch = stretch;
+    state->allocator = allocator;
+    state->owner = owner;
+
     return raw_heap;
 }
 
+static heap_v1::closure_t* heap_factory_v1_create_arena(heap_factory_v1::closure_t* self, memory_v1::size size)
+{
+    heap_v1::closure_t* parent = PVS(heap);
+    if (size > ~memory_v1::size(0) - sizeof(arena_state_t))
+        return 0;
+    arena_state_t* state = reinterpret_cast<arena_state_t*>(parent->allocate(sizeof(arena_state_t) + size));
+    if (!state)
+        return 0;
+
+    state->parent = parent;
+    state->chunk_size = size;
+    state->chunks = NULL;
+    state->top = reinterpret_cast<address_t>(state + 1);
+    state->end = state->top + size;
+    state->last = 0;
+    state->allocated = 0;
+    state->peak = 0;
+
+    // Oh, uglyness, oh, casting!
+    closure_init(&state->closure, &arena_v1_methods, reinterpret_cast<heap_v1::state_t*>(state));
+    return &state->closure;
+}
+
 static const heap_factory_v1::ops_t heap_factory_v1_methods =
 {
     heap_factory_v1_create_raw,
     heap_factory_v1_where,
-    heap_factory_v1_realize
+    heap_factory_v1_realize,
+    heap_factory_v1_create_arena
 };
 
 static heap_factory_v1::closure_t clos =
@@ -14,6 +14,8 @@
 #include "frame_allocator_v1_impl.h"
 #include "system_frame_allocator_v1_interface.h"
 #include "system_frame_allocator_v1_impl.h"
+#include "mmu_v1_interface.h"
+#include "events_v1_interface.h"
 #include "types.h"
 #include "macros.h"
 #include "default_console.h"
@@ -22,6 +24,101 @@
 #include "domain.h"
 #include "algorithm"
 #include "logger.h"
+#include "memutils.h"
+#include "bit_ops.h"
+#include "infopage.h"
+#include "time_macros.h"
+#include "config.h" // for FRAMES_BUDDY
+#include "lockable.h"
+
+/**
+ * Single frame allocations are served from per-VCPU caches of free frames, so they need not go through the region
+ * free frames info. Freed frames are pushed on the hot end of the cache and handed out first, while they may still be
+ * in the CPU caches; frames refilled from the regions sit at the cold end. An empty cache is refilled with
+ * FRAMES_CACHE_BATCH frames, a cache over FRAMES_CACHE_HIGH frames drains FRAMES_CACHE_BATCH coldest ones back.
+ *
+ * Cached frames are free and unowned in the ramtab and are not accounted to any client.
+ *
+ * Each VCPU has a cache per NUMA node, so that a client is never handed frames cached from a node other than the one
+ * it prefers. Frames on nodes numbered FRAMES_NODES and above are not cached.
+ * @todo Index by the current VCPU once there is more than one.
+ */
+#define FRAMES_VCPUS       1
+#define FRAMES_NODES       4
+#define FRAMES_CACHE_BATCH 16
+#define FRAMES_CACHE_HIGH  64
+
+struct frames_cache_t
+{
+    size_t count;
+    address_t frames[FRAMES_CACHE_HIGH + 1]; //!< Physical addresses, frames[0] is the coldest.
+};
+
+/**
+ * The caches, the pools below, the free frames info of all regions and the ramtab entries of frames being taken or
+ * given back are shared by all clients, which may run in different domains. They are guarded by a single frames lock,
+ * which the allocator entry points take and helpers expect to be held. It is never held across calls into the heap,
+ * which may come back for more frames, nor while waiting.
+ */
+struct frames_caches_t
+{
+    lockable_t lock;     //!< The frames lock.
+    frames_cache_t caches[FRAMES_VCPUS * FRAMES_NODES];
+};
+
+/**
+ * Allocations with the zeroed attribute take single frames from a pool of pre-zeroed frames, which scrub() fills up
+ * when the system is idle. Frees top the pool up by FRAMES_SCRUB_BATCH frames whenever it is below
+ * FRAMES_ZERO_POOL_LOW, so that it does not stay empty until the next scrub(). Frames are written through the
+ * one-to-one mapping of low physical memory set up by the loader, so only frames below direct_end are ever zeroed.
+ * Bigger zeroed allocations, and those made while the pool is empty, are zeroed synchronously.
+ */
+#define FRAMES_ZERO_POOL_SIZE 128
+#define FRAMES_ZERO_POOL_LOW  32
+#define FRAMES_SCRUB_BATCH    4
+
+struct frames_zero_pool_t
+{
+    address_t direct_end;                       //!< End of one-to-one mapped physical memory.
+    size_t count;
+    address_t frames[FRAMES_ZERO_POOL_SIZE];    //!< Physical addresses.
+};
+
+/**
+ * A few 4 MiB aligned extents of RAM are reserved for allocations that can be mapped with large pages, such as heaps
+ * and framebuffers. Reserved extents are taken from the regions free frames info and are broken up only when memory
+ * runs out otherwise. compact() reassembles extents by migrating mapped frames out of them, as does a 4 MiB
+ * allocation finding none free, though moving no more than FRAMES_COMPACT_BUDGET frames. No more than one eighth
+ * of RAM is reserved.
+ */
+#define FRAMES_LARGE_WIDTH     22
+#define FRAMES_LARGE_FRAMES    (1UL << (FRAMES_LARGE_WIDTH - FRAME_WIDTH))
+#define FRAMES_LARGE_POOL_SIZE 4
+#define FRAMES_COMPACT_BUDGET  64
+
+struct frames_large_pool_t
+{
+    size_t target;                              //!< Number of extents to keep reserved.
+    size_t count;
+    address_t extents[FRAMES_LARGE_POOL_SIZE];  //!< Physical addresses.
+};
+
+/**
+ * Clients may allocate past their guaranteed frames up to their extra frames. When a client cannot get frames within
+ * its guarantee, the optimistic frames held by others are revoked: the holders are notified and have
+ * FRAMES_REVOKE_TIMEOUT to free them, after which the frames are reclaimed forcibly. The revoking client sleeps on its
+ * own event count meanwhile, which each holder advances from free() once it is down to its target.
+ *
+ * The client list and the revocation state of the clients are guarded by the frames lock. Clients are never unlinked,
+ * so a walk may let go of the lock and carry on from the same client.
+ */
+#define FRAMES_REVOKE_TIMEOUT MILLISECS(100)
+#define NO_REVOCATION         (~0U)
+
+struct frames_clients_t
+{
+    frame_allocator_v1::state_t* head;          //!< All clients created by create_client().
+};
 
 /**
  * Frame allocator client record.
@@ -31,7 +128,7 @@ struct frame_allocator_v1::state_t
     frame_allocator_v1::closure_t closure;
 
     dcb_ro_t* domain;                      //<! Virtual address of client's RO DCB.
-    region_list_t* region_list;            //<! List of frame regions allocated for this client.
+    memory_region_tree_t* region_tree;     //<! Tree of frame regions allocated for this client.
 
     uint32_t n_allocated_phys_frames;      //<! Number of already allocated RAM frames.
 
@@ -39,13 +136,51 @@ struct frame_allocator_v1::state_t
     size_t guaranteed_frames;
     size_t extra_frames;
 
+    frame_allocator_v1::node_policy policy;
+    uint32_t node;                         //!< Node to allocate from, unless policy is any.
+
     heap_v1::closure_t* heap;
+    mmu_v1::closure_t* mmu;                   //<! Used to remap frames migrated by compact().
     frames_module_v1::state_t* module_state;  //<! Back pointer to shared state.
+    frames_caches_t* caches;                  //<! Per-VCPU free frame caches, shared by all clients.
+    frames_zero_pool_t* zero_pool;            //<! Pre-zeroed frames, shared by all clients.
+    frames_large_pool_t* large_pool;          //<! Reserved 4 MiB extents, shared by all clients.
+    frames_clients_t* clients;                //<! Client list, shared by all clients.
+    frame_allocator_v1::state_t* next_client;
+
+    events_v1::closure_t* revoke_events;      //<! Where to notify the client of revocation, NULL if not registered.
+    event_v1::count revoke_notify;
+    uint32_t revoke_target;                   //!< Frames to be left with after revocation, or NO_REVOCATION.
+    uint32_t revoke_asked;
+    frame_allocator_v1::state_t* revoker;     //!< Client the frames are being revoked for, NULL if none.
+
+    events_v1::closure_t* freed_events;       //<! Where victims tell the client they gave up their frames, NULL until it first revokes.
+    event_v1::count freed_notify;
 };
 
+/**
+ * Frames are managed either by a first-fit scanner or by a buddy allocator, selected at build time by FRAMES_BUDDY.
+ *
+ * The scanner keeps in each frame the number of free frames in the run starting at it, and looks for a long enough
+ * run linearly from the start of the region.
+ *
+ * The buddy allocator keeps free frames in naturally aligned blocks of 2^order frames, for orders 0..BUDDY_MAX_ORDER,
+ * on per-region doubly linked free lists threaded through the frames array. Alignment is by physical frame number,
+ * so a block of order k is always aligned to 2^k frames in physical memory. Requests larger than the biggest block
+ * are satisfied from adjacent maximum order blocks.
+ */
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_ORDERS    (BUDDY_MAX_ORDER + 1)
+#define NO_FRAME        (~0U)
+
 struct frame_st
 {
-    uint32_t free;
+    uint32_t free : 31;   //!< Scanner: free frames in the run starting here. Buddy: order + 1 if a free block starts here.
+    uint32_t movable : 1; //!< Allocated with the movable attribute, compaction may migrate it.
+#if FRAMES_BUDDY
+    uint32_t next;        //!< Buddy free list links, as frame indices in the region.
+    uint32_t prev;
+#endif
 };
 
 /**
@@ -57,9 +192,14 @@ struct frames_module_v1::state_t
     size_t n_logical_frames;
     uint32_t frame_width;
     memory_v1::attrs attrs;
+    uint32_t node;                         //!< NUMA node of the region memory.
     ramtab_v1::closure_t* ramtab;
     frames_module_v1::state_t* next;
     frame_st* frames;
+#if FRAMES_BUDDY
+    uint32_t free_orders;                  //!< Bit k is set if free list of order k is not empty.
+    uint32_t free_heads[BUDDY_ORDERS];
+#endif
 };
 
 //======================================================================================================================
@@ -73,6 +213,10 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
 static uint32_t system_frame_allocator_v1_query(frame_allocator_v1::closure_t* self, memory_v1::address addr, memory_v1::attrs* attr);
 static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self, memory_v1::address addr, memory_v1::size bytes);
 static void system_frame_allocator_v1_destroy(frame_allocator_v1::closure_t* self);
+static void system_frame_allocator_v1_set_node_policy(frame_allocator_v1::closure_t* self, frame_allocator_v1::node_policy policy, uint32_t node);
+static uint32_t system_frame_allocator_v1_query_node(frame_allocator_v1::closure_t* self, memory_v1::address addr);
+static void system_frame_allocator_v1_register_revocation(frame_allocator_v1::closure_t* self, events_v1::closure_t* events, event_v1::count notify);
+static uint32_t system_frame_allocator_v1_revocation_pending(frame_allocator_v1::closure_t* self);
 
 static memory_v1::address frame_allocator_v1_allocate(frame_allocator_v1::closure_t* self, memory_v1::size bytes, uint32_t frame_width)
 {
@@ -99,59 +243,413 @@ static void frame_allocator_v1_destroy(frame_allocator_v1::closure_t* self)
     system_frame_allocator_v1_destroy(self);
 }
 
+static void frame_allocator_v1_set_node_policy(frame_allocator_v1::closure_t* self, frame_allocator_v1::node_policy policy, uint32_t node)
+{
+    system_frame_allocator_v1_set_node_policy(self, policy, node);
+}
+
+static uint32_t frame_allocator_v1_query_node(frame_allocator_v1::closure_t* self, memory_v1::address addr)
+{
+    return system_frame_allocator_v1_query_node(self, addr);
+}
+
+static void frame_allocator_v1_register_revocation(frame_allocator_v1::closure_t* self, events_v1::closure_t* events, event_v1::count notify)
+{
+    system_frame_allocator_v1_register_revocation(self, events, notify);
+}
+
+static uint32_t frame_allocator_v1_revocation_pending(frame_allocator_v1::closure_t* self)
+{
+    return system_frame_allocator_v1_revocation_pending(self);
+}
+
 static const frame_allocator_v1::ops_t frame_allocator_v1_methods =
 {
     frame_allocator_v1_allocate,
     frame_allocator_v1_allocate_range,
     frame_allocator_v1_query,
     frame_allocator_v1_free,
-    frame_allocator_v1_destroy
+    frame_allocator_v1_destroy,
+    frame_allocator_v1_set_node_policy,
+    frame_allocator_v1_query_node,
+    frame_allocator_v1_register_revocation,
+    frame_allocator_v1_revocation_pending
 };
 
 //======================================================================================================================
 // implementation helper functions
 //======================================================================================================================
 
-static void mark_frames_used(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* state, address_t first_frame, size_t n_frames)
+inline address_t frame_address(frames_module_v1::state_t* cur_state, address_t frame_index)
 {
-    for (size_t j = first_frame; j < (first_frame + n_frames); ++j)
-        state->frames[j].free = 0;
+    return cur_state->start + (frame_index << cur_state->frame_width);
+}
 
-    if (state->ramtab)
+#if FRAMES_BUDDY
+
+/**
+ * @return smallest order of a block containing @a n_frames frames.
+ */
+static inline uint32_t buddy_order(size_t n_frames)
+{
+    return (n_frames <= 1) ? 0 : bit_ops::find_last_set(n_frames - 1) + 1;
+}
+
+/**
+ * @return physical frame number of the logical frame @a index in the region, buddies are paired by it.
+ */
+static inline address_t buddy_pfn(frames_module_v1::state_t* region, address_t index)
+{
+    return (region->start >> region->frame_width) + index;
+}
+
+static void buddy_link(frames_module_v1::state_t* region, address_t block, uint32_t order)
+{
+    frame_st& frame = region->frames[block];
+    frame.free = order + 1;
+    frame.prev = NO_FRAME;
+    frame.next = region->free_heads[order];
+    if (frame.next != NO_FRAME)
+        region->frames[frame.next].prev = block;
+    region->free_heads[order] = block;
+    region->free_orders |= 1U << order;
+}
+
+static void buddy_unlink(frames_module_v1::state_t* region, address_t block)
+{
+    frame_st& frame = region->frames[block];
+    uint32_t order = frame.free - 1;
+
+    if (frame.prev != NO_FRAME)
+        region->frames[frame.prev].next = frame.next;
+    else
+        region->free_heads[order] = frame.next;
+    if (frame.next != NO_FRAME)
+        region->frames[frame.next].prev = frame.prev;
+    if (region->free_heads[order] == NO_FRAME)
+        region->free_orders &= ~(1U << order);
+
+    frame.free = 0;
+}
+
+/**
+ * Put a free block back, merging it with its buddy as long as the buddy is free as a whole.
+ */
+static void buddy_insert(frames_module_v1::state_t* region, address_t block, uint32_t order)
+{
+    while (order < BUDDY_MAX_ORDER)
     {
-        uint32_t ridx = state->start >> FRAME_WIDTH;
-        size_t fshift = state->frame_width - FRAME_WIDTH; /* frame_width >= FRAME_WIDTH */
-        for (size_t j = first_frame; j < (first_frame + n_frames); ++j)
+        // Buddies are paired by physical frame number, the region may start unaligned.
+        address_t buddy = (buddy_pfn(region, block) ^ (1UL << order)) - buddy_pfn(region, 0);
+        if ((buddy >= region->n_logical_frames) || (region->frames[buddy].free != order + 1))
+            break;
+        buddy_unlink(region, buddy);
+        block = std::min(block, buddy);
+        ++order;
+    }
+    buddy_link(region, block, order);
+}
+
+/**
+ * Split a run of free frames into the largest naturally aligned blocks and put them on the free lists.
+ */
+static void buddy_free_run(frames_module_v1::state_t* region, address_t first, size_t n_frames)
+{
+    while (n_frames > 0)
+    {
+        address_t pfn = buddy_pfn(region, first);
+        uint32_t order = pfn ? std::min<uint32_t>(bit_ops::find_first_set(pfn), BUDDY_MAX_ORDER) : BUDDY_MAX_ORDER;
+        while ((1UL << order) > n_frames)
+            --order;
+        buddy_insert(region, first, order);
+        first += 1UL << order;
+        n_frames -= 1UL << order;
+    }
+}
+
+/**
+ * @return first frame of the free block containing frame @a index, or NO_FRAME if the frame is allocated.
+ */
+static address_t buddy_find_block(frames_module_v1::state_t* region, address_t index)
+{
+    address_t pfn = buddy_pfn(region, index);
+    for (uint32_t order = 0; order < BUDDY_ORDERS; ++order)
+    {
+        address_t block = index - (pfn & ((1UL << order) - 1));
+        if (block > index) // ran off the region start
+            break;
+        if (region->frames[block].free == order + 1)
+            return block;
+    }
+    return NO_FRAME;
+}
+
+/**
+ * @return number of consecutive free frames starting at @a first, looking at no more than @a n_frames.
+ */
+static size_t buddy_free_frames_at(frames_module_v1::state_t* region, address_t first, size_t n_frames)
+{
+    size_t n_free = 0;
+    while ((n_free < n_frames) && (first + n_free < region->n_logical_frames))
+    {
+        address_t block = buddy_find_block(region, first + n_free);
+        if (block == NO_FRAME)
+            break;
+        n_free = block + (1UL << (region->frames[block].free - 1)) - first;
+    }
+    return std::min(n_free, n_frames);
+}
+
+#endif // FRAMES_BUDDY
+
+/**
+ * Initialise region frames to all free.
+ */
+static void init_free_frames(frames_module_v1::state_t* region)
+{
+    for (size_t j = 0; j < region->n_logical_frames; ++j)
+        region->frames[j].movable = false;
+#if FRAMES_BUDDY
+    region->free_orders = 0;
+    for (size_t order = 0; order < BUDDY_ORDERS; ++order)
+        region->free_heads[order] = NO_FRAME;
+    for (size_t j = 0; j < region->n_logical_frames; ++j)
+        region->frames[j].free = 0;
+    buddy_free_run(region, 0, region->n_logical_frames);
+#else
+    for (size_t j = 0; j < region->n_logical_frames; ++j)
+        region->frames[j].free = region->n_logical_frames - j;
+#endif
+}
+
+/**
+ * Find @a n_frames free logical frames in @a region, the first one aligned to @a align bits.
+ */
+static bool find_free_frames(frames_module_v1::state_t* region, size_t n_frames, uint32_t align, address_t* first_frame)
+{
+#if FRAMES_BUDDY
+    uint32_t order = std::max(buddy_order(n_frames), align > region->frame_width ? align - region->frame_width : 0);
+
+    if (order <= BUDDY_MAX_ORDER)
+    {
+        uint32_t orders = region->free_orders & bit_ops::bits_from(order);
+        if (!orders)
+            return false;
+        *first_frame = region->free_heads[bit_ops::find_first_set(orders)];
+        return true;
+    }
+
+    // Bigger than the largest block: look for a run of adjacent largest blocks.
+    for (address_t block = region->free_heads[BUDDY_MAX_ORDER]; block != NO_FRAME; block = region->frames[block].next)
+    {
+        if (is_aligned_to_frame_width(frame_address(region, block), align)
+            && (buddy_free_frames_at(region, block, n_frames) == n_frames))
+        {
+            *first_frame = block;
+            return true;
+        }
+    }
+    return false;
+#else
+    // We need at least n_frames contiguous frames starting aligned to "align"
+    for (*first_frame = 0; *first_frame < region->n_logical_frames; ++(*first_frame))
+    {
+        if (region->frames[*first_frame].free >= n_frames && is_aligned_to_frame_width(frame_address(region, *first_frame), align))
+            return true;
+    }
+    return false;
+#endif
+}
+
+/**
+ * Find @a n_frames free logical frames in @a region which all lie below address @a limit, the first one aligned
+ * to @a align bits. Slower than find_free_frames().
+ */
+static bool find_low_free_frames(frames_module_v1::state_t* region, size_t n_frames, uint32_t align, address_t limit, address_t* first_frame)
+{
+    if (frame_address(region, n_frames) > limit)
+        return false;
+    size_t n_low_frames = std::min<size_t>(region->n_logical_frames, (limit - region->start) >> region->frame_width);
+
+#if FRAMES_BUDDY
+    // Try the first aligned frame of every free block, the run may continue into the following blocks.
+    address_t align_mask = (align > region->frame_width) ? (1UL << (align - region->frame_width)) - 1 : 0;
+    for (uint32_t order = 0; order < BUDDY_ORDERS; ++order)
+    {
+        for (address_t block = region->free_heads[order]; block != NO_FRAME; block = region->frames[block].next)
         {
-            for(size_t k = 0; k < (1UL << fshift); ++k)
+            address_t candidate = block + (-buddy_pfn(region, block) & align_mask);
+            if ((candidate < block + (1UL << order))
+                && (candidate + n_frames <= n_low_frames)
+                && (buddy_free_frames_at(region, candidate, n_frames) == n_frames))
             {
-                // Effectively, set only owner and frame_width. Frames are yet unused (neither mapped nor nailed).
-                state->ramtab->put(ridx + (j << fshift) + k, client_state->owner, state->frame_width, ramtab_v1::state_unused);
+                *first_frame = candidate;
+                return true;
             }
         }
     }
+    return false;
+#else
+    for (*first_frame = 0; *first_frame + n_frames <= n_low_frames; ++(*first_frame))
+    {
+        if (region->frames[*first_frame].free >= n_frames && is_aligned_to_frame_width(frame_address(region, *first_frame), align))
+            return true;
+    }
+    return false;
+#endif
+}
+
+/**
+ * @return number of consecutive free logical frames at @a first_frame, looking at no more than @a n_frames.
+ */
+static size_t free_frames_at(frames_module_v1::state_t* region, address_t first_frame, size_t n_frames)
+{
+#if FRAMES_BUDDY
+    return buddy_free_frames_at(region, first_frame, n_frames);
+#else
+    return std::min<size_t>(region->frames[first_frame].free, n_frames);
+#endif
 }
 
 /**
- * After allocation, update predecessors free frames info.
+ * Remove free frames from the free frames info.
  */
-static void alloc_update_free_predecessors(frames_module_v1::state_t* cur_state, address_t first_frame)
+static void take_free_frames(frames_module_v1::state_t* region, address_t first_frame, size_t n_frames)
 {
-    uint32_t start_free = cur_state->frames[first_frame].free;
+#if FRAMES_BUDDY
+    // Unlink every free block overlapping the frames and give back the parts of it outside of them.
+    address_t end = first_frame + n_frames;
+    while (first_frame < end)
+    {
+        address_t block = buddy_find_block(region, first_frame);
+        ASSERT(block != NO_FRAME);
+        address_t block_end = block + (1UL << (region->frames[block].free - 1));
+
+        buddy_unlink(region, block);
+        buddy_free_run(region, block, first_frame - block);
+        if (block_end > end)
+            buddy_free_run(region, end, block_end - end);
+
+        first_frame = block_end;
+    }
+#else
+    // Update predecessors free frames info.
+    uint32_t start_free = region->frames[first_frame].free;
     for (address_t i = first_frame; i != 0; )
     {
         --i;
-        if (cur_state->frames[i].free == 0)
+        if (region->frames[i].free == 0)
             break;
-        cur_state->frames[i].free -= start_free;
+        region->frames[i].free -= start_free;
+    }
+
+    for (size_t j = first_frame; j < (first_frame + n_frames); ++j)
+        region->frames[j].free = 0;
+#endif
+}
+
+/**
+ * Add frames back to the free frames info.
+ */
+static void return_free_frames(frames_module_v1::state_t* region, address_t first_frame, size_t n_frames)
+{
+#if FRAMES_BUDDY
+    buddy_free_run(region, first_frame, n_frames);
+#else
+    // Sort out the frames we're freeing from the back, so we can keep "free" counts consistent.
+    address_t end = first_frame + n_frames;
+    uint32_t end_free = (end == region->n_logical_frames) ? 0 : region->frames[end].free;
+    address_t i = end;
+
+    while (i > first_frame)
+        region->frames[--i].free = ++end_free;
+
+    // Now update all empty frames immediately before the first frame we've freed; hopefully this will not be
+    // too many since we alloc first fit.
+    while ((i > 0) && (region->frames[i - 1].free != 0))
+        region->frames[--i].free = ++end_free;
+#endif
+}
+
+/**
+ * Record the client as the owner of already taken frames, and whether it allowed them to be migrated.
+ */
+static void set_frames_owner(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* state, address_t first_frame, size_t n_frames, bool movable = false)
+{
+    for (address_t i = first_frame; i < first_frame + n_frames; ++i)
+        state->frames[i].movable = movable;
+
+    if (state->ramtab)
+    {
+        uint32_t ridx = state->start >> FRAME_WIDTH;
+        size_t fshift = state->frame_width - FRAME_WIDTH; /* frame_width >= FRAME_WIDTH */
+        // Effectively, set only owner and frame_width. Frames are yet unused (neither mapped nor nailed).
+        state->ramtab->put_range(ridx + (first_frame << fshift), n_frames << fshift, client_state->owner, state->frame_width, ramtab_v1::state_unused);
     }
 }
 
+static void mark_frames_used(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* state, address_t first_frame, size_t n_frames, bool movable = false)
+{
+    take_free_frames(state, first_frame, n_frames);
+    set_frames_owner(client_state, state, first_frame, n_frames, movable);
+}
+
 // FIXME: Lots of reinterpret casts suck, do something about it!
 
-static bool add_range_element(frame_allocator_v1::state_t* client_state, address_t start, size_t n_phys_frames, size_t frame_width)
+//======================================================================================================================
+// Per-client region tree
+//
+// Frames allocated to a client are recorded as disjoint ranges in a red-black tree keyed by start address, hanging
+// off the client's DCB. Adjacent ranges of the same frame width are merged, so the tree stays small, and finding the
+// range containing an address takes O(log n).
+//======================================================================================================================
+
+static inline address_t region_end(const memory_region_t* r)
+{
+    return r->start + (r->n_phys_frames << FRAME_WIDTH);
+}
+
+/**
+ * @return the range containing @a addr, or NULL if the client owns no frame at @a addr.
+ */
+static memory_region_t* region_tree_find(memory_region_tree_t* tree, address_t addr)
+{
+    memory_region_t* r = tree->root();
+    while (r)
+    {
+        if (addr < r->start)
+            r = r->left;
+        else if (addr >= region_end(r))
+            r = r->right;
+        else
+            return r;
+    }
+    return NULL;
+}
+
+/**
+ * @return the lowest range starting at or above @a addr, or NULL if there is none.
+ */
+static memory_region_t* region_tree_next(memory_region_tree_t* tree, address_t addr)
+{
+    memory_region_t* next = NULL;
+    memory_region_t* r = tree->root();
+    while (r)
+    {
+        if (r->start >= addr)
+        {
+            next = r;
+            r = r->left;
+        }
+        else
+            r = r->right;
+    }
+    return next;
+}
+
+static bool add_range_element(heap_v1::closure_t* heap, memory_region_tree_t* tree, address_t start, size_t n_phys_frames, size_t frame_width)
 {
-    region_list_t* new_entry = new(client_state->heap) region_list_t;
+    memory_region_t* new_entry = new(heap) memory_region_t;
     if (new_entry == NULL)
         return false;
 
@@ -159,59 +657,115 @@ static bool add_range_element(frame_allocator_v1::state_t* client_state, address
     new_entry->n_phys_frames = n_phys_frames;
     new_entry->frame_width = frame_width;
 
-    client_state->region_list->insert_after(*new_entry);
+    tree->insert(new_entry);
 
     return true;
 }
 
-static bool add_range(frame_allocator_v1::state_t* client_state, address_t start, size_t n_phys_frames, size_t frame_width)
+/**
+ * Record frames in @a tree, merging them with the adjacent ranges of the same frame width.
+ */
+static bool region_tree_add(heap_v1::closure_t* heap, memory_region_tree_t* tree, address_t start, size_t n_phys_frames, size_t frame_width)
 {
-    if (!client_state->heap || !client_state->region_list || !n_phys_frames)
+    address_t end = start + (n_phys_frames << FRAME_WIDTH);
+
+    memory_region_t* prev = start ? region_tree_find(tree, start - 1) : NULL;
+    memory_region_t* next = region_tree_next(tree, start);
+
+    if ((prev && (region_end(prev) > start)) || (next && (next->start < end)))
+    {
+        logger::warning() << __FUNCTION__ << ": range " << start << ".." << end << " is already recorded.";
+        return false;
+    }
+    if (next && (next->start != end))
+        next = NULL;
+
+    if (prev && (prev->frame_width != frame_width))
+        prev = NULL;
+    if (next && (next->frame_width != frame_width))
+        next = NULL;
+
+    if (prev && next)
+    {
+        logger::debug() << __FUNCTION__ << ": merging on both sides.";
+        tree->remove(next);
+        prev->n_phys_frames += n_phys_frames + next->n_phys_frames;
+        heap->free(reinterpret_cast<memory_v1::address>(next));
+        return true;
+    }
+    if (prev)
+    {
+        logger::debug() << __FUNCTION__ << ": merging on lhs.";
+        prev->n_phys_frames += n_phys_frames;
+        return true;
+    }
+    if (next)
+    {
+        // Nothing lies between the range and next, so moving next's key keeps the tree ordered.
+        logger::debug() << __FUNCTION__ << ": merging on rhs.";
+        next->start = start;
+        next->n_phys_frames += n_phys_frames;
         return true;
+    }
 
-    logger::trace() << __FUNCTION__ << ": " << n_phys_frames << " frames at " << start << " frame width " << frame_width;
+    logger::debug() << __FUNCTION__ << ": allocating new entry.";
+    return add_range_element(heap, tree, start, n_phys_frames, frame_width);
+}
+
+/**
+ * Remove frames from @a tree, splitting the range they are in if necessary.
+ * @return false if the frames are not all in one range of the tree.
+ */
+static bool region_tree_del(heap_v1::closure_t* heap, memory_region_tree_t* tree, address_t start, size_t n_phys_frames)
+{
     address_t end = start + (n_phys_frames << FRAME_WIDTH);
+    memory_region_t* entry = region_tree_find(tree, start);
+
+    if (!entry || (end > region_end(entry)))
+        return false;
+
+    address_t entry_end = region_end(entry);
 
-    if (client_state->region_list->is_empty())
+    if ((start == entry->start) && (end == entry_end))
+    {
+        tree->remove(entry);
+        heap->free(reinterpret_cast<memory_v1::address>(entry));
+    }
+    else if (start == entry->start)
+    {
+        entry->start = end;
+        entry->n_phys_frames -= n_phys_frames;
+    }
+    else if (end == entry_end)
     {
-        logger::trace() << __FUNCTION__ << ": region list is empty, allocating new entry";
-        return add_range_element(client_state, start, n_phys_frames, frame_width);
+        entry->n_phys_frames -= n_phys_frames;
     }
     else
     {
-        // Try to find the correct place to insert it.
-        region_list_t* link;
-        address_t current_start, current_end, next_start;
-        for (link = *client_state->region_list->next(); link != client_state->region_list; link = *link->next())
-        {
-            current_start = (*link)->start;
-            current_end = current_start + ((*link)->n_phys_frames << FRAME_WIDTH);
-            next_start = (*link->next())->start;
-            if ((start >= current_end) && (end <= next_start))
-                break;
-        }
-        
-        // We wrapped, no any elements before this one.
-        if (link == client_state->region_list)
-        {
-            // Check if we can merge on rhs
-            // FIXME: doesn't check frame_width??
-            if (end == next_start)
-            {
-                logger::debug() << __FUNCTION__ << ": no prior elements, merging on rhs.";
-                (*link->next())->n_phys_frames += n_phys_frames;
-                (*link->next())->start = start;
-                return true;
-            }
-            else
-            {
-                logger::debug() << __FUNCTION__ << ": no prior elements, allocating new entry.";
-                return add_range_element(client_state, start, n_phys_frames, frame_width);
-            }
-        }
-        PANIC("Unimplemented!");
+        // Insert the tail first, so that the entry is left whole if there is no memory for it.
+        if (!add_range_element(heap, tree, end, phys_frame_number(entry_end - end), entry->frame_width))
+            return false;
+        entry->n_phys_frames = phys_frame_number(start - entry->start);
     }
-    return false;
+    return true;
+}
+
+static bool add_range(frame_allocator_v1::state_t* client_state, address_t start, size_t n_phys_frames, size_t frame_width)
+{
+    if (!client_state->heap || !client_state->region_tree || !n_phys_frames)
+        return true;
+
+    logger::trace() << __FUNCTION__ << ": " << n_phys_frames << " frames at " << start << " frame width " << frame_width;
+    return region_tree_add(client_state->heap, client_state->region_tree, start, n_phys_frames, frame_width);
+}
+
+static bool del_range(frame_allocator_v1::state_t* client_state, address_t start, size_t n_phys_frames)
+{
+    if (!client_state->heap || !client_state->region_tree || !n_phys_frames)
+        return true;
+
+    logger::trace() << __FUNCTION__ << ": " << n_phys_frames << " frames at " << start;
+    return region_tree_del(client_state->heap, client_state->region_tree, start, n_phys_frames);
 }
 
 /*
@@ -221,111 +775,1009 @@ static bool add_range(frame_allocator_v1::state_t* client_state, address_t start
 */
 static frames_module_v1::state_t* get_region(frames_module_v1::state_t* state, address_t addr)
 {
-    frames_module_v1::state_t* ret = state;
+    frames_module_v1::state_t* ret = state;
+
+    while(ret)
+    {
+        if ((addr >= ret->start) && addr < (ret->start + (ret->n_logical_frames << ret->frame_width)))
+            break;
+        ret = ret->next;
+    }
+
+    return ret;
+}
+
+/**
+ * @return current VCPU cache of frames on @a node, or NULL if frames on @a node are not cached.
+ */
+static inline frames_cache_t* current_cache(frame_allocator_v1::state_t* client_state, uint32_t node)
+{
+    return (node < FRAMES_NODES) ? &client_state->caches->caches[node] : NULL;
+}
+
+/**
+ * Regions are tried in two passes. The first pass is over regions on the client's node, the second one over regions
+ * on other nodes if the policy is prefer. With the any policy all regions are tried in the first pass.
+ */
+#define FRAMES_POLICY_PASSES 2
+
+static inline bool region_in_pass(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* region, int pass)
+{
+    switch (client_state->policy)
+    {
+        case frame_allocator_v1::node_policy_any:
+            return pass == 0;
+        case frame_allocator_v1::node_policy_prefer:
+            return (pass == 0) == (region->node == client_state->node);
+        default:
+            return (pass == 0) && (region->node == client_state->node);
+    }
+}
+
+/**
+ * Only standard width frames from RAM regions are cached.
+ */
+static inline bool is_cacheable(frames_module_v1::state_t* region)
+{
+    return !region->attrs && region->ramtab && (region->frame_width == FRAME_WIDTH);
+}
+
+/**
+ * Take a batch of frames on @a node from the regions, preferably contiguous.
+ */
+static void refill_cache(frame_allocator_v1::state_t* client_state, frames_cache_t* cache, uint32_t node)
+{
+    frames_module_v1::state_t* region;
+    address_t first_frame;
+
+    for (region = client_state->module_state; region; region = region->next)
+    {
+        if (is_cacheable(region) && (region->node == node) && find_free_frames(region, FRAMES_CACHE_BATCH, FRAME_WIDTH, &first_frame))
+        {
+            take_free_frames(region, first_frame, FRAMES_CACHE_BATCH);
+            // Push in reverse, so frames are handed out in ascending address order.
+            for (size_t i = FRAMES_CACHE_BATCH; i > 0; --i)
+                cache->frames[cache->count++] = frame_address(region, first_frame + i - 1);
+            return;
+        }
+    }
+
+    for (region = client_state->module_state; region && (cache->count < FRAMES_CACHE_BATCH); region = region->next)
+    {
+        while (is_cacheable(region) && (region->node == node) && (cache->count < FRAMES_CACHE_BATCH) && find_free_frames(region, 1, FRAME_WIDTH, &first_frame))
+        {
+            take_free_frames(region, first_frame, 1);
+            cache->frames[cache->count++] = frame_address(region, first_frame);
+        }
+    }
+}
+
+/**
+ * Give @a n_frames coldest frames of the cache back to their regions.
+ */
+static void drain_cache(frame_allocator_v1::state_t* client_state, frames_cache_t* cache, size_t n_frames)
+{
+    for (size_t i = 0; i < n_frames; ++i)
+    {
+        frames_module_v1::state_t* region = get_region(client_state->module_state, cache->frames[i]);
+        return_free_frames(region, bytes_to_log_frames(cache->frames[i] - region->start, region->frame_width), 1);
+    }
+
+    cache->count -= n_frames;
+    for (size_t i = 0; i < cache->count; ++i)
+        cache->frames[i] = cache->frames[i + n_frames];
+}
+
+/**
+ * Give all cached and pre-zeroed frames back to their regions, so that they can be allocated as part of a larger range.
+ * @return true if any frames were cached.
+ */
+static bool drain_caches(frame_allocator_v1::state_t* client_state)
+{
+    frames_zero_pool_t* pool = client_state->zero_pool;
+    bool drained = (pool->count > 0);
+
+    for (size_t v = 0; v < FRAMES_VCPUS * FRAMES_NODES; ++v)
+    {
+        frames_cache_t* cache = &client_state->caches->caches[v];
+        drained = drained || (cache->count > 0);
+        drain_cache(client_state, cache, cache->count);
+    }
+
+    for (size_t i = 0; i < pool->count; ++i)
+    {
+        frames_module_v1::state_t* region = get_region(client_state->module_state, pool->frames[i]);
+        return_free_frames(region, bytes_to_log_frames(pool->frames[i] - region->start, region->frame_width), 1);
+    }
+    pool->count = 0;
+
+    return drained;
+}
+
+/**
+ * Allocate a single frame from the current VCPU cache for the client's node. The frame is taken from the region free
+ * frames info already.
+ */
+static frames_module_v1::state_t* alloc_cached(frame_allocator_v1::state_t* client_state, size_t n_physical_frames, uint32_t frame_width, address_t* first_log_frame, size_t* n_log_frames)
+{
+    if ((n_physical_frames != 1) || (frame_width != FRAME_WIDTH))
+        return NULL;
+
+    frames_cache_t* cache = current_cache(client_state, client_state->node);
+    if (!cache)
+        return NULL;
+
+    if (cache->count == 0)
+        refill_cache(client_state, cache, client_state->node);
+    if (cache->count == 0)
+        return NULL;
+
+    address_t addr = cache->frames[--cache->count];
+    frames_module_v1::state_t* region = get_region(client_state->module_state, addr);
+    *first_log_frame = bytes_to_log_frames(addr - region->start, region->frame_width);
+    *n_log_frames = 1;
+    return region;
+}
+
+/**
+ * Put a freed single frame to the hot end of the current VCPU cache for its node.
+ * @return false if the frames are not cacheable and should be returned to the region.
+ */
+static bool free_cached(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* region, address_t first_log_frame, size_t n_log_frames)
+{
+    frames_cache_t* cache = current_cache(client_state, region->node);
+    if ((n_log_frames != 1) || !is_cacheable(region) || !cache)
+        return false;
+
+    cache->frames[cache->count++] = frame_address(region, first_log_frame);
+    if (cache->count > FRAMES_CACHE_HIGH)
+        drain_cache(client_state, cache, FRAMES_CACHE_BATCH);
+    return true;
+}
+
+/**
+ * Reserve free 4 MiB extents until the large frame pool reaches its target size.
+ */
+static void fill_large_pool(frame_allocator_v1::state_t* client_state)
+{
+    frames_large_pool_t* pool = client_state->large_pool;
+    frames_module_v1::state_t* region = client_state->module_state;
+    address_t first_frame;
+
+    while (region && (pool->count < pool->target))
+    {
+        if (is_cacheable(region) && find_free_frames(region, FRAMES_LARGE_FRAMES, FRAMES_LARGE_WIDTH, &first_frame))
+        {
+            take_free_frames(region, first_frame, FRAMES_LARGE_FRAMES);
+            pool->extents[pool->count++] = frame_address(region, first_frame);
+        }
+        else
+            region = region->next;
+    }
+}
+
+/**
+ * Give reserved extent @a index back to its region.
+ */
+static void release_large_extent(frame_allocator_v1::state_t* client_state, size_t index)
+{
+    frames_large_pool_t* pool = client_state->large_pool;
+    frames_module_v1::state_t* region = get_region(client_state->module_state, pool->extents[index]);
+
+    return_free_frames(region, bytes_to_log_frames(pool->extents[index] - region->start, region->frame_width), FRAMES_LARGE_FRAMES);
+    pool->extents[index] = pool->extents[--pool->count];
+}
+
+/**
+ * Give back reserved extents overlapping physical range [start, end).
+ */
+static void release_large_extents(frame_allocator_v1::state_t* client_state, address_t start, address_t end)
+{
+    frames_large_pool_t* pool = client_state->large_pool;
+
+    for (size_t i = 0; i < pool->count; )
+    {
+        if ((pool->extents[i] < end) && (pool->extents[i] + (FRAMES_LARGE_FRAMES << FRAME_WIDTH) > start))
+            release_large_extent(client_state, i);
+        else
+            ++i;
+    }
+}
+
+/**
+ * Give cached frames back to the regions, or failing that break up a reserved extent.
+ * @return true if any frames were given back.
+ */
+static bool reclaim_frames(frame_allocator_v1::state_t* client_state)
+{
+    if (drain_caches(client_state))
+        return true;
+
+    if (client_state->large_pool->count == 0)
+        return false;
+
+    logger::debug() << "frames_mod: memory is short, breaking up a reserved 4MiB extent";
+    release_large_extent(client_state, client_state->large_pool->count - 1);
+    return true;
+}
+
+/**
+ * Allocate a reserved 4 MiB extent for a request of exactly that size and alignment.
+ * The frames are taken from the region free frames info already.
+ */
+static frames_module_v1::state_t* alloc_large(frame_allocator_v1::state_t* client_state, size_t n_physical_frames, uint32_t frame_width, address_t* first_log_frame, size_t* n_log_frames)
+{
+    frames_large_pool_t* pool = client_state->large_pool;
+
+    if ((n_physical_frames != FRAMES_LARGE_FRAMES) || (frame_width != FRAMES_LARGE_WIDTH) || (pool->count == 0))
+        return NULL;
+
+    // Prefer an extent on the client's node, a strict client takes nothing else.
+    frames_module_v1::state_t* region = NULL;
+    size_t i;
+    for (i = pool->count; i > 0; --i)
+    {
+        region = get_region(client_state->module_state, pool->extents[i - 1]);
+        if (region->node == client_state->node)
+            break;
+    }
+    if (i == 0)
+    {
+        if (client_state->policy == frame_allocator_v1::node_policy_strict)
+            return NULL;
+        i = pool->count;
+        region = get_region(client_state->module_state, pool->extents[i - 1]);
+    }
+
+    address_t addr = pool->extents[i - 1];
+    pool->extents[i - 1] = pool->extents[--pool->count];
+    *first_log_frame = bytes_to_log_frames(addr - region->start, region->frame_width);
+    *n_log_frames = FRAMES_LARGE_FRAMES;
+    return region;
+}
+
+/**
+ * Put a freed 4 MiB extent back into the large frame pool, if it is not full.
+ * @return false if the frames should be returned to the region.
+ */
+static bool free_large(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* region, address_t first_log_frame, size_t n_log_frames)
+{
+    frames_large_pool_t* pool = client_state->large_pool;
+    address_t addr = frame_address(region, first_log_frame);
+
+    if ((n_log_frames != FRAMES_LARGE_FRAMES) || !is_cacheable(region) || !is_aligned_to_frame_width(addr, FRAMES_LARGE_WIDTH)
+        || (pool->count >= pool->target))
+        return false;
+
+    pool->extents[pool->count++] = addr;
+    return true;
+}
+
+static inline void zero_frames(address_t start, size_t n_physical_frames)
+{
+    memutils::clear_memory_dwords(reinterpret_cast<void*>(start), n_physical_frames << FRAME_WIDTH);
+}
+
+/**
+ * Allocate zero filled frames, from the pool of pre-zeroed frames if possible.
+ * @a taken is set if the frames are taken from the region free frames info already.
+ */
+static frames_module_v1::state_t* alloc_zeroed(frame_allocator_v1::state_t* client_state, size_t n_physical_frames, uint32_t frame_width, address_t* first_log_frame, size_t* n_log_frames, bool* taken)
+{
+    frames_zero_pool_t* pool = client_state->zero_pool;
+    frames_module_v1::state_t* region;
+
+    if ((n_physical_frames == 1) && (frame_width == FRAME_WIDTH) && (pool->count > 0))
+    {
+        address_t addr = pool->frames[pool->count - 1];
+        region = get_region(client_state->module_state, addr);
+        if ((client_state->policy != frame_allocator_v1::node_policy_strict) || (region->node == client_state->node))
+        {
+            --pool->count;
+            *first_log_frame = bytes_to_log_frames(addr - region->start, region->frame_width);
+            *n_log_frames = 1;
+            *taken = true;
+            return region;
+        }
+    }
+
+    // Zero the frames now, they must be directly mapped for that.
+    for (int pass = 0; pass < FRAMES_POLICY_PASSES; ++pass)
+    {
+        for (region = client_state->module_state; region; region = region->next)
+        {
+            if (region->attrs || (region->frame_width != FRAME_WIDTH) || !region_in_pass(client_state, region, pass))
+                continue;
+
+            if (find_low_free_frames(region, n_physical_frames, frame_width, pool->direct_end, first_log_frame))
+            {
+                zero_frames(frame_address(region, *first_log_frame), n_physical_frames);
+                *n_log_frames = n_physical_frames;
+                *taken = false;
+                return region;
+            }
+        }
+    }
+
+    if (reclaim_frames(client_state))
+        return alloc_zeroed(client_state, n_physical_frames, frame_width, first_log_frame, n_log_frames, taken);
+
+    return NULL;
+}
+
+/**
+ * Zero up to @a max_frames free frames into the pool of pre-zeroed frames, the coldest cached ones first.
+ * Takes the frames lock, but lets go of it while a frame is being zeroed.
+ * @return number of frames added to the pool.
+ */
+static uint32_t scrub_frames(frame_allocator_v1::state_t* client_state, uint32_t max_frames)
+{
+    frames_zero_pool_t* pool = client_state->zero_pool;
+    frames_cache_t* cache = current_cache(client_state, client_state->node);
+    uint32_t n_scrubbed = 0;
+
+    while (n_scrubbed < max_frames)
+    {
+        address_t addr = NO_ADDRESS;
+
+        {
+            lockable_scope_lock_t lock(client_state->caches->lock);
+            if (pool->count >= FRAMES_ZERO_POOL_SIZE)
+                break;
+
+            // Prefer the coldest cached frames, they are the least likely to be reused soon.
+            for (size_t i = 0; cache && (i < cache->count); ++i)
+            {
+                if (cache->frames[i] < pool->direct_end)
+                {
+                    addr = cache->frames[i];
+                    --cache->count;
+                    for (; i < cache->count; ++i)
+                        cache->frames[i] = cache->frames[i + 1];
+                    break;
+                }
+            }
+
+            for (frames_module_v1::state_t* region = client_state->module_state; region && (addr == NO_ADDRESS); region = region->next)
+            {
+                address_t first_frame;
+                if (is_cacheable(region) && find_low_free_frames(region, 1, FRAME_WIDTH, pool->direct_end, &first_frame))
+                {
+                    take_free_frames(region, first_frame, 1);
+                    addr = frame_address(region, first_frame);
+                }
+            }
+        }
+
+        if (addr == NO_ADDRESS)
+            break;
+
+        // The frame is taken, nobody else hands it out meanwhile.
+        zero_frames(addr, 1);
+
+        lockable_scope_lock_t lock(client_state->caches->lock);
+        if (pool->count >= FRAMES_ZERO_POOL_SIZE)
+        {
+            frames_module_v1::state_t* region = get_region(client_state->module_state, addr);
+            return_free_frames(region, bytes_to_log_frames(addr - region->start, region->frame_width), 1);
+            break;
+        }
+        pool->frames[pool->count++] = addr;
+        ++n_scrubbed;
+    }
+
+    return n_scrubbed;
+}
+
+static frames_module_v1::state_t* alloc_any(frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t align, address_t* first_log_frame, size_t* n_log_frames)
+{
+    frame_allocator_v1::state_t* client_state = self->d_state;
+    frames_module_v1::state_t* state = client_state->module_state;
+
+    logger::debug() << __FUNCTION__ << ": requested " << n_physical_frames << " frames.";
+
+    // The client's node first, then the others if the policy allows.
+    for (int pass = 0; pass < FRAMES_POLICY_PASSES; ++pass)
+    {
+        for (frames_module_v1::state_t* cur_state = state; cur_state; cur_state = cur_state->next)
+        {
+            if (cur_state->attrs || !region_in_pass(client_state, cur_state, pass))
+                continue;
+
+            *n_log_frames = n_physical_frames >> (cur_state->frame_width - FRAME_WIDTH);
+
+            if (*n_log_frames != n_physical_frames)
+            {
+                PANIC("Region with non-standard frame width! Unsupported.");
+            }
+
+            if (find_free_frames(cur_state, *n_log_frames, align, first_log_frame))
+                return cur_state;
+        }
+    }
+
+    // Cached or reserved frames may be just what is needed to satisfy the request, give them back and retry.
+    if (reclaim_frames(client_state))
+        return alloc_any(self, n_physical_frames, align, first_log_frame, n_log_frames);
+
+    return NULL; // out of physical memory
+}
+
+static frames_module_v1::state_t* alloc_any(system_frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t align, address_t* first_log_frame, size_t* n_log_frames)
+{
+    return alloc_any(reinterpret_cast<frame_allocator_v1::closure_t*>(self), n_physical_frames, align, first_log_frame, n_log_frames);
+}
+
+static frames_module_v1::state_t* alloc_range(frame_allocator_v1::closure_t* self, size_t n_physical_frames, address_t start, address_t* first_log_frame, size_t* n_log_frames)
+{
+    frame_allocator_v1::state_t* client_state = self->d_state;
+    frames_module_v1::state_t* state = client_state->module_state;
+    frames_module_v1::state_t* cur_state = state;
+    uint32_t fshift;
+
+    if ((cur_state = get_region(state, start)) == NULL)
+    {
+        logger::warning() << "alloc_range: we don't own requested address " << start;
+        PANIC("frames_mod");
+    }
+
+    /*
+     * Translate from n_physical_frames (i.e. frames of size FRAME_SIZE) required
+     * into *n_log_frames = number of logical frames required (i.e. frames of size 1 << cur_state->frame_width).
+     */
+    // FIXME: on ARM, the allocation frame width may be smaller than FRAME_WIDTH (e.g. with 1K pages)
+    fshift = cur_state->frame_width - FRAME_WIDTH; /* >= 0 */
+    *n_log_frames = align_to_frame_width(n_physical_frames, fshift) >> fshift; //bytes_to_log_frames, actually, too?
+    *first_log_frame = bytes_to_log_frames(start - cur_state->start, cur_state->frame_width);
+
+    size_t n_free = free_frames_at(cur_state, *first_log_frame, *n_log_frames);
+    if (n_free < *n_log_frames)
+    {
+        /* not enough space at requested address: give as much as possible */
+        kconsole << "alloc_range: less than " << int(*n_log_frames << cur_state->frame_width) << " bytes free at requested address " << start;
+        *n_log_frames = n_free;
+        kconsole << ", returning as much as available - " << int(*n_log_frames << cur_state->frame_width) << endl;
+        return cur_state;
+    }
+
+    int bytes = int(*n_log_frames << cur_state->frame_width);
+    logger::debug() << "alloc_range: allocated " << bytes << " bytes at requested address " << start << "->" << start + bytes;
+    return cur_state;
+}
+
+static frames_module_v1::state_t* alloc_range(system_frame_allocator_v1::closure_t* self, size_t n_frames, address_t start, address_t* first_log_frame, size_t* n_log_frames)
+{
+    return alloc_range(reinterpret_cast<frame_allocator_v1::closure_t*>(self), n_frames, start, first_log_frame, n_log_frames);
+}
+
+/**
+ * Replace frame @a from with frame @a to in the tree of frame regions allocated for @a domain.
+ */
+static bool move_owned_frame(frame_allocator_v1::state_t* client_state, dcb_ro_t* domain, address_t from, address_t to)
+{
+    return region_tree_del(client_state->heap, &domain->memory_regions, from, 1)
+        && region_tree_add(client_state->heap, &domain->memory_regions, to, 1, FRAME_WIDTH);
+}
+
+/**
+ * Move the contents of mapped frame @a from_frame to a free frame outside of its extent, whose free frames must be
+ * taken already, and make all pages mapped onto it map onto the new frame. The frame must be movable: its owner
+ * only reaches it through the page mappings changed here.
+ */
+static bool migrate_frame(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* region, address_t from_frame)
+{
+    frames_module_v1::state_t* to_region;
+    address_t to_frame;
+
+    for (to_region = client_state->module_state; to_region; to_region = to_region->next)
+    {
+        if (is_cacheable(to_region) && find_low_free_frames(to_region, 1, FRAME_WIDTH, client_state->zero_pool->direct_end, &to_frame))
+            break;
+    }
+    if (!to_region)
+        return false;
+
+    address_t from = frame_address(region, from_frame);
+    address_t to = frame_address(to_region, to_frame);
+    uint32_t frame_width;
+    ramtab_v1::state st;
+    uint32_t owner = region->ramtab->get(phys_frame_number(from), &frame_width, &st);
+
+    take_free_frames(to_region, to_frame, 1);
+
+    // Stores made while the frame is copied would be lost, so write access to it is taken away first
+    // and only given back by remapping the pages onto the copy.
+    if (client_state->mmu->protect_frame(from) == 0)
+    {
+        return_free_frames(to_region, to_frame, 1);
+        return false;
+    }
+
+    memutils::copy_memory(to, from, PAGE_SIZE);
+
+    // The owner's region tree lives on the heap, so the frames lock is let go meanwhile. Both frames are taken,
+    // nothing else hands them out in between.
+    client_state->caches->lock.unlock();
+    bool moved = move_owned_frame(client_state, reinterpret_cast<dcb_ro_t*>(owner), from, to);
+    client_state->caches->lock.lock();
+
+    if (!moved)
+    {
+        client_state->mmu->remap_frame(from, from);
+        return_free_frames(to_region, to_frame, 1);
+        return false;
+    }
+
+    client_state->mmu->remap_frame(from, to);
+
+    to_region->frames[to_frame].movable = true;
+    region->frames[from_frame].movable = false;
+    to_region->ramtab->put(phys_frame_number(to), owner, FRAME_WIDTH, ramtab_v1::state_mapped);
+    region->ramtab->put(phys_frame_number(from), OWNER_NONE, FRAME_WIDTH, ramtab_v1::state_unused);
+    return true;
+}
+
+/**
+ * Count frames which have to be migrated to free the 4 MiB extent at @a first_frame.
+ * Only frames which client domains allocated with the movable attribute and have mapped can be migrated. Anybody
+ * else may hold on to the physical address of a frame, e.g. for DMA or in a page table, and would not notice it move.
+ * @return number of frames to migrate, or NO_FRAME if the extent cannot be freed.
+ */
+static size_t count_movable_frames(frames_module_v1::state_t* region, address_t first_frame)
+{
+    size_t n_movable = 0;
+    address_t end = first_frame + FRAMES_LARGE_FRAMES;
+    uint32_t ridx = region->start >> FRAME_WIDTH;
+
+    for (address_t frame = first_frame; frame < end; )
+    {
+        uint32_t frame_width, n_same;
+        ramtab_v1::state st;
+        uint32_t owner = region->ramtab->get_range(ridx + frame, end - frame, &frame_width, &st, &n_same);
+
+        if (n_same == 0)
+            return NO_FRAME;
+
+        if (owner == OWNER_NONE)
+        {
+            // Unowned frames may still be reserved in the large frame pool.
+            if (free_frames_at(region, frame, n_same) != n_same)
+                return NO_FRAME;
+        }
+        else if ((owner != OWNER_SYSTEM) && (st == ramtab_v1::state_mapped) && (frame_width == FRAME_WIDTH))
+        {
+            for (address_t i = frame; i < frame + n_same; ++i)
+            {
+                if (!region->frames[i].movable)
+                    return NO_FRAME;
+            }
+            n_movable += n_same;
+        }
+        else
+            return NO_FRAME;
+
+        frame += n_same;
+    }
+
+    return n_movable;
+}
+
+/**
+ * Migrate all used frames out of the 4 MiB extent at @a first_frame, leaving the whole extent taken.
+ * count_movable_frames() must have found them all movable.
+ */
+static bool evacuate_extent(frame_allocator_v1::state_t* client_state, frames_module_v1::state_t* region, address_t first_frame)
+{
+    address_t end = first_frame + FRAMES_LARGE_FRAMES;
+    uint32_t ridx = region->start >> FRAME_WIDTH;
+    address_t frame;
+
+    // Take the free frames first, so that they are not chosen as migration targets.
+    for (frame = first_frame; frame < end; )
+    {
+        size_t n_free = free_frames_at(region, frame, end - frame);
+        if (n_free > 0)
+        {
+            take_free_frames(region, frame, n_free);
+            frame += n_free;
+        }
+        else
+            ++frame;
+    }
+
+    for (frame = first_frame; frame < end; ++frame)
+    {
+        uint32_t frame_width;
+        ramtab_v1::state st;
+        if ((region->ramtab->get(ridx + frame, &frame_width, &st) != OWNER_NONE) && !migrate_frame(client_state, region, frame))
+            break;
+    }
+
+    if (frame == end)
+        return true;
+
+    // Give back whatever is unowned now.
+    for (frame = first_frame; frame < end; )
+    {
+        uint32_t frame_width, n_same;
+        ramtab_v1::state st;
+        if (region->ramtab->get_range(ridx + frame, end - frame, &frame_width, &st, &n_same) == OWNER_NONE)
+            return_free_frames(region, frame, n_same);
+        frame += std::max<size_t>(n_same, 1);
+    }
+    return false;
+}
+
+/**
+ * Fill the large frame pool up to its target, migrating no more than @a max_frames mapped frames out of partly used
+ * extents.
+ * @return number of extents added to the pool.
+ */
+static uint32_t compact_frames(frame_allocator_v1::state_t* client_state, uint32_t max_frames)
+{
+    frames_large_pool_t* pool = client_state->large_pool;
+    size_t initial_count = pool->count;
+    uint32_t n_migrated = 0;
+
+    // Cached frames look used in the free frames info, give them back first.
+    drain_caches(client_state);
+    fill_large_pool(client_state);
+
+    while (pool->count < pool->target)
+    {
+        // Pick the extent needing the fewest migrations. Frames are copied through the one-to-one mapping,
+        // so the extent must lie within it.
+        frames_module_v1::state_t* best_region = NULL;
+        address_t best_frame = 0;
+        size_t best_movable = NO_FRAME;
+
+        for (frames_module_v1::state_t* region = client_state->module_state; region; region = region->next)
+        {
+            if (!is_cacheable(region))
+                continue;
+
+            for (address_t frame = bytes_to_log_frames(align_up(region->start, 1UL << FRAMES_LARGE_WIDTH) - region->start, FRAME_WIDTH);
+                 (frame + FRAMES_LARGE_FRAMES <= region->n_logical_frames) && (frame_address(region, frame + FRAMES_LARGE_FRAMES) <= client_state->zero_pool->direct_end);
+                 frame += FRAMES_LARGE_FRAMES)
+            {
+                size_t n_movable = count_movable_frames(region, frame);
+                if (n_movable < best_movable)
+                {
+                    best_region = region;
+                    best_frame = frame;
+                    best_movable = n_movable;
+                }
+            }
+        }
+
+        if (!best_region || (n_migrated + best_movable > max_frames))
+            break;
+
+        if (!evacuate_extent(client_state, best_region, best_frame))
+        {
+            logger::warning() << __FUNCTION__ << ": failed to migrate frames out of extent at " << frame_address(best_region, best_frame);
+            break;
+        }
+
+        n_migrated += best_movable;
+        pool->extents[pool->count++] = frame_address(best_region, best_frame);
+    }
+
+    logger::debug() << __FUNCTION__ << ": migrated " << n_migrated << " frames, " << pool->count << " of " << pool->target << " 4MiB extents reserved.";
+    return pool->count - initial_count;
+}
+
+/**
+ * Allocate frames at any address, from the pool matching @a attr if possible.
+ * @param[out] taken Set if the frames have been taken from the region free frames info already.
+ */
+static frames_module_v1::state_t* alloc_anywhere(frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t frame_width, memory_v1::attrs attr, address_t* first_log_frame, size_t* n_log_frames, bool* taken)
+{
+    frame_allocator_v1::state_t* client_state = self->d_state;
+    frames_module_v1::state_t* region;
+
+    if (attr == memory_v1::attrs_zeroed)
+        return alloc_zeroed(client_state, n_physical_frames, frame_width, first_log_frame, n_log_frames, taken);
+
+    region = alloc_large(client_state, n_physical_frames, frame_width, first_log_frame, n_log_frames);
+    if (!region)
+        region = alloc_cached(client_state, n_physical_frames, frame_width, first_log_frame, n_log_frames);
+    *taken = (region != NULL);
+    if (!region)
+        region = alloc_any(self, n_physical_frames, frame_width, first_log_frame, n_log_frames);
+
+    // A large frame may still be put together by moving a few frames out of the way.
+    if (!region && (n_physical_frames == FRAMES_LARGE_FRAMES) && (frame_width == FRAMES_LARGE_WIDTH)
+        && compact_frames(client_state, FRAMES_COMPACT_BUDGET))
+    {
+        region = alloc_large(client_state, n_physical_frames, frame_width, first_log_frame, n_log_frames);
+        *taken = (region != NULL);
+    }
+    return region;
+}
+
+//======================================================================================================================
+// Revocation of optimistic frames
+//======================================================================================================================
+
+/**
+ * Take back a single frame from @a victim without its cooperation, unmapping it first if @a unmap is set.
+ * Nailed frames and frames allocated with a larger frame width are left alone.
+ * Takes the frames lock, the victim's region tree is updated without it.
+ */
+static bool reclaim_owned_frame(frame_allocator_v1::state_t* victim, address_t addr, bool unmap)
+{
+    frames_module_v1::state_t* region = get_region(victim->module_state, addr);
+    if (!region || !region->ramtab || (region->frame_width != FRAME_WIDTH))
+        return false;
+
+    {
+        lockable_scope_lock_t lock(victim->caches->lock);
+        uint32_t frame_width;
+        ramtab_v1::state st;
+        uint32_t owner = region->ramtab->get(phys_frame_number(addr), &frame_width, &st);
+        if ((owner != victim->owner) || (frame_width != FRAME_WIDTH) || (st == ramtab_v1::state_nailed))
+            return false;
+
+        if (st == ramtab_v1::state_mapped)
+        {
+            if (!unmap || !victim->mmu)
+                return false;
+            victim->mmu->unmap_frame(addr);
+        }
+    }
+
+    if (!del_range(victim, addr, 1))
+        return false;
+
+    lockable_scope_lock_t lock(victim->caches->lock);
+    return_free_frames(region, bytes_to_log_frames(addr - region->start, FRAME_WIDTH), 1);
+    region->ramtab->put(phys_frame_number(addr), OWNER_NONE, FRAME_WIDTH, ramtab_v1::state_unused);
+    --victim->n_allocated_phys_frames;
+    return true;
+}
+
+/**
+ * Reclaim up to @a n_frames frames of @a victim, unused ones first, then mapped ones.
+ * @return number of frames reclaimed.
+ */
+static size_t force_reclaim(frame_allocator_v1::state_t* victim, size_t n_frames)
+{
+    size_t n_reclaimed = 0;
+
+    if (!victim->region_tree)
+        return 0;
+
+    for (int unmap = 0; (unmap < 2) && (n_reclaimed < n_frames); ++unmap)
+    {
+        // Reclaiming frames splits and frees tree entries, so only the bounds of a run are taken from the tree,
+        // and the next run is looked up past its end.
+        address_t addr = 0;
+        memory_region_t* entry;
+        while ((n_reclaimed < n_frames) && ((entry = region_tree_next(victim->region_tree, addr)) != NULL))
+        {
+            address_t end = region_end(entry);
+            for (addr = entry->start; (addr != end) && (n_reclaimed < n_frames); addr += PAGE_SIZE)
+            {
+                if (reclaim_owned_frame(victim, addr, unmap))
+                    ++n_reclaimed;
+            }
+            if (end == 0)
+                break; // the run reaches the end of the address space
+            addr = end;
+        }
+    }
+    return n_reclaimed;
+}
+
+static inline size_t optimistic_frames(frame_allocator_v1::state_t* client_state)
+{
+    if (client_state->n_allocated_phys_frames <= client_state->guaranteed_frames)
+        return 0;
+    return client_state->n_allocated_phys_frames - client_state->guaranteed_frames;
+}
+
+/**
+ * @return true if any client still holds frames revoked for @a revoker. Takes the frames lock.
+ */
+static bool revocation_outstanding(frame_allocator_v1::state_t* revoker)
+{
+    lockable_scope_lock_t lock(revoker->caches->lock);
 
-    while(ret)
+    for (frame_allocator_v1::state_t* c = revoker->clients->head; c; c = c->next_client)
     {
-        if ((addr >= ret->start) && addr < (ret->start + (ret->n_logical_frames << ret->frame_width)))
-            break;
-        ret = ret->next;
+        if ((c->revoker == revoker) && (c->n_allocated_phys_frames > c->revoke_target))
+            return true;
     }
-
-    return ret;
+    return false;
 }
 
-inline address_t frame_address(frames_module_v1::state_t* cur_state, address_t frame_index)
+/**
+ * Create the event count victims advance when they have given up frames revoked for @a client_state.
+ * Events are allocated on the heap, so this is done outside of the frames lock.
+ */
+static void create_freed_event(frame_allocator_v1::state_t* client_state)
 {
-    return cur_state->start + (frame_index << cur_state->frame_width);
+    event_v1::count ec = PVS(events)->create();
+    bool raced;
+    {
+        lockable_scope_lock_t lock(client_state->caches->lock);
+        raced = (client_state->freed_events != NULL);
+        if (!raced)
+        {
+            client_state->freed_notify = ec;
+            client_state->freed_events = PVS(events);
+        }
+    }
+    // Another thread of the client revoked at the same time.
+    if (raced)
+        PVS(events)->destroy(ec);
 }
 
-static frames_module_v1::state_t* alloc_any(frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t align, address_t* first_log_frame, size_t* n_log_frames)
+/**
+ * Make room for an allocation of @a n_frames frames within the guarantee of @a client_state, by revoking optimistic
+ * frames of other clients. Clients are notified and given FRAMES_REVOKE_TIMEOUT to free the frames themselves,
+ * what is left after that is reclaimed forcibly.
+ * @return number of frames which have been given up.
+ */
+static size_t revoke_frames(frame_allocator_v1::state_t* client_state, size_t n_frames)
 {
-    frame_allocator_v1::state_t* client_state = self->d_state;
-    frames_module_v1::state_t* state = client_state->module_state;
-    frames_module_v1::state_t* cur_state = state;
+    frames_clients_t* clients = client_state->clients;
+    size_t n_asked = 0;
 
-    logger::debug() << __FUNCTION__ << ": requested " << n_physical_frames << " frames.";
+    // Without a thread scheduler running yet there is no way to wait, so go ahead and reclaim at once.
+    bool can_wait = INFO_PAGE.pervasives && PVS(events) && PVS(time);
+    if (can_wait && !client_state->freed_events)
+        create_freed_event(client_state);
+
+    lockable_t& lock = client_state->caches->lock;
+    lock.lock();
 
-    while (cur_state)
+    // Biggest optimists first.
+    while (n_asked < n_frames)
     {
-        if (!cur_state->attrs)
+        frame_allocator_v1::state_t* victim = NULL;
+        for (frame_allocator_v1::state_t* c = clients->head; c; c = c->next_client)
         {
-            *n_log_frames = n_physical_frames >> (cur_state->frame_width - FRAME_WIDTH);
+            if ((c != client_state) && !c->revoker && optimistic_frames(c)
+                && (!victim || (optimistic_frames(c) > optimistic_frames(victim))))
+                victim = c;
+        }
+        if (!victim)
+            break;
 
-            if (*n_log_frames != n_physical_frames)
-            {
-                PANIC("Region with non-standard frame width! Unsupported.");
-            }
+        size_t n = std::min(optimistic_frames(victim), n_frames - n_asked);
+        victim->revoker = client_state;
+        victim->revoke_asked = n;
+        victim->revoke_target = victim->n_allocated_phys_frames - n;
+        n_asked += n;
+    }
 
-            // We need at least n_physical_frames contiguous frames starting aligned to "align"
-            for (*first_log_frame = 0; *first_log_frame < cur_state->n_logical_frames; ++(*first_log_frame))
-            {
-                if (cur_state->frames[*first_log_frame].free >= *n_log_frames && is_aligned_to_frame_width(frame_address(cur_state, *first_log_frame), align))
-                    return cur_state;
-            }
+    if (n_asked == 0)
+    {
+        lock.unlock();
+        return 0;
+    }
+
+    // Notifying a victim may run its threads, which must not find the frames lock taken.
+    for (frame_allocator_v1::state_t* c = clients->head; c; c = c->next_client)
+    {
+        if (c->revoker != client_state)
+            continue;
+
+        events_v1::closure_t* events = c->revoke_events;
+        event_v1::count notify = c->revoke_notify;
+        size_t n = c->revoke_asked;
+        lock.unlock();
+        logger::info() << __FUNCTION__ << ": revoking " << n << " frames from client " << c->owner;
+        if (events)
+            events->advance(notify, 1);
+        lock.lock();
+    }
+
+    lock.unlock();
+
+    // Wait for the victims to comply. The count is read before checking on them, so that no advance is missed.
+    if (can_wait)
+    {
+        time_v1::time deadline = NOW() + FRAMES_REVOKE_TIMEOUT;
+        event_v1::value seen = client_state->freed_events->read(client_state->freed_notify);
+        while (revocation_outstanding(client_state) && (NOW() < deadline))
+            seen = client_state->freed_events->await_until(client_state->freed_notify, seen + 1, deadline);
+    }
+
+    lock.lock();
+
+    size_t n_revoked = 0;
+    for (frame_allocator_v1::state_t* c = clients->head; c; c = c->next_client)
+    {
+        if (c->revoker != client_state)
+            continue;
+
+        if (c->n_allocated_phys_frames > c->revoke_target)
+        {
+            // Reclaiming changes the victim's region tree on the heap.
+            size_t n_outstanding = c->n_allocated_phys_frames - c->revoke_target;
+            lock.unlock();
+            size_t n_reclaimed = force_reclaim(c, n_outstanding);
+            logger::warning() << __FUNCTION__ << ": client " << c->owner << " did not free " << n_outstanding << " frames in time, reclaimed " << n_reclaimed;
+            lock.lock();
         }
-        cur_state = cur_state->next;
+
+        size_t n_before = c->revoke_target + c->revoke_asked;
+        if (n_before > c->n_allocated_phys_frames)
+            n_revoked += n_before - c->n_allocated_phys_frames;
+        c->revoke_target = NO_REVOCATION;
+        c->revoke_asked = 0;
+        c->revoker = NULL;
     }
 
-    return NULL; // out of physical memory
-}
+    lock.unlock();
 
-static frames_module_v1::state_t* alloc_any(system_frame_allocator_v1::closure_t* self, size_t n_physical_frames, uint32_t align, address_t* first_log_frame, size_t* n_log_frames)
-{
-    return alloc_any(reinterpret_cast<frame_allocator_v1::closure_t*>(self), n_physical_frames, align, first_log_frame, n_log_frames);
+    logger::debug() << __FUNCTION__ << ": " << n_revoked << " frames revoked for client " << client_state->owner;
+    return n_revoked;
 }
 
-static frames_module_v1::state_t* alloc_range(frame_allocator_v1::closure_t* self, size_t n_physical_frames, address_t start, address_t* first_log_frame, size_t* n_log_frames)
+//======================================================================================================================
+// system_frame_allocator_v1 implementation
+//======================================================================================================================
+
+/**
+ * Take frames for a @a bytes long allocation, at @a start unless it is unaligned, and account them to the client.
+ * @a frame_width and @a n_phys_frames are rounded up if the frames come from a region with wider frames.
+ * Takes the frames lock.
+ * @return start address of the frames, or NO_ADDRESS if there are none free.
+ */
+static address_t take_frames(frame_allocator_v1::closure_t* self, memory_v1::size bytes, memory_v1::address start, memory_v1::attrs attr, size_t* n_phys_frames, uint32_t* frame_width)
 {
     frame_allocator_v1::state_t* client_state = self->d_state;
-    frames_module_v1::state_t* state = client_state->module_state;
-    frames_module_v1::state_t* cur_state = state;
-    uint32_t fshift;
+    frames_module_v1::state_t* cur_state;
+    address_t first_frame;
+    size_t n_frames;
+    bool taken = false;
 
-    if ((cur_state = get_region(state, start)) == NULL)
+    lockable_scope_lock_t lock(client_state->caches->lock);
+
+    if (unaligned(start))
     {
-        logger::warning() << "alloc_range: we don't own requested address " << start;
-        PANIC("frames_mod");
+        cur_state = alloc_anywhere(self, *n_phys_frames, *frame_width, attr, &first_frame, &n_frames, &taken);
+    }
+    else
+    {
+        // Requested frames may be cached or reserved.
+        drain_caches(client_state);
+        release_large_extents(client_state, start, start + (*n_phys_frames << FRAME_WIDTH));
+        cur_state = alloc_range(self, *n_phys_frames, start, &first_frame, &n_frames);
     }
 
+    if (!cur_state)
+        return NO_ADDRESS;
+
     /*
-     * Translate from n_physical_frames (i.e. frames of size FRAME_SIZE) required
-     * into *n_log_frames = number of logical frames required (i.e. frames of size 1 << cur_state->frame_width).
+     * Check if our requested frame width has been rounded up;
+     * this can only happen if we've allocated from a non-standard
+     * region with a default logical frame width greater than our
+     * requested one.
      */
-    // FIXME: on ARM, the allocation frame width may be smaller than FRAME_WIDTH (e.g. with 1K pages)
-    fshift = cur_state->frame_width - FRAME_WIDTH; /* >= 0 */
-    *n_log_frames = align_to_frame_width(n_physical_frames, fshift) >> fshift; //bytes_to_log_frames, actually, too?
-    *first_log_frame = bytes_to_log_frames(start - cur_state->start, cur_state->frame_width);
-
-    if (cur_state->frames[*first_log_frame].free < *n_log_frames)
+    if (cur_state->frame_width > *frame_width)
     {
-        /* not enough space at requested address: give as much as possible */
-        kconsole << "alloc_range: less than " << int(*n_log_frames << cur_state->frame_width) << " bytes free at requested address " << start;
-        *n_log_frames = cur_state->frames[*first_log_frame].free;
-        kconsole << ", returning as much as available - " << int(*n_log_frames << cur_state->frame_width) << endl;
-        return cur_state;
+        *frame_width  = cur_state->frame_width;
+        *n_phys_frames = align_to_frame_width(bytes, *frame_width) >> FRAME_WIDTH;
     }
 
-    int bytes = int(*n_log_frames << cur_state->frame_width);
-    logger::debug() << "alloc_range: allocated " << bytes << " bytes at requested address " << start << "->" << start + bytes;
-    return cur_state;
-}
+    if (taken)
+        set_frames_owner(client_state, cur_state, first_frame, n_frames, attr == memory_v1::attrs_movable);
+    else
+        mark_frames_used(client_state, cur_state, first_frame, n_frames, attr == memory_v1::attrs_movable);
 
-static frames_module_v1::state_t* alloc_range(system_frame_allocator_v1::closure_t* self, size_t n_frames, address_t start, address_t* first_log_frame, size_t* n_log_frames)
-{
-    return alloc_range(reinterpret_cast<frame_allocator_v1::closure_t*>(self), n_frames, start, first_log_frame, n_log_frames);
-}
+    client_state->n_allocated_phys_frames += *n_phys_frames;
 
-//======================================================================================================================
-// system_frame_allocator_v1 implementation
-//======================================================================================================================
+    return frame_address(cur_state, first_frame);
+}
 
 static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocator_v1::closure_t* self, memory_v1::size bytes, uint32_t frame_width, memory_v1::address start, memory_v1::attrs attr)
 {
     frame_allocator_v1::state_t* client_state = reinterpret_cast<frame_allocator_v1::state_t*>(self->d_state);
-    frames_module_v1::state_t* cur_state;
-    address_t first_frame;
-    size_t n_frames;
 
     if (bytes == 0)
     {
@@ -336,64 +1788,47 @@ static memory_v1::address system_frame_allocator_v1_allocate_range(frame_allocat
     frame_width = std::max(frame_width, FRAME_WIDTH);
     size_t n_phys_frames = align_to_frame_width(bytes, frame_width) >> FRAME_WIDTH;
 
-    if (client_state->n_allocated_phys_frames + n_phys_frames > client_state->guaranteed_frames)
+    if (client_state->n_allocated_phys_frames + n_phys_frames > client_state->extra_frames)
     {
         logger::warning() << __FUNCTION__ << ": client exceeded quota!";
         return NO_ADDRESS;
     }
 
-    if (unaligned(start))
+    // for alloc_range we check alignment externally
+    if (!unaligned(start) && !is_aligned_to_frame_width(start, frame_width))
     {
-        cur_state = alloc_any(self, n_phys_frames, frame_width, &first_frame, &n_frames);
-        if (!cur_state)
-        {
-            logger::warning() << __FUNCTION__ << ": failed to allocate " << bytes << " bytes.";
-            return NO_ADDRESS;
-        }
+        logger::warning() << __FUNCTION__ << ": start " << start << " not aligned to width " << frame_width;
+        return NO_ADDRESS;
     }
-    else
+
+    address_t addr = take_frames(self, bytes, start, attr, &n_phys_frames, &frame_width);
+
+    // Frames within the guarantee are due to the client, take them back from the optimists if need be.
+    // Revocation waits for the other clients, so it is done without the frames lock.
+    if ((addr == NO_ADDRESS) && unaligned(start)
+        && (client_state->n_allocated_phys_frames + n_phys_frames <= client_state->guaranteed_frames)
+        && revoke_frames(client_state, n_phys_frames))
     {
-        // for alloc_range we check alignment externally
-        if (!is_aligned_to_frame_width(start, frame_width))
-        {
-            logger::warning() << __FUNCTION__ << ": start " << start << " not aligned to width " << frame_width;
-            return NO_ADDRESS;
-        }
-        cur_state = alloc_range(self, n_phys_frames, start, &first_frame, &n_frames);
-        if (!cur_state)
-        {
-            logger::warning() << __FUNCTION__ << ": failed to allocate " << bytes << " bytes at " << start;
-            return NO_ADDRESS;
-        }
+        addr = take_frames(self, bytes, start, attr, &n_phys_frames, &frame_width);
     }
 
-    /*
-     * Check if our requested frame width has been rounded up;
-     * this can only happen if we've allocated from a non-standard
-     * region with a default logical frame width greater than our
-     * requested one.
-     */
-    if (cur_state->frame_width > frame_width)
+    if (addr == NO_ADDRESS)
     {
-        frame_width  = cur_state->frame_width;
-        n_phys_frames = align_to_frame_width(bytes, frame_width) >> FRAME_WIDTH;
+        if (unaligned(start))
+            logger::warning() << __FUNCTION__ << ": failed to allocate " << bytes << " bytes.";
+        else
+            logger::warning() << __FUNCTION__ << ": failed to allocate " << bytes << " bytes at " << start;
+        return NO_ADDRESS;
     }
 
-    start = frame_address(cur_state, first_frame);
-
-    alloc_update_free_predecessors(cur_state, first_frame);
-    mark_frames_used(client_state, cur_state, first_frame, n_frames);
-
-    client_state->n_allocated_phys_frames += n_phys_frames;
-
     // Add the info about this newly allocated region to our list.
-    if(!add_range(client_state, start, n_phys_frames, frame_width))
+    if(!add_range(client_state, addr, n_phys_frames, frame_width))
     {
         PANIC("Something's wrong.");
     }
 
-    logger::debug() << __FUNCTION__ << ": allocated " << start;
-    return start;
+    logger::debug() << __FUNCTION__ << ": allocated " << addr;
+    return addr;
 }
 
 static memory_v1::address system_frame_allocator_v1_allocate(frame_allocator_v1::closure_t* self, memory_v1::size bytes, uint32_t frame_width)
@@ -464,25 +1899,28 @@ static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self,
     if (cur_state->ramtab)
     {
         uint32_t first_frame = phys_frame_number(addr);
-        for (uint32_t i = 0; i < n_phys_frames; ++i)
+        size_t frame_width, n_same;
+        owner = cur_state->ramtab->get_range(first_frame, n_phys_frames, &frame_width, &mem_state, &n_same);
+        if (owner != client_state->owner)
         {
-            size_t frame_width;
-            owner = cur_state->ramtab->get(first_frame + i, &frame_width, &mem_state);
-            if (owner != client_state->owner)
-            {
-                logger::warning() << __FUNCTION__ << ": we do not own the frame at " << ((first_frame + i) << FRAME_WIDTH);
-                PANIC("Frame allocator misuse.");
-            }
-            if (frame_width != allocation_frame_width)
-            {
-                logger::warning() << __FUNCTION__ << ": frame " << (first_frame + i) << " width is " << frame_width << ", should be " << allocation_frame_width;
-                PANIC("Frame allocator misuse.");
-            }
-            if ((mem_state == ramtab_v1::state_mapped) || (mem_state == ramtab_v1::state_nailed))
-            {
-                logger::warning() << __FUNCTION__ << ": frame at " << ((first_frame + i) << FRAME_WIDTH) << " is " << (mem_state == ramtab_v1::state_mapped ? "mapped" : "nailed");
-                PANIC("Frame allocator misuse.");
-            }
+            logger::warning() << __FUNCTION__ << ": we do not own the frame at " << (first_frame << FRAME_WIDTH);
+            PANIC("Frame allocator misuse.");
+        }
+        if (frame_width != allocation_frame_width)
+        {
+            logger::warning() << __FUNCTION__ << ": frame " << first_frame << " width is " << frame_width << ", should be " << allocation_frame_width;
+            PANIC("Frame allocator misuse.");
+        }
+        if ((mem_state == ramtab_v1::state_mapped) || (mem_state == ramtab_v1::state_nailed))
+        {
+            logger::warning() << __FUNCTION__ << ": frame at " << (first_frame << FRAME_WIDTH) << " is " << (mem_state == ramtab_v1::state_mapped ? "mapped" : "nailed");
+            PANIC("Frame allocator misuse.");
+        }
+        // All frames must be like the first one, otherwise the next one is either not ours, or of a different width, or in use.
+        if (n_same != n_phys_frames)
+        {
+            logger::warning() << __FUNCTION__ << ": frame at " << ((first_frame + n_same) << FRAME_WIDTH) << " differs in owner, width or state from frame at " << (first_frame << FRAME_WIDTH);
+            PANIC("Frame allocator misuse.");
         }
     }
 
@@ -496,57 +1934,58 @@ static void system_frame_allocator_v1_free(frame_allocator_v1::closure_t* self,
         PANIC("Frame allocator misuse.");
     }
 
-    /*
-     * First sort out the frames we're freeing.
-     * We do this from the back so can keep "free" counts consistent.
-     */
-    address_t i;
-    size_t end_free = (end_log_frame == cur_state->n_logical_frames) ? 0 : cur_state->frames[end_log_frame].free;
-
-    for (i = end_log_frame; i >= start_log_frame; --i)
+    // The frames must have been allocated on this interface, which also takes them off our tree of regions.
+    if (!del_range(client_state, addr, n_phys_frames))
     {
-        cur_state->frames[i].free = ++end_free;
-        logger::trace() << "1. Log frame " << i << " free set to " << cur_state->frames[i].free;
+        logger::warning() << __FUNCTION__ << ": frames at " << addr << ".." << end << " were not allocated to this client.";
+        PANIC("Frame allocator misuse.");
     }
 
-    /*
-     * Now need to update all empty frames immediately before the first
-     * frame we've freed; hopefully this will not be too many since we
-     * alloc first fit.
-     * [Note: i points to frame before start_log_frame already]
-     */
-    for (; /*wrap protect:*/(i < start_log_frame) && (cur_state->frames[i].free != 0); --i)
+    bool scrub;
+    events_v1::closure_t* freed_events = NULL;
+    event_v1::count freed_notify = 0;
     {
-        cur_state->frames[i].free = ++end_free;
-        logger::trace() << "2. Log frame " << i << " free set to " << cur_state->frames[i].free;
-    }
+        lockable_scope_lock_t lock(client_state->caches->lock);
 
-    /* Now update the ramtab (if appropriate) */
-    if(cur_state->ramtab)
-    {
-        uint32_t ridx = cur_state->start >> FRAME_WIDTH;
-        size_t fshift = cur_state->frame_width - FRAME_WIDTH; /* frame_width >= FRAME_WIDTH */
-        for (size_t j = start_log_frame; j < end_log_frame; ++j)
+        if (!free_large(client_state, cur_state, start_log_frame, end_log_frame - start_log_frame)
+            && !free_cached(client_state, cur_state, start_log_frame, end_log_frame - start_log_frame))
+            return_free_frames(cur_state, start_log_frame, end_log_frame - start_log_frame);
+
+        /* Now update the ramtab (if appropriate) */
+        if(cur_state->ramtab)
         {
-            //FIXME: indexing will be wrong with fshift > 0
+            uint32_t ridx = cur_state->start >> FRAME_WIDTH;
+            size_t fshift = cur_state->frame_width - FRAME_WIDTH; /* frame_width >= FRAME_WIDTH */
             // Effectively, just set the owner to none and state to unused.
-            cur_state->ramtab->put(ridx + (j << fshift), OWNER_NONE, cur_state->frame_width, ramtab_v1::state_unused);
+            cur_state->ramtab->put_range(ridx + (start_log_frame << fshift), (end_log_frame - start_log_frame) << fshift, OWNER_NONE, cur_state->frame_width, ramtab_v1::state_unused);
         }
-    }
 
-    /* Finally, update number of allocated frames (protect from wrapping), and our linked list of regions */
-    size_t new_phys_frames = client_state->n_allocated_phys_frames - n_phys_frames;
-    if (new_phys_frames > client_state->n_allocated_phys_frames)
-    {
-        logger::warning() << __FUNCTION__ << ": freeing more frames than I own (ignored)";
-        new_phys_frames = 0;
+        /* Finally, update number of allocated frames (protect from wrapping) */
+        size_t new_phys_frames = client_state->n_allocated_phys_frames - n_phys_frames;
+        if (new_phys_frames > client_state->n_allocated_phys_frames)
+        {
+            logger::warning() << __FUNCTION__ << ": freeing more frames than I own (ignored)";
+            new_phys_frames = 0;
+        }
+        client_state->n_allocated_phys_frames = new_phys_frames;
+
+        // Let the client waiting for revoked frames know once they have all been given up.
+        frame_allocator_v1::state_t* revoker = client_state->revoker;
+        if (revoker && (new_phys_frames <= client_state->revoke_target) && (new_phys_frames + n_phys_frames > client_state->revoke_target))
+        {
+            freed_events = revoker->freed_events;
+            freed_notify = revoker->freed_notify;
+        }
+
+        scrub = (client_state->zero_pool->count < FRAMES_ZERO_POOL_LOW);
     }
-    client_state->n_allocated_phys_frames = new_phys_frames;
 
-/*  if(!del_range(cst, base, npf, alfw)) {
-        eprintf("Frames$Free: something's wrong.\n");
-        ntsc_dbgstop();
-    }*/
+    if (freed_events)
+        freed_events->advance(freed_notify, 1);
+
+    // Keep some zeroed frames ready, there is no telling when scrub() is called next.
+    if (scrub)
+        scrub_frames(client_state, FRAMES_SCRUB_BATCH);
 }
 
 static void system_frame_allocator_v1_destroy(frame_allocator_v1::closure_t* self)
@@ -554,6 +1993,49 @@ static void system_frame_allocator_v1_destroy(frame_allocator_v1::closure_t* sel
     PANIC("frames_mod: destroy is not implemented!");
 }
 
+static void system_frame_allocator_v1_set_node_policy(frame_allocator_v1::closure_t* self, frame_allocator_v1::node_policy policy, uint32_t node)
+{
+    frame_allocator_v1::state_t* client_state = self->d_state;
+
+    if (node >= FRAMES_NODES)
+        logger::warning() << __FUNCTION__ << ": node " << node << " has no frame cache, allocations will bypass it.";
+
+    client_state->policy = policy;
+    client_state->node = node;
+    logger::debug() << __FUNCTION__ << ": client " << client_state->owner << " now allocates with policy " << policy << " on node " << node;
+}
+
+static uint32_t system_frame_allocator_v1_query_node(frame_allocator_v1::closure_t* self, memory_v1::address addr)
+{
+    frames_module_v1::state_t* region = get_region(self->d_state->module_state, addr);
+
+    if (!region)
+    {
+        logger::warning() << __FUNCTION__ << ": address " << addr << " is not in any memory region.";
+        return 0;
+    }
+    return region->node;
+}
+
+static void system_frame_allocator_v1_register_revocation(frame_allocator_v1::closure_t* self, events_v1::closure_t* events, event_v1::count notify)
+{
+    frame_allocator_v1::state_t* client_state = self->d_state;
+    lockable_scope_lock_t lock(client_state->caches->lock);
+
+    client_state->revoke_events = events;
+    client_state->revoke_notify = notify;
+}
+
+static uint32_t system_frame_allocator_v1_revocation_pending(frame_allocator_v1::closure_t* self)
+{
+    frame_allocator_v1::state_t* client_state = self->d_state;
+    lockable_scope_lock_t lock(client_state->caches->lock);
+
+    if ((client_state->revoke_target == NO_REVOCATION) || (client_state->n_allocated_phys_frames <= client_state->revoke_target))
+        return 0;
+    return client_state->n_allocated_phys_frames - client_state->revoke_target;
+}
+
 static frame_allocator_v1::closure_t* system_frame_allocator_v1_create_client(system_frame_allocator_v1::closure_t* self, memory_v1::address owner_dcb_virt, memory_v1::address owner_dcb_phys, uint32_t granted_frames, uint32_t extra_frames, uint32_t init_alloc_frames)
 {
     frame_allocator_v1::state_t* client_state = reinterpret_cast<frame_allocator_v1::state_t*>(self->d_state);
@@ -587,17 +2069,36 @@ static frame_allocator_v1::closure_t* system_frame_allocator_v1_create_client(sy
     domain->min_phys_frame_count = 0;
     domain->max_phys_frame_count = state->ramtab->size();
     domain->ramtab = reinterpret_cast<ramtab_entry_t*>(state->ramtab->base());
-    domain->memory_region_list.init(&domain->memory_region_list);
+    domain->memory_regions = memory_region_tree_t();
 
     logger::debug() << __FUNCTION__ << ": initialising new client record";
     new_client_state->domain = domain;
-    new_client_state->region_list = &domain->memory_region_list;
+    new_client_state->region_tree = &domain->memory_regions;
     new_client_state->n_allocated_phys_frames = init_alloc_frames;
     new_client_state->owner = owner_dcb_virt; // use owner_dcb_phys instead?
     new_client_state->guaranteed_frames = granted_frames;
     new_client_state->extra_frames = extra_frames;
     new_client_state->heap = client_state->heap;
+    new_client_state->mmu = client_state->mmu;
     new_client_state->module_state = client_state->module_state;
+    new_client_state->caches = client_state->caches;
+    new_client_state->zero_pool = client_state->zero_pool;
+    new_client_state->large_pool = client_state->large_pool;
+    new_client_state->clients = client_state->clients;
+    new_client_state->revoke_events = NULL;
+    new_client_state->revoke_notify = 0;
+    new_client_state->revoke_target = NO_REVOCATION;
+    new_client_state->revoke_asked = 0;
+    new_client_state->revoker = NULL;
+    new_client_state->freed_events = NULL;
+    new_client_state->freed_notify = 0;
+
+    // Allocate near the domain's control block, falling back to other nodes when the node runs out.
+    frames_module_v1::state_t* dcb_region = get_region(state, owner_dcb_phys);
+    new_client_state->policy = frame_allocator_v1::node_policy_prefer;
+    new_client_state->node = dcb_region ? dcb_region->node : 0;
+
+    closure_init(&new_client_state->closure, &frame_allocator_v1_methods, new_client_state);
 
     // Allocate init_alloc_frames.
     address_t first_frame;
@@ -606,25 +2107,29 @@ static frame_allocator_v1::closure_t* system_frame_allocator_v1_create_client(sy
 
     logger::debug() << __FUNCTION__ << ": allocating " << init_alloc_frames << " init frames";
 
-    cur_state = alloc_any(self, init_alloc_frames, FRAME_WIDTH, &first_frame, &n_frames);
-    if (cur_state == NULL)
-    {
-        logger::fatal() << __FUNCTION__ << ": Out of physical memory, failed to allocate " << init_alloc_frames << " frames.";
-        PANIC("Out of physical memory.");
-    }
-    if (n_frames != init_alloc_frames)
+    address_t start;
     {
-        PANIC("Region with non-standard frame width! Unsupported.");
-    }
+        lockable_scope_lock_t lock(client_state->caches->lock);
 
-    address_t start = frame_address(cur_state, first_frame);
-    logger::debug() << __FUNCTION__ << ": allocated " << init_alloc_frames << " physical frames at " << start;
+        cur_state = alloc_any(&new_client_state->closure, init_alloc_frames, FRAME_WIDTH, &first_frame, &n_frames);
+        if (cur_state == NULL)
+        {
+            logger::fatal() << __FUNCTION__ << ": Out of physical memory, failed to allocate " << init_alloc_frames << " frames.";
+            PANIC("Out of physical memory.");
+        }
+        if (n_frames != init_alloc_frames)
+        {
+            PANIC("Region with non-standard frame width! Unsupported.");
+        }
 
-    alloc_update_free_predecessors(cur_state, first_frame);
-    mark_frames_used(new_client_state, cur_state, first_frame, n_frames);
+        start = frame_address(cur_state, first_frame);
+        logger::debug() << __FUNCTION__ << ": allocated " << init_alloc_frames << " physical frames at " << start;
 
-    /* Update the number of frames we've allocated on this interface */
-    client_state->n_allocated_phys_frames += init_alloc_frames;
+        mark_frames_used(new_client_state, cur_state, first_frame, n_frames);
+
+        /* Update the number of frames we've allocated on this interface */
+        client_state->n_allocated_phys_frames += init_alloc_frames;
+    }
 
     // Add the info about this newly allocated region to our list.
     if(!add_range(new_client_state, start, init_alloc_frames, FRAME_WIDTH))
@@ -632,9 +2137,11 @@ static frame_allocator_v1::closure_t* system_frame_allocator_v1_create_client(sy
         PANIC("Something's wrong.");
     }
 
-    // And that is it.
-    closure_init(&new_client_state->closure, &frame_allocator_v1_methods, new_client_state);
+    lockable_scope_lock_t lock(client_state->caches->lock);
+    new_client_state->next_client = client_state->clients->head;
+    client_state->clients->head = new_client_state;
 
+    // And that is it.
     return &new_client_state->closure;
 }
 
@@ -644,6 +2151,23 @@ static bool system_frame_allocator_v1_add_frames(system_frame_allocator_v1::clos
     return false;
 }
 
+static uint32_t system_frame_allocator_v1_scrub(system_frame_allocator_v1::closure_t* self, uint32_t max_frames)
+{
+    frame_allocator_v1::state_t* client_state = reinterpret_cast<frame_allocator_v1::state_t*>(self->d_state);
+    uint32_t n_scrubbed = scrub_frames(client_state, max_frames);
+
+    logger::trace() << __FUNCTION__ << ": scrubbed " << n_scrubbed << " frames.";
+    return n_scrubbed;
+}
+
+static uint32_t system_frame_allocator_v1_compact(system_frame_allocator_v1::closure_t* self, uint32_t max_frames)
+{
+    frame_allocator_v1::state_t* client_state = reinterpret_cast<frame_allocator_v1::state_t*>(self->d_state);
+
+    lockable_scope_lock_t lock(client_state->caches->lock);
+    return compact_frames(client_state, max_frames);
+}
+
 static const system_frame_allocator_v1::ops_t system_frame_allocator_v1_methods =
 {
     system_frame_allocator_v1_allocate,
@@ -651,14 +2175,44 @@ static const system_frame_allocator_v1::ops_t system_frame_allocator_v1_methods
     system_frame_allocator_v1_query,
     system_frame_allocator_v1_free,
     system_frame_allocator_v1_destroy,
+    system_frame_allocator_v1_set_node_policy,
+    system_frame_allocator_v1_query_node,
+    system_frame_allocator_v1_register_revocation,
+    system_frame_allocator_v1_revocation_pending,
     system_frame_allocator_v1_create_client,
     system_frame_allocator_v1_add_frames,
+    system_frame_allocator_v1_scrub,
+    system_frame_allocator_v1_compact,
 };
 
 //======================================================================================================================
 // frames_module_v1 implementation
 //======================================================================================================================
 
+/**
+ * Call @a fn(start, size, node) for each part of memory map entry @a e which lies on a single NUMA node.
+ * Parts are whole frames, a partial frame at a node boundary stays with the preceding node.
+ */
+template <typename F>
+static void for_each_node_span(bootinfo_t* bi, const multiboot_t::mmap_entry_t* e, F fn)
+{
+    uint64_t addr = e->address();
+    uint64_t end = e->address() + e->size();
+
+    while (addr < end)
+    {
+        uint64_t span_end;
+        uint32_t node = bi->memory_node(addr, span_end);
+
+        span_end = std::max(span_end & ~uint64_t(PAGE_SIZE - 1), addr + PAGE_SIZE);
+        if (span_end > end)
+            span_end = end;
+
+        fn(addr, span_end - addr, node);
+        addr = span_end;
+    }
+}
+
 static memory_v1::size frames_module_v1_required_size(frames_module_v1::closure_t* self)
 {
     UNUSED(self);
@@ -666,16 +2220,19 @@ static memory_v1::size frames_module_v1_required_size(frames_module_v1::closure_
     bootinfo_t* bi = new(bootinfo_t::ADDRESS) bootinfo_t; // simplify memory map operations
 
     // Scan through the set of mem desc and count the number of logical frames they contain in total.
-    std::for_each(bi->mmap_begin(), bi->mmap_end(), [&n_regions, &n_frames](const multiboot_t::mmap_entry_t* e)
+    std::for_each(bi->mmap_begin(), bi->mmap_end(), [bi, &n_regions, &n_frames](const multiboot_t::mmap_entry_t* e)
     {
         if (e->type() == multiboot_t::mmap_entry_t::non_free)
             return;
 
-        n_frames += e->size() >> FRAME_WIDTH;
-        ++n_regions;
+        for_each_node_span(bi, e, [&n_regions, &n_frames](uint64_t, uint64_t size, uint32_t)
+        {
+            n_frames += size >> FRAME_WIDTH;
+            ++n_regions;
+        });
     });
 
-    res = sizeof(frame_allocator_v1::closure_t) + sizeof(frame_allocator_v1::state_t) + n_regions * sizeof(frames_module_v1::state_t) + n_frames * sizeof(frame_st);
+    res = sizeof(frame_allocator_v1::closure_t) + sizeof(frame_allocator_v1::state_t) + sizeof(frames_caches_t) + sizeof(frames_zero_pool_t) + sizeof(frames_large_pool_t) + sizeof(frames_clients_t) + n_regions * sizeof(frames_module_v1::state_t) + n_frames * sizeof(frame_st);
     res = page_align_up(res);
 
     logger::debug() << "frames_mod: required_size counted " << int(n_regions) << " memory regions";
@@ -694,49 +2251,94 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
     system_frame_allocator_v1::closure_t* ret = reinterpret_cast<system_frame_allocator_v1::closure_t*>(&client_state->closure);
     closure_init(ret, &system_frame_allocator_v1_methods, reinterpret_cast<system_frame_allocator_v1::state_t*>(client_state));
 
-    frames_module_v1::state_t* frames_state = reinterpret_cast<frames_module_v1::state_t*>(where_to_start + sizeof(frame_allocator_v1::state_t));
+    frames_caches_t* caches = reinterpret_cast<frames_caches_t*>(where_to_start + sizeof(frame_allocator_v1::state_t));
+    caches->lock = lockable_t();
+    for (size_t v = 0; v < FRAMES_VCPUS * FRAMES_NODES; ++v)
+        caches->caches[v].count = 0;
+
+    frames_zero_pool_t* zero_pool = reinterpret_cast<frames_zero_pool_t*>(caches + 1);
+    zero_pool->count = 0;
+    zero_pool->direct_end = 0;
+
+    frames_large_pool_t* large_pool = reinterpret_cast<frames_large_pool_t*>(zero_pool + 1);
+    large_pool->count = 0;
+    large_pool->target = 0;
+
+    frames_clients_t* clients = reinterpret_cast<frames_clients_t*>(large_pool + 1);
+    clients->head = NULL;
+
+    frames_module_v1::state_t* frames_state = reinterpret_cast<frames_module_v1::state_t*>(clients + 1);
 
     client_state->owner = OWNER_SYSTEM;
+    client_state->region_tree = NULL;
     client_state->n_allocated_phys_frames = 0;
     client_state->guaranteed_frames = -1;
     client_state->extra_frames = -1;
     client_state->heap = 0;
+    client_state->mmu = 0;
+    client_state->policy = frame_allocator_v1::node_policy_any;
+    client_state->node = 0;
     client_state->module_state = frames_state;
+    client_state->caches = caches;
+    client_state->zero_pool = zero_pool;
+    client_state->large_pool = large_pool;
+    client_state->clients = clients;
+    client_state->next_client = NULL;
+    client_state->revoke_events = NULL;
+    client_state->revoke_notify = 0;
+    client_state->revoke_target = NO_REVOCATION;
+    client_state->revoke_asked = 0;
+    client_state->revoker = NULL;
+    client_state->freed_events = NULL;
+    client_state->freed_notify = 0;
 
     frames_module_v1::state_t* running_state = frames_state;
     frames_module_v1::state_t* last_state = running_state;
     size_t n_regions = 0;
 
     bootinfo_t* bi = new(bootinfo_t::ADDRESS) bootinfo_t;
-    std::for_each(bi->mmap_begin(), bi->mmap_end(), [&running_state, &last_state, &n_regions, rtab](const multiboot_t::mmap_entry_t* e)
+
+    // Find out how much of low physical memory is mapped one-to-one, so that frames can be zeroed.
+    std::for_each(bi->vmap_begin(), bi->vmap_end(), [zero_pool](const memory_v1::mapping* e)
+    {
+        if ((e->virt == e->phys) && (e->phys <= zero_pool->direct_end))
+            zero_pool->direct_end = std::max(zero_pool->direct_end, address_t(e->phys + (e->nframes << FRAME_WIDTH)));
+    });
+    logger::debug() << "frames_mod: frames below " << zero_pool->direct_end << " can be zeroed";
+
+    // Memory map entries spanning several NUMA nodes are split into one region per node.
+    std::for_each(bi->mmap_begin(), bi->mmap_end(), [bi, &running_state, &last_state, &n_regions, rtab](const multiboot_t::mmap_entry_t* e)
     {
         if (e->type() == multiboot_t::mmap_entry_t::non_free)
             return;
 
-        running_state->start = e->address();
-        running_state->n_logical_frames = phys_frame_number(e->size());
-        running_state->frame_width = FRAME_WIDTH;
-        if ((e->type() == multiboot_t::mmap_entry_t::free) || (e->type() == multiboot_t::mmap_entry_t::acpi_reclaimable))
-        {
-            running_state->attrs = memory_v1::attrs_regular;
-            running_state->ramtab = rtab;
-            logger::debug() << "Adding RAM at " << e->address() << " is " << e->size() << " bytes of type " << e->type();
-        }
-        else
+        for_each_node_span(bi, e, [e, &running_state, &last_state, &n_regions, rtab](uint64_t start, uint64_t size, uint32_t node)
         {
-            running_state->attrs = memory_v1::attrs_non_memory;
-            running_state->ramtab = 0;
-            logger::debug() << "Adding non-RAM at " << e->address() << " is " << e->size() << " bytes of type " << e->type();
-        }
-        running_state->frames = reinterpret_cast<frame_st*>(running_state + 1);
+            running_state->start = start;
+            running_state->n_logical_frames = phys_frame_number(size);
+            running_state->frame_width = FRAME_WIDTH;
+            running_state->node = node;
+            if ((e->type() == multiboot_t::mmap_entry_t::free) || (e->type() == multiboot_t::mmap_entry_t::acpi_reclaimable))
+            {
+                running_state->attrs = memory_v1::attrs_regular;
+                running_state->ramtab = rtab;
+                logger::debug() << "Adding RAM at " << start << " is " << size << " bytes of type " << e->type() << " on node " << node;
+            }
+            else
+            {
+                running_state->attrs = memory_v1::attrs_non_memory;
+                running_state->ramtab = 0;
+                logger::debug() << "Adding non-RAM at " << start << " is " << size << " bytes of type " << e->type() << " on node " << node;
+            }
+            running_state->frames = reinterpret_cast<frame_st*>(running_state + 1);
 
-        for(size_t j = 0; j < running_state->n_logical_frames; ++j)
-            running_state->frames[j].free = running_state->n_logical_frames - j;
+            init_free_frames(running_state);
 
-        running_state->next = reinterpret_cast<frames_module_v1::state_t*>(&running_state->frames[running_state->n_logical_frames]);
-        last_state = running_state;
-        running_state = running_state->next;
-        ++n_regions;
+            running_state->next = reinterpret_cast<frames_module_v1::state_t*>(&running_state->frames[running_state->n_logical_frames]);
+            last_state = running_state;
+            running_state = running_state->next;
+            ++n_regions;
+        });
     });
     last_state->next = 0;
 
@@ -753,22 +2355,29 @@ static system_frame_allocator_v1::closure_t* frames_module_v1_create(frames_modu
 
         logger::debug() << "Used memory at " << e->address() << " is " << e->size() << " bytes of type " << e->type();
 
-        address_t first_frame;
-        size_t n_frames;
-        auto running_state = alloc_range(ret, size_in_whole_frames(e->size(), FRAME_WIDTH), e->address(), &first_frame, &n_frames);
-        if (n_frames == 0)
-            PANIC("Already allocated range deemed unavailable!");
+        // The range may cross a node boundary, alloc_range() stops at the end of a region.
+        address_t start = e->address();
+        size_t n_remaining = size_in_whole_frames(e->size(), FRAME_WIDTH);
+        while (n_remaining > 0)
+        {
+            address_t first_frame;
+            size_t n_frames;
+            auto running_state = alloc_range(ret, n_remaining, start, &first_frame, &n_frames);
+            if (n_frames == 0)
+                PANIC("Already allocated range deemed unavailable!");
+
+            mark_frames_used(client_state, running_state, first_frame, n_frames);
 
-        alloc_update_free_predecessors(running_state, first_frame);
-        mark_frames_used(client_state, running_state, first_frame, n_frames);
-        
-        client_state->n_allocated_phys_frames += n_frames;
+            client_state->n_allocated_phys_frames += n_frames;
+            start += n_frames << FRAME_WIDTH;
+            n_remaining -= n_frames;
+        }
     });
 
     return ret;
 }
 
-static void frames_module_v1_finish_init(frames_module_v1::closure_t* self, system_frame_allocator_v1::closure_t* frames, heap_v1::closure_t* heap)
+static void frames_module_v1_finish_init(frames_module_v1::closure_t* self, system_frame_allocator_v1::closure_t* frames, heap_v1::closure_t* heap, mmu_v1::closure_t* mmu)
 {
     frame_allocator_v1::state_t* state = reinterpret_cast<frame_allocator_v1::state_t*>(frames->d_state);
 
@@ -779,6 +2388,24 @@ static void frames_module_v1_finish_init(frames_module_v1::closure_t* self, syst
     }
 
     state->heap = heap;
+    state->mmu = mmu;
+
+    // Reserve large extents while memory is still mostly free.
+    size_t n_ram_frames = 0;
+    for (frames_module_v1::state_t* region = state->module_state; region; region = region->next)
+    {
+        if (is_cacheable(region))
+            n_ram_frames += region->n_logical_frames;
+    }
+    state->large_pool->target = std::min<size_t>(FRAMES_LARGE_POOL_SIZE, n_ram_frames / 8 / FRAMES_LARGE_FRAMES);
+    {
+        lockable_scope_lock_t lock(state->caches->lock);
+        fill_large_pool(state);
+    }
+    logger::debug() << "frames_mod: reserved " << state->large_pool->count << " of " << state->large_pool->target << " 4MiB extents";
+
+    // Have some zeroed frames ready for the first domains.
+    system_frame_allocator_v1_scrub(frames, FRAMES_ZERO_POOL_SIZE);
 }
 
 static const frames_module_v1::ops_t frames_module_v1_methods =
@@ -98,6 +98,13 @@ static gatekeeper_v1::ops_t simple_gatekeeper_ops =
 
 static heap_v1::ops_t gatekeeper_heap_ops =
 {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
     NULL,
     NULL,
     NULL
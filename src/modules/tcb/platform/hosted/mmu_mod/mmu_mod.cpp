@@ -11,7 +11,10 @@
  * it only needs to create some bookkeeping structures and maintain them in already
  * allocated memory.
  * The memory map abstraction is supported by the bootinfo page.
+ * Page tables and the TLB are simulated by soft_mmu_t, which counts walks, misses and
+ * flushes per protection domain so that the pc99 policies can be measured on the host.
  */
+#include <stdlib.h>
 #include "algorithm"
 #include "default_console.h"
 #include "bootinfo.h"
@@ -30,6 +33,7 @@
 #include "domain.h"
 #include "stretch_v1_state.h"
 #include "logger.h"
+#include "soft_mmu.h"
 
 //======================================================================================================================
 // mmu_v1 state
@@ -38,6 +42,13 @@
 static const size_t N_L1_TABLES = 1024;
 static const size_t N_L2_ENTRIES = 1024;
 
+// Simulated TLB geometry, 64 entries like the data TLB of common x86 cores.
+static const size_t TLB_SETS = 16;
+static const size_t TLB_WAYS = 4;
+
+// Same policy as pc99: ranges up to this many pages are invalidated page by page, larger ones flush the TLB.
+static const size_t TLB_FLUSH_THRESHOLD = 32;
+
 struct ramtab_entry_t
 {
     address_t owner;        /* PHYSICAL address of owning domain's DCB   */
@@ -85,6 +96,8 @@ struct mmu_v1::state_t
 
     bool                  use_global_pages;    /* Set iff we can use PGE    */
 
+    soft_mmu_t*           soft;                /* Simulated page tables and TLB */
+
     /*system_*/frame_allocator_v1::closure_t*  system_frame_allocator;
     heap_v1::closure_t*                        heap;
     stretch_allocator_v1::closure_t*           stretch_allocator;
@@ -131,22 +144,126 @@ inline uint16_t alloc_pdidx(mmu_v1::state_t* state)
     return 0xdead;
 }
 
+static void* host_alloc(void*, size_t size)
+{
+    return malloc(size);
+}
+
+static void host_free(void*, void* p)
+{
+    free(p);
+}
+
+static uint32_t control_bits(mmu_v1::state_t* state, stretch_v1::rights rights, bool valid)
+{
+    uint32_t flags = 0;
+
+    if (valid)
+        flags |= soft_mmu_t::present;
+    if (rights.has(stretch_v1::right_read))
+        flags |= soft_mmu_t::user;
+    if (rights.has(stretch_v1::right_write))
+        flags |= soft_mmu_t::writable;
+    if (state->use_global_pages && rights.has(stretch_v1::right_global))
+        flags |= soft_mmu_t::global;
+
+    return flags;
+}
+
+inline bool is_4mb_aligned(address_t a)
+{
+    return (a & ((N_L2_ENTRIES << FRAME_WIDTH) - 1)) == 0;
+}
+
+/**
+ * The simulated MMU has only 4K and 4MB pages, same as pc99 without PAE.
+ */
+static bool valid_range(const char* func, memory_v1::virtmem_desc mem_range)
+{
+    if (mem_range.page_width != FRAME_WIDTH)
+    {
+        logger::warning() << func << ": unsupported page width " << mem_range.page_width;
+        return false;
+    }
+    return true;
+}
+
 //======================================================================================================================
 // mmu_v1 methods
 //======================================================================================================================
 
+static void mmu_v1_switch_domain(mmu_v1::closure_t* self, protection_domain_v1::id dom_id);
+
 static void mmu_v1_start(mmu_v1::closure_t* self, protection_domain_v1::id root_domain)
 {
-    // nucleus::flush_tlb();
-    // nucleus::wrpdom(base);
+    self->d_state->soft->reset_counters();
+    mmu_v1_switch_domain(self, root_domain);
 }
 
 static void mmu_v1_add_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, stretch_v1::rights global_rights)
 {
+    if (!valid_range(__FUNCTION__, mem_range))
+        return;
+
+    uint32_t flags = control_bits(self->d_state, global_rights, /*valid:*/false);
+    address_t virt = mem_range.start_addr;
+
+    for (size_t n_pages = 0; n_pages < mem_range.n_pages; ++n_pages, virt += PAGE_SIZE)
+    {
+        if (!self->d_state->soft->map_4k(virt, 0, flags))
+        {
+            logger::warning() << __FUNCTION__ << ": failed to add page at " << virt;
+            return;
+        }
+    }
 }
 
 static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, memory_v1::physmem_desc pmem, stretch_v1::rights global_rights)
 {
+    auto state = self->d_state;
+
+    if (!valid_range(__FUNCTION__, mem_range))
+        return;
+
+    if ((pmem.frame_width != FRAME_WIDTH) || (pmem.n_frames != mem_range.n_pages))
+    {
+        logger::warning() << __FUNCTION__ << ": pages " << mem_range.n_pages << " and frames " << pmem.n_frames << " do not match";
+        return;
+    }
+
+    uint32_t flags = control_bits(state, global_rights, /*valid:*/true);
+    address_t virt = mem_range.start_addr;
+    address_t phys = pmem.start_addr;
+    size_t n_pages = mem_range.n_pages;
+
+    while (n_pages > 0)
+    {
+        size_t n = 1;
+
+        // Same superpage policy as pc99: whole aligned 4MB areas on both sides get a single 4MB page.
+        if (is_4mb_aligned(virt) && is_4mb_aligned(phys) && (n_pages >= N_L2_ENTRIES) && state->soft->map_4m(virt, phys, flags))
+        {
+            n = N_L2_ENTRIES;
+        }
+        else if (!state->soft->map_4k(virt, phys, flags))
+        {
+            logger::warning() << __FUNCTION__ << ": failed to add page at " << virt;
+            return;
+        }
+
+        size_t frame = phys >> FRAME_WIDTH;
+        if (frame < state->ramtab_size)
+        {
+            uint32_t width;
+            ramtab_v1::state frame_state;
+            uint32_t owner = state->ramtab_closure.get(frame, &width, &frame_state);
+            state->ramtab_closure.put_range(frame, std::min(n, state->ramtab_size - frame), owner, FRAME_WIDTH, ramtab_v1::state_mapped);
+        }
+
+        n_pages -= n;
+        virt += n << FRAME_WIDTH;
+        phys += n << FRAME_WIDTH;
+    }
 }
 
 /**
@@ -154,11 +271,100 @@ static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure
  */
 static void mmu_v1_update_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, stretch_v1::rights global_rights)
 {
+    auto state = self->d_state;
+
+    if (!valid_range(__FUNCTION__, mem_range))
+        return;
+
+    uint32_t flags = control_bits(state, global_rights, /*valid:*/true);
+    address_t virt = mem_range.start_addr;
+    address_t end = virt + (mem_range.n_pages << FRAME_WIDTH);
+
+    while (virt < end)
+    {
+        uint32_t* e = state->soft->entry(virt);
+        size_t n = 1;
+
+        if (e && (*e & soft_mmu_t::large))
+        {
+            if (is_4mb_aligned(virt) && (end - virt >= (N_L2_ENTRIES << FRAME_WIDTH)))
+            {
+                *e = (*e & soft_mmu_t::large_frame_mask) | flags | soft_mmu_t::large;
+                n = N_L2_ENTRIES;
+            }
+            else if (state->soft->split_4m(virt))
+                e = state->soft->entry(virt);
+            else
+                e = NULL;
+        }
+
+        if (!e)
+        {
+            logger::warning() << __FUNCTION__ << ": no page at " << virt;
+            return;
+        }
+
+        if (n == 1)
+            *e = (*e & soft_mmu_t::frame_mask) | flags;
+
+        state->soft->invalidate(virt);
+        virt += n << FRAME_WIDTH;
+    }
 }
 
 static void mmu_v1_free_range(mmu_v1::closure_t* self, memory_v1::virtmem_desc mem_range)
 {
+    auto state = self->d_state;
+
+    if (!valid_range(__FUNCTION__, mem_range))
+        return;
+
+    address_t virt = mem_range.start_addr;
+    address_t end = virt + (mem_range.n_pages << FRAME_WIDTH);
+    bool flush_each = mem_range.n_pages <= TLB_FLUSH_THRESHOLD;
+    bool flush_global = false;
+
+    while (virt < end)
+    {
+        uint32_t* e = state->soft->entry(virt);
+        size_t n = 1;
+
+        if (e && (*e & soft_mmu_t::large))
+        {
+            // A 4MB page only partly covered by the range is demoted first.
+            if (is_4mb_aligned(virt) && (end - virt >= (N_L2_ENTRIES << FRAME_WIDTH)))
+                n = N_L2_ENTRIES;
+            else if (state->soft->split_4m(virt))
+                e = state->soft->entry(virt);
+        }
+
+        if (e)
+        {
+            uint32_t pte = *e;
+            if (pte & soft_mmu_t::present)
+            {
+                size_t frame = (pte & soft_mmu_t::frame_mask) >> FRAME_WIDTH;
+                if (frame < state->ramtab_size)
+                {
+                    uint32_t width;
+                    ramtab_v1::state frame_state;
+                    uint32_t owner = state->ramtab_closure.get(frame, &width, &frame_state);
+                    if (frame_state == ramtab_v1::state_mapped)
+                        state->ramtab_closure.put_range(frame, std::min(n, state->ramtab_size - frame), owner, width, ramtab_v1::state_unused);
+                }
+            }
+            flush_global |= (pte & soft_mmu_t::global) != 0;
+            state->soft->unmap(virt);
+
+            if (flush_each)
+                state->soft->invalidate(virt);
+        }
+
+        virt += n << FRAME_WIDTH;
+    }
 
+    if (!flush_each)
+        state->soft->flush(flush_global);
 }
 
 static protection_domain_v1::id mmu_v1_create_domain(mmu_v1::closure_t* self)
@@ -172,8 +378,8 @@ static protection_domain_v1::id mmu_v1_create_domain(mmu_v1::closure_t* self)
     state->pdominfo[idx].gen++;
 
     memory_v1::size sz;
+    // Nailed stretches are allocated zeroed.
     pdom_t* base = reinterpret_cast<pdom_t*>(state->pdominfo[idx].stretch->info(&sz));
-    memutils::clear_memory(base, sz);
 
     state->pdom_tbl[idx] = base;
 
@@ -215,6 +421,10 @@ static void mmu_v1_release_domain(mmu_v1::closure_t* self, protection_domain_v1:
 
     if (state->pdominfo[idx].refcnt == 0)
     {
+        const soft_mmu_t::counters_t& c = state->soft->counters(idx);
+        logger::debug() << __FUNCTION__ << ": pdom " << idx << " made " << c.accesses << " accesses, " << c.tlb_misses << " TLB misses, "
+            << c.walk_refs << " walk references, " << c.flushes << " flushes, " << c.l2_allocs << " L2 tables allocated";
+
         state->stretch_allocator->destroy_stretch(state->pdominfo[idx].stretch);
         state->pdom_tbl[idx] = NULL;
     }
@@ -253,10 +463,25 @@ static stretch_v1::rights mmu_v1_query_rights(mmu_v1::closure_t* self, protectio
     return 0;
 }
 
-// No ASN supported on x86.
+// The simulated TLB is tagged with the domain index, 0 is left for the kernel.
 static int32_t mmu_v1_query_asn(mmu_v1::closure_t* self, protection_domain_v1::id dom_id)
 {
-    return 0x666;
+    return PDIDX(dom_id) + 1;
+}
+
+static void mmu_v1_switch_domain(mmu_v1::closure_t* self, protection_domain_v1::id dom_id)
+{
+    auto state = self->d_state;
+    uint16_t idx = PDIDX(dom_id);
+
+    if ((idx >= PDIDX_MAX) || (state->pdom_tbl[idx] == NULL))
+    {
+        kconsole << __FUNCTION__ << ": bogus pdom id " << dom_id << endl;
+        nucleus::debug_stop();
+        return;
+    }
+
+    state->soft->switch_domain(idx, idx + 1);
 }
 
 static stretch_v1::rights mmu_v1_query_global_rights(mmu_v1::closure_t* self, stretch_v1::closure_t* str)
@@ -269,6 +494,21 @@ static void mmu_v1_clone_rights(mmu_v1::closure_t* self, stretch_v1::closure_t*
 
 }
 
+static uint32_t mmu_v1_protect_frame(mmu_v1::closure_t* self, memory_v1::address frame)
+{
+    return self->d_state->soft->protect_frame(frame);
+}
+
+static uint32_t mmu_v1_remap_frame(mmu_v1::closure_t* self, memory_v1::address from, memory_v1::address to)
+{
+    return self->d_state->soft->remap_frame(from, to);
+}
+
+static uint32_t mmu_v1_unmap_frame(mmu_v1::closure_t* self, memory_v1::address frame)
+{
+    return self->d_state->soft->unmap_frame(frame);
+}
+
 static const mmu_v1::ops_t mmu_v1_methods =
 {
     mmu_v1_start,
@@ -282,8 +522,12 @@ static const mmu_v1::ops_t mmu_v1_methods =
     mmu_v1_set_rights,
     mmu_v1_query_rights,
     mmu_v1_query_asn,
+    mmu_v1_switch_domain,
     mmu_v1_query_global_rights,
-    mmu_v1_clone_rights
+    mmu_v1_clone_rights,
+    mmu_v1_protect_frame,
+    mmu_v1_remap_frame,
+    mmu_v1_unmap_frame
 };
 
 //======================================================================================================================
@@ -336,12 +580,57 @@ static uint32_t ramtab_v1_get(ramtab_v1::closure_t* self, uint32_t frame, uint32
     return st->ramtab[frame].owner;
 }
 
+static void ramtab_v1_put_range(ramtab_v1::closure_t* self, uint32_t frame, uint32_t n_frames, uint32_t owner, uint32_t frame_width, ramtab_v1::state state)
+{
+    mmu_v1::state_t* st = reinterpret_cast<mmu_v1::state_t*>(self->d_state);
+    logger::trace() << __FUNCTION__ << ": " << n_frames << " frames from " << frame << " with owner " << owner << " and frame width " << int(frame_width) << " in state " << state;
+    if ((frame >= st->ramtab_size) || (n_frames > st->ramtab_size - frame))
+    {
+        logger::warning() << __FUNCTION__ << ": out of range frames " << frame << "+" << n_frames << ", max is " << st->ramtab_size;
+        nucleus::debug_stop();
+        return;
+    }
+
+    for (ramtab_entry_t* entry = &st->ramtab[frame]; entry != &st->ramtab[frame + n_frames]; ++entry)
+    {
+        entry->owner = owner;
+        entry->frame_width = frame_width;
+        entry->state = state;
+    }
+}
+
+static uint32_t ramtab_v1_get_range(ramtab_v1::closure_t* self, uint32_t frame, uint32_t n_frames, uint32_t* frame_width, ramtab_v1::state* state, uint32_t* n_same)
+{
+    mmu_v1::state_t* st = reinterpret_cast<mmu_v1::state_t*>(self->d_state);
+    if (frame >= st->ramtab_size)
+    {
+        logger::warning() << __FUNCTION__ << ": out of range frame " << frame << ", max is " << st->ramtab_size;
+        nucleus::debug_stop();
+        *n_same = 0;
+        return 0xdeadd00d;
+    }
+
+    const ramtab_entry_t* first = &st->ramtab[frame];
+    const ramtab_entry_t* end = first + std::min<size_t>(n_frames, st->ramtab_size - frame);
+    const ramtab_entry_t* entry = first + 1;
+    while ((entry < end) && (entry->owner == first->owner) && (entry->frame_width == first->frame_width) && (entry->state == first->state))
+        ++entry;
+
+    *frame_width = first->frame_width;
+    *state = ramtab_v1::state(first->state);
+    *n_same = entry - first;
+    logger::trace() << __FUNCTION__ << ": " << *n_same << " frames from " << frame << " with owner " << first->owner << " and frame width " << int(*frame_width) << " in state " << *state;
+    return first->owner;
+}
+
 static const ramtab_v1::ops_t ramtab_v1_methods =
 {
     ramtab_v1_size,
     ramtab_v1_base,
     ramtab_v1_put,
-    ramtab_v1_get
+    ramtab_v1_get,
+    ramtab_v1_put_range,
+    ramtab_v1_get_range
 };
 
 //======================================================================================================================
@@ -525,6 +814,12 @@ static mmu_v1::closure_t* mmu_module_v1_create(mmu_module_v1::closure_t* self, u
 
     state->use_global_pages = (INFO_PAGE.cpu_features & X86_32_FEAT_PGE) != 0;
 
+    state->soft = new soft_mmu_t(TLB_SETS, TLB_WAYS, /*tagged:*/true, host_alloc, host_free, NULL);
+    if (!state->soft->is_valid())
+    {
+        PANIC("Unable to allocate the simulated TLB!");
+    }
+
     // Intialise our closures, etc to NULL for now  // will be fixed by $Done later
     state->system_frame_allocator = NULL;
     state->heap = NULL;
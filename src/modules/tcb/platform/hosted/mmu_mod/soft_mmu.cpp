@@ -0,0 +1,481 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "soft_mmu.h"
+
+static const int L1_SHIFT = 22;
+static const int L2_SHIFT = 12;
+
+inline size_t l1_index(addr32_t va) { return va >> L1_SHIFT; }
+inline size_t l2_index(addr32_t va) { return (va >> L2_SHIFT) & (soft_mmu_t::N_L2_ENTRIES - 1); }
+
+soft_mmu_t::soft_mmu_t(size_t tlb_sets_, size_t tlb_ways_, bool tagged_, alloc_fn alloc_, free_fn free_, void* ctx_)
+    : l2_count(0)
+    , tlb(NULL)
+    , tlb_sets(tlb_sets_)
+    , tlb_ways(tlb_ways_)
+    , tagged(tagged_)
+    , tick(0)
+    , current_asn(0)
+    , current_pdom(0)
+    , alloc(alloc_)
+    , release(free_)
+    , ctx(ctx_)
+{
+    for (size_t i = 0; i < N_L1_ENTRIES; ++i)
+    {
+        l1[i] = 0;
+        l2[i] = NULL;
+    }
+    reset_counters();
+
+    if (tlb_sets && tlb_ways)
+    {
+        tlb = reinterpret_cast<tlb_entry_t*>(alloc(ctx, tlb_sets * tlb_ways * sizeof(tlb_entry_t)));
+        for (size_t i = 0; tlb && (i < tlb_sets * tlb_ways); ++i)
+            tlb[i].valid = false;
+    }
+}
+
+soft_mmu_t::~soft_mmu_t()
+{
+    for (size_t i = 0; i < N_L1_ENTRIES; ++i)
+    {
+        if (l2[i])
+            release(ctx, l2[i]);
+    }
+    if (tlb)
+        release(ctx, tlb);
+}
+
+void soft_mmu_t::reset_counters()
+{
+    const counters_t zero = counters_t();
+    for (size_t i = 0; i < N_DOMAINS; ++i)
+        stats[i] = zero;
+}
+
+//======================================================================================================================
+// Page tables
+//======================================================================================================================
+
+uint32_t* soft_mmu_t::alloc_l2(size_t l1idx)
+{
+    uint32_t* table = reinterpret_cast<uint32_t*>(alloc(ctx, N_L2_ENTRIES * sizeof(uint32_t)));
+    if (!table)
+        return NULL;
+
+    for (size_t i = 0; i < N_L2_ENTRIES; ++i)
+        table[i] = 0;
+    l2[l1idx] = table;
+    // There is no physical address to put into the PDE, the walk goes through l2[] instead.
+    l1[l1idx] = present | writable | user;
+    ++l2_count;
+    ++current().l2_allocs;
+    return table;
+}
+
+void soft_mmu_t::free_l2(size_t l1idx)
+{
+    release(ctx, l2[l1idx]);
+    l2[l1idx] = NULL;
+    l1[l1idx] = 0;
+    --l2_count;
+    ++current().l2_frees;
+}
+
+/**
+ * True if no entry of the L2 table has anything in it, invalid entries may still carry information.
+ */
+bool soft_mmu_t::is_l2_empty(size_t l1idx) const
+{
+    for (size_t i = 0; i < N_L2_ENTRIES; ++i)
+    {
+        if (l2[l1idx][i])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Set the 4K page at @a va, @a flags without present give an invalid entry. Splits a 4MB page covering @a va.
+ */
+bool soft_mmu_t::map_4k(addr32_t va, addr32_t pa, uint32_t flags)
+{
+    size_t l1idx = l1_index(va);
+
+    if ((l1[l1idx] & large) && !split_4m(va))
+        return false;
+
+    if (!l2[l1idx] && !alloc_l2(l1idx))
+        return false;
+
+    l2[l1idx][l2_index(va)] = (pa & frame_mask) | (flags & flags_mask & ~large);
+    return true;
+}
+
+/**
+ * Set the 4MB page at @a va. An L2 table there is given back if none of its pages are present.
+ */
+bool soft_mmu_t::map_4m(addr32_t va, addr32_t pa, uint32_t flags)
+{
+    size_t l1idx = l1_index(va);
+
+    if (l2[l1idx])
+    {
+        for (size_t i = 0; i < N_L2_ENTRIES; ++i)
+        {
+            if (l2[l1idx][i] & present)
+                return false;
+        }
+        free_l2(l1idx);
+    }
+
+    l1[l1idx] = (pa & large_frame_mask) | (flags & flags_mask) | large;
+    return true;
+}
+
+/**
+ * Replace the 4MB page covering @a va, if any, by an L2 table of 4K pages with the same frames and flags.
+ */
+bool soft_mmu_t::split_4m(addr32_t va)
+{
+    size_t l1idx = l1_index(va);
+    uint32_t pde = l1[l1idx];
+
+    if (!(pde & large))
+        return true;
+
+    uint32_t* table = alloc_l2(l1idx);
+    if (!table)
+    {
+        l1[l1idx] = pde;
+        return false;
+    }
+
+    for (size_t i = 0; i < N_L2_ENTRIES; ++i)
+        table[i] = ((pde & large_frame_mask) + (i << L2_SHIFT)) | (pde & flags_mask & ~large);
+
+    return true;
+}
+
+/**
+ * Clear the 4K page at @a va, or the whole 4MB page covering it. L2 tables left empty are freed.
+ * Returns true if a present page was removed.
+ */
+bool soft_mmu_t::unmap(addr32_t va)
+{
+    size_t l1idx = l1_index(va);
+    bool was_present;
+
+    if (l1[l1idx] & large)
+    {
+        was_present = (l1[l1idx] & present) != 0;
+        l1[l1idx] = 0;
+        return was_present;
+    }
+
+    if (!l2[l1idx])
+        return false;
+
+    uint32_t& pte = l2[l1idx][l2_index(va)];
+    was_present = (pte & present) != 0;
+    pte = 0;
+
+    if (is_l2_empty(l1idx))
+        free_l2(l1idx);
+
+    return was_present;
+}
+
+/**
+ * Entry mapping @a va: the PDE of a 4MB page, a PTE, or NULL if there is no L2 table for it.
+ */
+uint32_t* soft_mmu_t::entry(addr32_t va)
+{
+    size_t l1idx = l1_index(va);
+
+    if (l1[l1idx] & large)
+        return &l1[l1idx];
+
+    if (!l2[l1idx])
+        return NULL;
+
+    return &l2[l1idx][l2_index(va)];
+}
+
+uint32_t soft_mmu_t::protect_frame(addr32_t frame)
+{
+    uint32_t n_pages = 0;
+
+    for (size_t l1idx = 0; l1idx < N_L1_ENTRIES; ++l1idx)
+    {
+        addr32_t base = l1[l1idx] & large_frame_mask;
+        if ((l1[l1idx] & large) && ((frame < base) || (frame - base >= (1U << L1_SHIFT)) || !split_4m(l1idx << L1_SHIFT)))
+            continue;
+
+        if (!l2[l1idx])
+            continue;
+
+        for (size_t l2idx = 0; l2idx < N_L2_ENTRIES; ++l2idx)
+        {
+            uint32_t& pte = l2[l1idx][l2idx];
+            if ((pte & present) && ((pte & frame_mask) == frame))
+            {
+                if (pte & writable)
+                {
+                    pte = (pte & ~writable) | migrating;
+                    invalidate((l1idx << L1_SHIFT) | (l2idx << L2_SHIFT));
+                }
+                ++n_pages;
+            }
+        }
+    }
+
+    return n_pages;
+}
+
+uint32_t soft_mmu_t::remap_frame(addr32_t from, addr32_t to)
+{
+    uint32_t n_pages = 0;
+
+    for (size_t l1idx = 0; l1idx < N_L1_ENTRIES; ++l1idx)
+    {
+        addr32_t base = l1[l1idx] & large_frame_mask;
+        if ((l1[l1idx] & large) && ((from < base) || (from - base >= (1U << L1_SHIFT)) || !split_4m(l1idx << L1_SHIFT)))
+            continue;
+
+        if (!l2[l1idx])
+            continue;
+
+        for (size_t l2idx = 0; l2idx < N_L2_ENTRIES; ++l2idx)
+        {
+            uint32_t& pte = l2[l1idx][l2idx];
+            if ((pte & present) && ((pte & frame_mask) == from))
+            {
+                if (pte & migrating)
+                    pte = (pte & ~migrating) | writable;
+                pte = (to & frame_mask) | (pte & flags_mask);
+                invalidate((l1idx << L1_SHIFT) | (l2idx << L2_SHIFT));
+                ++n_pages;
+            }
+        }
+    }
+
+    return n_pages;
+}
+
+uint32_t soft_mmu_t::unmap_frame(addr32_t frame)
+{
+    uint32_t n_pages = 0;
+
+    for (size_t l1idx = 0; l1idx < N_L1_ENTRIES; ++l1idx)
+    {
+        addr32_t base = l1[l1idx] & large_frame_mask;
+        if ((l1[l1idx] & large) && ((frame < base) || (frame - base >= (1U << L1_SHIFT)) || !split_4m(l1idx << L1_SHIFT)))
+            continue;
+
+        if (!l2[l1idx])
+            continue;
+
+        for (size_t l2idx = 0; l2idx < N_L2_ENTRIES; ++l2idx)
+        {
+            uint32_t& pte = l2[l1idx][l2idx];
+            if ((pte & present) && ((pte & frame_mask) == frame))
+            {
+                pte &= ~present;
+                invalidate((l1idx << L1_SHIFT) | (l2idx << L2_SHIFT));
+                ++n_pages;
+            }
+        }
+    }
+
+    return n_pages;
+}
+
+//======================================================================================================================
+// TLB
+//======================================================================================================================
+
+soft_mmu_t::tlb_entry_t* soft_mmu_t::lookup(addr32_t va)
+{
+    if (!tlb)
+        return NULL;
+
+    for (int is_large = 0; is_large < 2; ++is_large)
+    {
+        uint32_t vpn = va >> (is_large ? L1_SHIFT : L2_SHIFT);
+        tlb_entry_t* set = &tlb[(vpn % tlb_sets) * tlb_ways];
+
+        for (size_t way = 0; way < tlb_ways; ++way)
+        {
+            tlb_entry_t* e = &set[way];
+            if (e->valid && (e->large == bool(is_large)) && (e->vpn == vpn) && ((e->flags & global) || (e->asn == current_asn)))
+            {
+                e->used = ++tick;
+                return e;
+            }
+        }
+    }
+    return NULL;
+}
+
+void soft_mmu_t::fill(addr32_t va, uint32_t frame, uint32_t flags, bool is_large)
+{
+    if (!tlb)
+        return;
+
+    uint32_t vpn = va >> (is_large ? L1_SHIFT : L2_SHIFT);
+    tlb_entry_t* set = &tlb[(vpn % tlb_sets) * tlb_ways];
+    tlb_entry_t* victim = &set[0];
+
+    for (size_t way = 0; way < tlb_ways; ++way)
+    {
+        if (!set[way].valid)
+        {
+            victim = &set[way];
+            break;
+        }
+        if (set[way].used < victim->used)
+            victim = &set[way];
+    }
+
+    victim->vpn = vpn;
+    victim->frame = frame;
+    victim->flags = flags;
+    victim->asn = current_asn;
+    victim->large = is_large;
+    victim->valid = true;
+    victim->used = ++tick;
+}
+
+/**
+ * Translate @a va as the current domain would, through the TLB and on a miss through the page tables.
+ * Returns false on a fault.
+ */
+bool soft_mmu_t::translate(addr32_t va, bool write, addr32_t* pa)
+{
+    counters_t& c = current();
+    ++c.accesses;
+
+    tlb_entry_t* e = lookup(va);
+    uint32_t frame, flags;
+    bool is_large;
+
+    if (e)
+    {
+        ++c.tlb_hits;
+        frame = e->frame;
+        flags = e->flags;
+        is_large = e->large;
+    }
+    else
+    {
+        ++c.tlb_misses;
+        ++c.walks;
+
+        size_t l1idx = l1_index(va);
+        uint32_t pde = l1[l1idx];
+        ++c.walk_refs;
+
+        if (!(pde & present))
+        {
+            ++c.faults;
+            return false;
+        }
+
+        is_large = (pde & large) != 0;
+        if (is_large)
+        {
+            frame = pde & large_frame_mask;
+            flags = pde & flags_mask;
+        }
+        else
+        {
+            uint32_t pte = l2[l1idx][l2_index(va)];
+            ++c.walk_refs;
+
+            if (!(pte & present))
+            {
+                ++c.faults;
+                return false;
+            }
+            frame = pte & frame_mask;
+            flags = pte & flags_mask;
+        }
+
+        fill(va, frame, flags, is_large);
+    }
+
+    if (write && !(flags & writable))
+    {
+        ++c.faults;
+        return false;
+    }
+
+    *pa = frame | (va & (is_large ? ~large_frame_mask : ~frame_mask));
+    return true;
+}
+
+/**
+ * Drop the translations of @a va in all address spaces, like invlpg.
+ */
+void soft_mmu_t::invalidate(addr32_t va)
+{
+    ++current().invalidations;
+    if (!tlb)
+        return;
+
+    for (int is_large = 0; is_large < 2; ++is_large)
+    {
+        uint32_t vpn = va >> (is_large ? L1_SHIFT : L2_SHIFT);
+        tlb_entry_t* set = &tlb[(vpn % tlb_sets) * tlb_ways];
+
+        for (size_t way = 0; way < tlb_ways; ++way)
+        {
+            if (set[way].valid && (set[way].large == bool(is_large)) && (set[way].vpn == vpn))
+                set[way].valid = false;
+        }
+    }
+}
+
+void soft_mmu_t::drop(bool include_global)
+{
+    if (!tlb)
+        return;
+
+    for (size_t i = 0; i < tlb_sets * tlb_ways; ++i)
+    {
+        if (include_global || !(tlb[i].flags & global))
+            tlb[i].valid = false;
+    }
+}
+
+/**
+ * Drop all non-global translations, and the global ones too if @a include_global is set, like a CR3 reload.
+ */
+void soft_mmu_t::flush(bool include_global)
+{
+    ++current().flushes;
+    drop(include_global);
+}
+
+/**
+ * Run as protection domain @a pdom in address space @a asn. An untagged TLB loses its non-global entries on every
+ * change of address space.
+ */
+void soft_mmu_t::switch_domain(size_t pdom, uint16_t asn)
+{
+    current_pdom = slot(pdom);
+    if (asn == current_asn)
+        return;
+
+    current_asn = asn;
+    if (!tagged)
+        flush();
+}
@@ -0,0 +1,127 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+
+/**
+ * Software model of the 32 bit x86 MMU for hosted builds: two-level page tables in host memory and a set-associative
+ * TLB, optionally tagged with address space numbers. It counts what the hardware would do, per protection domain,
+ * so that page table policies can be measured without booting a machine.
+ *
+ * As on hardware, page table updates leave the TLB alone, stale entries stay until invalidate() or flush().
+ */
+class soft_mmu_t
+{
+public:
+    static const size_t N_L1_ENTRIES = 1024;
+    static const size_t N_L2_ENTRIES = 1024;
+    static const size_t N_DOMAINS    = 256; // Counters are kept per domain index, higher ones share the last slot.
+
+    // Page table entry bits, same as on x86.
+    static const uint32_t present   = 0x001;
+    static const uint32_t writable  = 0x002;
+    static const uint32_t user      = 0x004;
+    static const uint32_t large     = 0x080;
+    static const uint32_t global    = 0x100;
+    static const uint32_t migrating = 0x800; // Software bit, write access taken away by protect_frame()
+
+    static const uint32_t frame_mask       = 0xfffff000;
+    static const uint32_t large_frame_mask = 0xffc00000;
+    static const uint32_t flags_mask       = 0x00000fff;
+
+    struct counters_t
+    {
+        uint64_t accesses;      // Translations asked for
+        uint64_t tlb_hits;
+        uint64_t tlb_misses;
+        uint64_t walks;         // Page walks, one per miss
+        uint64_t walk_refs;     // Page table entries read by the walks
+        uint64_t faults;        // Accesses without a valid translation
+        uint64_t flushes;       // Whole TLB flushes
+        uint64_t invalidations; // Single page invalidations
+        uint64_t l2_allocs;     // L2 tables allocated
+        uint64_t l2_frees;      // L2 tables freed
+    };
+
+    typedef void* (*alloc_fn)(void* ctx, size_t size);
+    typedef void (*free_fn)(void* ctx, void* p);
+
+    /**
+     * Simulate a TLB of @a tlb_sets sets of @a tlb_ways entries. A @a tagged TLB keeps entries of other address
+     * spaces across switch_domain(), an untagged one drops all non-global entries. Memory for the TLB and the L2
+     * tables comes from @a alloc. Without sets or ways there is no TLB, every access walks the page tables and
+     * is_valid() is false, as it is when the TLB could not be allocated.
+     */
+    soft_mmu_t(size_t tlb_sets, size_t tlb_ways, bool tagged, alloc_fn alloc, free_fn free, void* ctx);
+    ~soft_mmu_t();
+
+    bool is_valid() const { return tlb != NULL; }
+
+    // Page tables.
+    bool map_4k(addr32_t va, addr32_t pa, uint32_t flags);
+    bool map_4m(addr32_t va, addr32_t pa, uint32_t flags);
+    bool split_4m(addr32_t va);
+    bool unmap(addr32_t va);
+    uint32_t* entry(addr32_t va);
+    uint32_t protect_frame(addr32_t frame);
+    uint32_t remap_frame(addr32_t from, addr32_t to);
+    uint32_t unmap_frame(addr32_t frame);
+    size_t n_l2_tables() const { return l2_count; }
+
+    // TLB.
+    bool translate(addr32_t va, bool write, addr32_t* pa);
+    void invalidate(addr32_t va);
+    void flush(bool include_global = false);
+    void switch_domain(size_t pdom, uint16_t asn);
+
+    // Statistics.
+    const counters_t& counters(size_t pdom) const { return stats[slot(pdom)]; }
+    void reset_counters();
+
+private:
+    struct tlb_entry_t
+    {
+        uint32_t vpn;       // Virtual page number, of 4MB pages for large entries
+        uint32_t frame;
+        uint32_t flags;
+        uint64_t used;      // For LRU replacement
+        uint16_t asn;
+        bool     valid;
+        bool     large;
+    };
+
+    static size_t slot(size_t pdom) { return pdom < N_DOMAINS ? pdom : N_DOMAINS - 1; }
+    counters_t& current() { return stats[current_pdom]; }
+
+    uint32_t* alloc_l2(size_t l1idx);
+    void free_l2(size_t l1idx);
+    bool is_l2_empty(size_t l1idx) const;
+    tlb_entry_t* lookup(addr32_t va);
+    void fill(addr32_t va, uint32_t frame, uint32_t flags, bool is_large);
+    void drop(bool include_global);
+
+    uint32_t     l1[N_L1_ENTRIES];
+    uint32_t*    l2[N_L1_ENTRIES];   // Host addresses of the L2 tables
+    size_t       l2_count;
+
+    tlb_entry_t* tlb;
+    size_t       tlb_sets;
+    size_t       tlb_ways;
+    bool         tagged;
+    uint64_t     tick;
+
+    uint16_t     current_asn;
+    size_t       current_pdom;
+    counters_t   stats[N_DOMAINS];
+
+    alloc_fn     alloc;
+    free_fn      release;
+    void*        ctx;
+};
@@ -19,6 +19,7 @@
 #include "page_directory.h"
 #include "system_frame_allocator_v1_interface.h"
 #include "heap_v1_interface.h"
+#include "heap_allocator.h"
 #include "stretch_allocator_v1_interface.h"
 #include "nucleus.h"
 #include "cpu.h"
@@ -43,14 +44,52 @@ struct pdom_st
 {
     uint16_t               refcnt;  /* Reference count on this pdom    */
     uint16_t               gen;     /* Current generation of this pdom */
-    stretch_v1::closure_t* stretch; /* Handle on stretch (for destroy) */
+    uint16_t               asn;     /* Address space number            */
+    uint32_t               asn_gen; /* ASN generation the asn is from  */
 };
 
+#define N_ASNS          4096   /* ASNs per generation, ASN 0 is never handed out */
+
+#define PDOM_LEAF_SIDS  256    /* SIDs covered by one rights leaf        */
+#define PDOM_LEAVES     (SID_MAX/PDOM_LEAF_SIDS)
+#define PDOM_CACHE_SIZE 4      /* Recently looked up SIDs kept per pdom  */
+
+/**
+ * Rights of 256 consecutive SIDs, a nibble each.
+ */
+struct pdom_leaf_t
+{
+    uint8_t rights[PDOM_LEAF_SIDS/2];
+};
+
+struct pdom_cache_t
+{
+    sid_t   sid;
+    uint8_t rights;
+} PACKED;
+
+/**
+ * Rights of a protection domain. Leaves are allocated on the first set_rights within their SID range, SIDs without
+ * a leaf have no rights.
+ */
 struct pdom_t
 {
-    uint8_t rights[SID_MAX/2];
+    pdom_leaf_t*  leaves[PDOM_LEAVES];
+    pdom_cache_t  cache[PDOM_CACHE_SIZE];
+    uint32_t      cache_next;
+};
+
+/**
+ * Fixed size blocks carved out of nailed stretches, these are not accessible from user mode.
+ */
+struct pdom_pool_t
+{
+    void*  free;        /* Free blocks, linked through their first words */
+    size_t block_size;
 };
 
+#define PDOM_POOL_CHUNK (8*KiB) /* Stretch size to carve blocks from */
+
 struct shadow_t
 {
     sid_t sid;
@@ -59,12 +98,19 @@ struct shadow_t
 
 #define SHADOW(_va)  reinterpret_cast<shadow_t*>(reinterpret_cast<char*>(_va) + 4*KiB)
 
-typedef uint8_t     l2_info;    /* free or used info for 1K L2 page tables */
-#define L2FREE      (l2_info)0x12
-#define L2USED      (l2_info)0x99
+/**
+ * A free L2 table. Free tables are linked through their first words.
+ */
+struct l2_chunk_t
+{
+    l2_chunk_t* next;       /* Next free L2 table              */
+    address_t   phys;       /* Physical address of this table  */
+};
 
 #define PDIDX(_pdid)   ((_pdid) & 0xffff)
-#define PDIDX_MAX       0x80   /* Allow up to 128 protection domains */
+#define PDGEN(_pdid)   ((_pdid) >> 16)
+#define PDIDX_LIMIT     0x10000 /* Pdom index is 16 bits of the pdid */
+#define PDIDX_GROW      64      /* Initial size of the pdom tables    */
 
 struct mmu_v1::state_t
 {
@@ -76,10 +122,20 @@ struct mmu_v1::state_t
     ramtab_v1::closure_t  ramtab_closure;
 
     uint32_t              next_pdidx;          /* Next free pdom idx (hint) */
-    pdom_t*               pdom_tbl[PDIDX_MAX]; /* Map pdom idx to pdom_t's  */
-    pdom_st               pdominfo[PDIDX_MAX]; /* Map pdom idx to pdom_st's */
+    uint32_t              n_pdoms;             /* Size of the pdom tables   */
+    pdom_t**              pdom_tbl;            /* Map pdom idx to pdom_t's  */
+    pdom_st*              pdominfo;            /* Map pdom idx to pdom_st's */
+    pdom_pool_t           pdom_pool;           /* Top level rights tables   */
+    pdom_pool_t           leaf_pool;           /* Rights table leaves       */
+    protection_domain_v1::id current_pdom;     /* Domain we are running in  */
+
+    uint32_t              asn_gen;             /* Current ASN generation    */
+    uint32_t              asn_next;            /* Next unused ASN this generation */
+
+    uint32_t              sid_gen[SID_MAX];    /* SID generation the rights held are for */
 
     bool                  use_global_pages;    /* Set iff we can use PGE    */
+    bool                  use_4mb_pages;       /* Set iff we can use PSE    */
 
     /*system_*/frame_allocator_v1::closure_t*  system_frame_allocator;
     heap_v1::closure_t*                        heap;
@@ -90,17 +146,15 @@ struct mmu_v1::state_t
     address_t             l1_mapping_virt; /* Virtual  address of l1 page table */
     address_t             l1_mapping_phys; /* Physical address of l1 page table */
 
-    address_t             l2_virt;         /* Virtual  address of l2 array base */
-    address_t             l2_phys;         /* Physical address of l2 array base */
-
     address_t             l1_virt_virt;    /* Virtual address of l2 PtoV table  */
 
     ramtab_entry_t*       ramtab;          /* Base of ram table                 */
     size_t                ramtab_size;     /* Size of ram table                 */
 
-    uint32_t              l2_max;          /* Index of the last available chunk   */
-    uint32_t              l2_next;         /* Index of first potential free chunk */
-    l2_info               info[0];         /* Free/used L2 info; actually l2_max entries */
+    uint32_t              l2_max;          /* Number of L2 tables in the pool     */
+    uint32_t              l2_free;         /* Number of them on the free list     */
+    l2_chunk_t*           l2_free_list;    /* Free L2 tables                      */
+    bool                  l2_growing;      /* Set while adding tables to the pool */
 };
 
 //======================================================================================================================
@@ -108,40 +162,204 @@ struct mmu_v1::state_t
 //======================================================================================================================
 
 #define L2SIZE          (8*KiB)                // 4K for L2 pagetable + 4K for shadow(?)
+#define TLB_FLUSH_THRESHOLD 32                 // Pages above which a full TLB flush beats invlpg for each
 
-inline bool alloc_l2table(mmu_v1::state_t* state, address_t *l2va, address_t *l2pa)
+#define L2_RESERVE      4                      // Free L2 tables kept for mapping the pool's own growth
+#define L2_GROW_TABLES  32                     // L2 tables added to the pool at a time
+
+inline void free_l2table(mmu_v1::state_t* state, address_t l2va, address_t l2pa)
 {
-    size_t i;
+    l2_chunk_t* chunk = reinterpret_cast<l2_chunk_t*>(l2va);
 
-    for (i = state->l2_next; i < state->l2_max; i++)
-        if (state->info[i] == L2FREE)
-            break;
+    chunk->next = state->l2_free_list;
+    chunk->phys = l2pa;
+    state->l2_free_list = chunk;
+    ++state->l2_free;
+
+    logger::debug() << "free_l2table: released L2 table at va=" << l2va << ", pa=" << l2pa;
+}
 
-    if (i == state->l2_max)
+inline bool alloc_l2table(mmu_v1::state_t* state, address_t *l2va, address_t *l2pa)
+{
+    l2_chunk_t* chunk = state->l2_free_list;
+
+    if (!chunk)
     {
-        // XXX go get some more mem from frames/salloc
         logger::warning() << "alloc_l2table: out of memory for tables!";
         return false;
     }
 
-    state->info[i] = L2USED;
-    state->l2_next = i+1;
+    state->l2_free_list = chunk->next;
+    --state->l2_free;
 
-    *l2va = state->l2_virt + (L2SIZE * i);
+    *l2va = reinterpret_cast<address_t>(chunk);
+    *l2pa = chunk->phys;
     memutils::clear_memory(reinterpret_cast<void*>(*l2va), L2SIZE);
-    *l2pa = state->l2_phys + (L2SIZE * i);
 
     logger::debug() << "alloc_l2table: new L2 table at va=" << *l2va << ", pa=" << *l2pa << ", shadow va=" << SHADOW(*l2va);
     return true;
 }
 
+/**
+ * Translate a virtual address using our own page tables, returns 0 if it is not mapped.
+ */
+static address_t virt_to_phys(mmu_v1::state_t* state, address_t va)
+{
+    int l1idx = pde_entry(va);
+    page_t pde = state->l1_mapping[l1idx];
+
+    if (!pde.is_present())
+        return 0;
+
+    if (pde.is_4mb())
+        return pde.frame() + (va & ((1UL << page_t::width_4mib) - 1));
+
+    page_t pte = reinterpret_cast<page_t*>(state->l1_virt[l1idx].frame())[pte_entry(va)];
+    if (!pte.is_present())
+        return 0;
+
+    return pte.frame() + (va & (PAGE_SIZE - 1));
+}
+
+/**
+ * Top up the pool of L2 tables from a nailed stretch when it runs low. Mapping the stretch itself may take L2
+ * tables, which is what the reserve is for. Must be called before looking at the page directory, as it changes it.
+ */
+static void reserve_l2tables(mmu_v1::state_t* state)
+{
+    // Not before finish_init, the boot time pool is sized for the boot mappings.
+    if ((state->l2_free >= L2_RESERVE) || !state->stretch_allocator || state->l2_growing)
+        return;
+
+    state->l2_growing = true;
+
+    stretch_v1::closure_t* str = state->stretch_allocator->create(L2_GROW_TABLES * L2SIZE, stretch_v1::right_none);
+    memory_v1::size size;
+    address_t base = str ? str->info(&size) : 0;
+
+    for (size_t i = 0; base && (i < L2_GROW_TABLES); ++i)
+    {
+        address_t l2va = base + i * L2SIZE;
+        address_t l2pa = virt_to_phys(state, l2va);
+        if (!l2pa)
+        {
+            logger::warning() << __FUNCTION__ << ": stretch page at " << l2va << " is not mapped";
+            continue;
+        }
+        free_l2table(state, l2va, l2pa);
+        ++state->l2_max;
+    }
+
+    state->l2_growing = false;
+    logger::debug() << __FUNCTION__ << ": " << state->l2_max << " L2 tables, " << state->l2_free << " free";
+}
+
+/**
+ * Split a 4MB page into an L2 table of 4K pages with the same frames, flags and sid, so that parts of it can be
+ * changed independently.
+ */
+static bool demote_4mb_page(mmu_v1::state_t* state, int l1idx)
+{
+    address_t l2va, l2pa;
+
+    reserve_l2tables(state);
+    if (!alloc_l2table(state, &l2va, &l2pa))
+    {
+        logger::warning() << __FUNCTION__ << ": cannot alloc l2 table to split 4MB page " << (l1idx << page_t::width_4mib);
+        return false;
+    }
+
+    page_t pde = state->l1_mapping[l1idx];
+    address_t base = pde.frame();
+    flags_t flags = pde.flags();
+
+    for (size_t l2idx = 0; l2idx < N_L2_ENTRIES; ++l2idx)
+    {
+        page_t pte;
+        pte = 0;
+        pte.set_frame(base + (l2idx << page_t::width_4kib));
+        pte.set_flags(flags);
+        reinterpret_cast<page_t*>(l2va)[l2idx] = pte;
+
+        SHADOW(l2va)[l2idx] = state->l1_shadows[l1idx];
+    }
+
+    state->l1_mapping[l1idx] = 0;
+    state->l1_mapping[l1idx].set_frame(l2pa);
+    state->l1_mapping[l1idx].set_flags(page_t::writable|page_t::write_through);
+    state->l1_virt[l1idx].set_frame(l2va);
+    state->l1_shadows[l1idx].sid = SID_NULL;
+    state->l1_shadows[l1idx].flags = 0;
+
+    nucleus::flush_tlb_entry(l1idx << page_t::width_4mib);
+
+    logger::debug() << __FUNCTION__ << ": split 4MB page at " << (l1idx << page_t::width_4mib);
+    return true;
+}
+
+/**
+ * Map a 4MB page with a single PDE. An L2 table already covering va is given back if it holds no valid mappings and
+ * its invalid entries all belong to the same stretch, as left there by add_range.
+ */
+static bool add4m_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t sid)
+{
+    int l1idx = pde_entry(va);
+
+    if (!state->use_4mb_pages)
+        return false;
+
+    if (state->l1_mapping[l1idx].is_4mb())
+    {
+        if (state->l1_mapping[l1idx].is_present())
+        {
+            logger::warning() << "URK! mapping va=" << va << " is already mapped using a 4MB page!";
+            return false;
+        }
+    }
+    else if (state->l1_mapping[l1idx].is_present())
+    {
+        address_t l2va = state->l1_virt[l1idx].frame();
+        page_t* l2 = reinterpret_cast<page_t*>(l2va);
+
+        for (size_t l2idx = 0; l2idx < N_L2_ENTRIES; ++l2idx)
+        {
+            if (l2[l2idx].is_present() || ((uint32_t(l2[l2idx]) != 0) && (SHADOW(l2va)[l2idx].sid != sid)))
+                return false;
+        }
+
+        free_l2table(state, l2va, state->l1_mapping[l1idx].frame());
+        state->l1_virt[l1idx] = 0;
+        state->l1_mapping[l1idx] = pte;
+        state->l1_mapping[l1idx].set_4mb(true);
+
+        // The old PDE may still be cached by the processor.
+        nucleus::flush_tlb_entry(va);
+    }
+    else
+    {
+        state->l1_mapping[l1idx] = pte;
+        state->l1_mapping[l1idx].set_4mb(true);
+    }
+
+    // Setup shadow pde (holds sid + original global rights)
+    state->l1_shadows[l1idx].sid = sid;
+    state->l1_shadows[l1idx].flags = pte.flags();
+    return true;
+}
+
 static bool add4k_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t sid)
 {
     int l1idx, l2idx;
     address_t  l2va, l2pa;
 
+    reserve_l2tables(state);
+
     l1idx  = pde_entry(va);
 
+    // Changing a single page within a 4MB page needs it split first.
+    if (state->l1_mapping[l1idx].is_4mb() && !demote_4mb_page(state, l1idx))
+        return false;
+
     if (!state->l1_mapping[l1idx].is_present())
     {
         logger::debug() << "mapping va=" << va << " requires new L2 table";
@@ -160,11 +378,7 @@ static bool add4k_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t s
         return false;
     }
 
-    l2pa = state->l1_mapping[l1idx].frame();
-    l2va = state->l2_virt + (l2pa - state->l2_phys);
-    // XXX PARANOIA
-    if (l2va != state->l1_virt[l1idx].frame())
-        logger::warning() << "Virtual addresses out of sync: l2va=" << l2va << ", not " << state->l1_virt[l1idx].frame();
+    l2va = state->l1_virt[l1idx].frame();
 
     // Ok, once here, we have a pointer to our l2 table in "l2va"
     l2idx = pte_entry(va);
@@ -187,7 +401,7 @@ static bool add4k_page(mmu_v1::state_t* state, address_t va, page_t pte, sid_t s
 static size_t update4k_pages(mmu_v1::state_t* state, address_t va, size_t n_pages, page_t pte, sid_t sid)
 {
     int l1idx, l2idx;
-    address_t  l2va, l2pa;
+    address_t  l2va;
 
     l1idx  = pde_entry(va);
 
@@ -197,24 +411,31 @@ static size_t update4k_pages(mmu_v1::state_t* state, address_t va, size_t n_page
         return 0;
     }
 
+    flags_t flags = pte.flags();
+
     if (state->l1_mapping[l1idx].is_4mb())
     {
-        logger::warning() << __FUNCTION__ << ": address " << va << " is mapped using a 4MB page!";
-        return 0;
-    }
+        // A whole 4MB page is updated in place, anything less splits it into 4K pages.
+        if ((pte_entry(va) == 0) && (n_pages >= N_L2_ENTRIES))
+        {
+            state->l1_mapping[l1idx].set_flags(flags);
+            state->l1_mapping[l1idx].set_4mb(true);
+            state->l1_shadows[l1idx].sid = sid;
+            state->l1_shadows[l1idx].flags = flags;
+            nucleus::flush_tlb_entry(va);
+            return N_L2_ENTRIES;
+        }
 
-    l2pa = state->l1_mapping[l1idx].frame();
-    l2va = state->l2_virt + (l2pa - state->l2_phys);
+        if (!demote_4mb_page(state, l1idx))
+            return 0;
+    }
 
-    // XXX PARANOIA
-    if (l2va != state->l1_virt[l1idx].frame())
-        logger::warning() << "virtual addresses out of sync: l2va=" << l2va << ", not " << state->l1_virt[l1idx].frame();
+    l2va = state->l1_virt[l1idx].frame();
 
     // Ok, once here, we have a pointer to our l2 table in "l2va"
     l2idx = pte_entry(va);
 
     // Update only flags and sid.
-    flags_t flags = pte.flags();
     size_t i;
 
     for (i = 0; (i < n_pages) && ((i + l2idx) < N_L2_ENTRIES); ++i)
@@ -229,6 +450,34 @@ static size_t update4k_pages(mmu_v1::state_t* state, address_t va, size_t n_page
     return i;
 }
 
+/**
+ * Same as update4k_pages, for ranges mapped with 4MB pages.
+ */
+static size_t update4m_pages(mmu_v1::state_t* state, address_t va, size_t n_pages, page_t pte, sid_t sid)
+{
+    int l1idx = pde_entry(va);
+    flags_t flags = pte.flags();
+    size_t i;
+
+    for (i = 0; (i < n_pages) && ((i + l1idx) < N_L1_TABLES); ++i)
+    {
+        page_t& pde = state->l1_mapping[l1idx + i];
+        if (!pde.is_4mb())
+        {
+            logger::warning() << __FUNCTION__ << ": address " << va << " is not mapped using a 4MB page!";
+            break;
+        }
+
+        pde.set_flags(flags);
+        pde.set_4mb(true);
+        state->l1_shadows[l1idx + i].sid = sid;
+        state->l1_shadows[l1idx + i].flags = flags;
+        nucleus::flush_tlb_entry(va + (i << page_t::width_4mib));
+    }
+
+    return i;
+}
+
 /**
  * Add a page mapping.
  * va describes the corresponding virtual address.
@@ -244,7 +493,7 @@ static bool add_page(mmu_v1::state_t* state, size_t page_width, address_t va, pa
             result = add4k_page(state, va, pte, sid);
             break;
         case page_t::width_4mib:
-            // result = add4m_page(state, va, pte, sid);
+            result = add4m_page(state, va, pte, sid);
             break;
         default:
             logger::warning() << __FUNCTION__ << ": unsupported page width " << page_width;
@@ -261,7 +510,7 @@ static size_t update_pages(mmu_v1::state_t* state, size_t page_width, address_t
             result = update4k_pages(state, va, n_pages, pte, sid);
             break;
         case page_t::width_4mib:
-            // result = update4m_pages(state, va, n_pages, pte, sid);
+            result = update4m_pages(state, va, n_pages, pte, sid);
             break;
         default:
             logger::warning() << __FUNCTION__ << ": unsupported page width " << page_width;
@@ -269,24 +518,195 @@ static size_t update_pages(mmu_v1::state_t* state, size_t page_width, address_t
     return result;
 }
 
-inline uint16_t alloc_pdidx(mmu_v1::state_t* state)
+static void* pdom_pool_alloc(mmu_v1::state_t* state, pdom_pool_t* pool)
+{
+    if (!pool->free)
+    {
+        stretch_v1::closure_t* str = state->stretch_allocator->create(PDOM_POOL_CHUNK, stretch_v1::right_none);
+        memory_v1::size size;
+        address_t base = str ? str->info(&size) : 0;
+
+        if (!base)
+        {
+            logger::warning() << __FUNCTION__ << ": cannot allocate rights tables";
+            return NULL;
+        }
+
+        for (address_t block = base; block + pool->block_size <= base + PDOM_POOL_CHUNK; block += pool->block_size)
+        {
+            *reinterpret_cast<void**>(block) = pool->free;
+            pool->free = reinterpret_cast<void*>(block);
+        }
+    }
+
+    void* block = pool->free;
+    pool->free = *reinterpret_cast<void**>(block);
+    memutils::clear_memory(block, pool->block_size);
+    return block;
+}
+
+inline void pdom_pool_free(pdom_pool_t* pool, void* block)
+{
+    *reinterpret_cast<void**>(block) = pool->free;
+    pool->free = block;
+}
+
+/**
+ * Double the pdom tables, up to the number of indices a pdid can hold.
+ * Tables are resized through the heap, in place if it can, and only the new entries are cleared.
+ */
+static bool grow_pdom_tables(mmu_v1::state_t* state)
+{
+    uint32_t n = state->n_pdoms ? std::min<uint32_t>(state->n_pdoms * 2, PDIDX_LIMIT) : PDIDX_GROW;
+    if (n == state->n_pdoms)
+        return false;
+
+    std::heap_allocator<pdom_t*> tbl_alloc(state->heap);
+    pdom_t** tbl = tbl_alloc.reallocate(state->pdom_tbl, state->n_pdoms, n);
+    if (!tbl)
+        return false;
+    // The old table may be gone already, keep the larger one even if the info table cannot grow.
+    state->pdom_tbl = tbl;
+    memutils::clear_memory(tbl + state->n_pdoms, (n - state->n_pdoms) * sizeof(pdom_t*));
+
+    std::heap_allocator<pdom_st> info_alloc(state->heap);
+    pdom_st* info = info_alloc.reallocate(state->pdominfo, state->n_pdoms, n);
+    if (!info)
+        return false;
+    state->pdominfo = info;
+    memutils::clear_memory(info + state->n_pdoms, (n - state->n_pdoms) * sizeof(pdom_st));
+
+    state->n_pdoms = n;
+
+    logger::debug() << __FUNCTION__ << ": room for " << n << " protection domains";
+    return true;
+}
+
+inline uint32_t alloc_pdidx(mmu_v1::state_t* state)
 {
-    uint32_t i = state->next_pdidx;
-    logger::trace() << __FUNCTION__ << ": next_pdidx " << i;
-    do {
+    for (uint32_t n = 0; n < state->n_pdoms; ++n)
+    {
+        uint32_t i = (state->next_pdidx + n) % state->n_pdoms;
         if (state->pdom_tbl[i] == NULL)
         {
-            state->next_pdidx = (i + 1) % PDIDX_MAX;
+            state->next_pdidx = (i + 1) % state->n_pdoms;
             logger::trace() << __FUNCTION__ << ": allocate next_pdidx " << i;
             return i;
         }
-        i = (i + 1) % PDIDX_MAX;
-        logger::trace() << __FUNCTION__ << ": next_pdidx " << i;
-    } while(i != state->next_pdidx);
+    }
+
+    // All in use, the first new index is free.
+    uint32_t i = state->n_pdoms;
+    if (!grow_pdom_tables(state))
+    {
+        logger::warning() << __FUNCTION__ << ": out of identifiers!" << endl;
+        nucleus::debug_stop();
+        return PDIDX_LIMIT;
+    }
+
+    state->next_pdidx = i + 1;
+    logger::trace() << __FUNCTION__ << ": allocate next_pdidx " << i;
+    return i;
+}
+
+/**
+ * Index of a live pdom, or PDIDX_LIMIT if the id is stale or bogus.
+ */
+inline uint32_t pdom_index(mmu_v1::state_t* state, protection_domain_v1::id dom_id)
+{
+    uint32_t idx = PDIDX(dom_id);
+
+    if ((idx >= state->n_pdoms) || (state->pdom_tbl[idx] == NULL) || (state->pdominfo[idx].gen != PDGEN(dom_id)))
+        return PDIDX_LIMIT;
+    return idx;
+}
+
+static uint8_t pdom_rights(pdom_t* pdom, sid_t sid)
+{
+    for (size_t i = 0; i < PDOM_CACHE_SIZE; ++i)
+    {
+        if (pdom->cache[i].sid == sid)
+            return pdom->cache[i].rights;
+    }
+
+    if (sid >= SID_MAX)
+        return 0;
+
+    pdom_leaf_t* leaf = pdom->leaves[sid / PDOM_LEAF_SIDS];
+    uint8_t rights = leaf ? (leaf->rights[(sid % PDOM_LEAF_SIDS) >> 1] >> ((sid & 1) ? 4 : 0)) & 0xf : 0;
+
+    pdom->cache[pdom->cache_next].sid = sid;
+    pdom->cache[pdom->cache_next].rights = rights;
+    pdom->cache_next = (pdom->cache_next + 1) % PDOM_CACHE_SIZE;
+
+    return rights;
+}
+
+/**
+ * Rights held for the SID of @a str may have been given to a destroyed stretch that had the SID before. If the SID
+ * generation changed since rights for it were last set or queried, take them away from every pdom.
+ */
+static void sid_rights_revalidate(mmu_v1::state_t* state, stretch_v1::closure_t* str)
+{
+    sid_t sid = str->d_state->sid;
+    uint32_t gen = str->d_state->sid_gen;
+
+    if ((sid >= SID_MAX) || (state->sid_gen[sid] == gen))
+        return;
+
+    logger::debug() << __FUNCTION__ << ": sid " << sid << " generation " << state->sid_gen[sid] << " -> " << gen;
+    state->sid_gen[sid] = gen;
+
+    uint8_t mask = sid & 1 ? 0xf0 : 0x0f;
+    for (size_t idx = 0; idx < state->n_pdoms; ++idx)
+    {
+        pdom_t* pdom = state->pdom_tbl[idx];
+        if (!pdom)
+            continue;
+
+        pdom_leaf_t* leaf = pdom->leaves[sid / PDOM_LEAF_SIDS];
+        if (leaf)
+            leaf->rights[(sid % PDOM_LEAF_SIDS) >> 1] &= ~mask;
+
+        for (size_t i = 0; i < PDOM_CACHE_SIZE; ++i)
+        {
+            if (pdom->cache[i].sid == sid)
+                pdom->cache[i].rights = 0;
+        }
+    }
+}
+
+/**
+ * Start a new ASN generation, every pdom gets a new ASN on its next use. The 32 bit TLB is untagged and ASNs never
+ * reach the hardware, so nothing is cached under an old ASN and there is nothing to flush.
+ */
+static void new_asn_generation(mmu_v1::state_t* state)
+{
+    ++state->asn_gen;
+    state->asn_next = 1;
+
+    logger::debug() << __FUNCTION__ << ": ASN generation " << state->asn_gen;
+}
+
+/**
+ * ASN of a pdom, allocating one if it has none from the current generation. ASNs of released pdoms are not reused
+ * before the next generation, so an ASN names one pdom for as long as it is handed out.
+ */
+static uint32_t pdom_asn(mmu_v1::state_t* state, uint32_t idx)
+{
+    pdom_st& info = state->pdominfo[idx];
+
+    if (info.asn_gen == state->asn_gen)
+        return info.asn;
+
+    if (state->asn_next >= N_ASNS)
+        new_asn_generation(state);
+
+    uint32_t asn = state->asn_next++;
 
-    logger::warning() << __FUNCTION__ << ": out of identifiers!" << endl;
-    nucleus::debug_stop();
-    return 0xdead;
+    info.asn = asn;
+    info.asn_gen = state->asn_gen;
+    return asn;
 }
 
 static flags_t control_bits(mmu_v1::state_t* state, stretch_v1::rights rights, memory_v1::attr_flags attr, bool valid)
@@ -331,14 +751,32 @@ inline bool valid_width(uint32_t width)
     return width == page_t::width_4kib || width == page_t::width_4mib;
 }
 
+inline bool is_4mb_aligned(address_t addr)
+{
+    return (addr & ((1UL << page_t::width_4mib) - 1)) == 0;
+}
+
+/**
+ * Split a 4MB page if it maps the given frame, so that the frame scans below find it in the new L2 table.
+ * Returns false if the 4MB page is left alone.
+ */
+static bool demote_4mb_page_of(mmu_v1::state_t* state, int l1idx, address_t frame)
+{
+    address_t base = state->l1_mapping[l1idx].frame();
+    if ((frame < base) || (frame >= base + (1UL << page_t::width_4mib)))
+        return false;
+    return demote_4mb_page(state, l1idx);
+}
+
 //======================================================================================================================
 // mmu_v1 methods
 //======================================================================================================================
 
+static void mmu_v1_switch_domain(mmu_v1::closure_t* self, protection_domain_v1::id dom_id);
+
 static void mmu_v1_start(mmu_v1::closure_t* self, protection_domain_v1::id root_domain)
 {
-    // nucleus::flush_tlb();
-    // nucleus::wrpdom(base);
+    mmu_v1_switch_domain(self, root_domain);
 }
 
 static void mmu_v1_add_range(mmu_v1::closure_t* self, stretch_v1::closure_t* str, memory_v1::virtmem_desc mem_range, stretch_v1::rights global_rights)
@@ -427,19 +865,23 @@ static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure
     page_t pte;
     pte.set_flags(flags);
 
-    while (n_pages--)
+    size_t page_shift = page_width - FRAME_WIDTH;
+
+    // Map pages in runs of frames with the same ramtab entries, checking and updating the ramtab once per run.
+    while (n_pages > 0)
     {
         size_t frame = phys >> FRAME_WIDTH;
-        pte.set_frame(phys);
-
+        size_t n_run_pages = n_pages;
+        size_t n_same = 0;
         uint32_t owner = OWNER_NONE;
+        uint32_t ramtab_width = frame_width;
 
         // Sanity check the ramtab
         if (frame < self->d_state->ramtab_size)
         {
             ramtab_v1::state state;
 
-            owner = self->d_state->ramtab_closure.get(frame, &frame_width, &state);
+            owner = self->d_state->ramtab_closure.get_range(frame, n_pages << page_shift, &ramtab_width, &state, &n_same);
             if (owner == OWNER_NONE)
             {
                 logger::warning() << __FUNCTION__ << ": physical address " << phys << " not owned!";
@@ -451,22 +893,43 @@ static void mmu_v1_add_mapped_range(mmu_v1::closure_t* self, stretch_v1::closure
                 logger::warning() << __FUNCTION__ << ": physical address " << phys << " is nailed!";
                 nucleus::debug_stop();
             }
+
+            n_run_pages = std::max<size_t>(n_same >> page_shift, 1);
         }
 
-        if (!add_page(self->d_state, page_width, virt, pte, str->d_state->sid))
+        size_t n_mapped;
+        for (n_mapped = 0; n_mapped < n_run_pages; )
         {
-            logger::warning() << __FUNCTION__ << ": failed to add page at " << virt;
-            return;
+            size_t n = 1;
+            pte.set_frame(phys);
+
+            // Runs of 4K pages covering whole aligned 4MB areas on both sides are mapped with a single 4MB page.
+            if ((page_width == page_t::width_4kib) && is_4mb_aligned(virt) && is_4mb_aligned(phys)
+                && (n_run_pages - n_mapped >= N_L2_ENTRIES) && add4m_page(self->d_state, virt, pte, str->d_state->sid))
+            {
+                n = N_L2_ENTRIES;
+            }
+            else if (!add_page(self->d_state, page_width, virt, pte, str->d_state->sid))
+                break;
+
+            n_mapped += n;
+            virt += n * page_size;
+            phys += n * page_size;
         }
 
         // Update the ramtab
-        if (frame < self->d_state->ramtab_size)
+        if ((frame < self->d_state->ramtab_size) && (n_mapped > 0))
         {
-            self->d_state->ramtab_closure.put(frame, owner, frame_width, ramtab_v1::state_mapped);
+            self->d_state->ramtab_closure.put_range(frame, std::min(n_mapped << page_shift, n_same), owner, ramtab_width, ramtab_v1::state_mapped);
         }
 
-        virt += page_size;
-        phys += page_size;
+        if (n_mapped < n_run_pages)
+        {
+            logger::warning() << __FUNCTION__ << ": failed to add page at " << virt;
+            return;
+        }
+
+        n_pages -= n_run_pages;
     }
 
     logger::debug() << __FUNCTION__ << ": added mapped range [" << mem_range.start_addr << ".." << mem_range.start_addr + (mem_range.n_pages << mem_range.page_width) << ")=>[" << pmem.start_addr << ".." << pmem.start_addr + (pmem.n_frames << pmem.frame_width) << "), sid=" << str->d_state->sid;
@@ -509,26 +972,157 @@ static void mmu_v1_update_range(mmu_v1::closure_t* self, stretch_v1::closure_t*
     logger::debug() << __FUNCTION__ << ": updated range [" << mem_range.start_addr << ".." << mem_range.start_addr + (mem_range.n_pages << page_width) << "), sid=" << str->d_state->sid;
 }
 
+/**
+ * Frames no longer mapped anywhere go back to unused in the ramtab, so that they can be freed.
+ */
+static void unmapped_frames(mmu_v1::state_t* state, address_t phys, size_t n_frames)
+{
+    size_t frame = phys >> FRAME_WIDTH;
+    size_t end = std::min(frame + n_frames, state->ramtab_size);
+
+    for (; frame < end; ++frame)
+    {
+        if (state->ramtab[frame].state == ramtab_v1::state_mapped)
+            state->ramtab[frame].state = ramtab_v1::state_unused;
+    }
+}
+
+inline bool is_l2table_empty(address_t l2va)
+{
+    page_t* l2 = reinterpret_cast<page_t*>(l2va);
+    for (size_t l2idx = 0; l2idx < N_L2_ENTRIES; ++l2idx)
+    {
+        if (uint32_t(l2[l2idx]) != 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Remove all pages of the range and give back the L2 tables left empty.
+ * Small ranges invalidate their TLB entries one by one, larger ones flush the whole TLB once at the end.
+ */
 static void mmu_v1_free_range(mmu_v1::closure_t* self, memory_v1::virtmem_desc mem_range)
 {
+    auto state = self->d_state;
+    size_t page_width = mem_range.page_width;
+
+    if (!valid_width(page_width))
+    {
+        logger::warning() << __FUNCTION__ << ": unsupported page width " << page_width;
+        return;
+    }
+
+    const size_t superpage_size = 1UL << page_t::width_4mib;
+    address_t virt = mem_range.start_addr;
+    address_t end = virt + (mem_range.n_pages << page_width);
+    bool flush_each = ((end - virt) >> PAGE_WIDTH) <= TLB_FLUSH_THRESHOLD;
+    bool flush_global = false;
+    size_t n_freed = 0;
+
+    while (virt < end)
+    {
+        int l1idx = pde_entry(virt);
+        page_t& pde = state->l1_mapping[l1idx];
+
+        if (pde.is_4mb())
+        {
+            // Only part of a 4MB page is freed, split it and free the 4K pages.
+            if (!is_4mb_aligned(virt) || (end - virt < superpage_size))
+            {
+                if (!demote_4mb_page(state, l1idx))
+                {
+                    // Entries cleared so far may still be cached in the TLB.
+                    if (!flush_each)
+                        nucleus::flush_tlb(flush_global);
+                    logger::warning() << __FUNCTION__ << ": cannot free range at " << virt;
+                    nucleus::debug_stop();
+                    return;
+                }
+                continue;
+            }
+
+            if (pde.is_present())
+            {
+                unmapped_frames(state, pde.frame(), N_L2_ENTRIES);
+                flush_global |= (pde.flags() & page_t::global) != 0;
+            }
+
+            pde = 0;
+            state->l1_shadows[l1idx].sid = SID_NULL;
+            state->l1_shadows[l1idx].flags = 0;
+
+            if (flush_each)
+                nucleus::flush_tlb_entry(virt);
+            virt += superpage_size;
+            continue;
+        }
+
+        address_t next = (virt & ~(superpage_size - 1)) + superpage_size;
+
+        if (!pde.is_present())
+        {
+            virt = next;
+            continue;
+        }
+
+        address_t l2va = state->l1_virt[l1idx].frame();
+        page_t* l2 = reinterpret_cast<page_t*>(l2va);
+
+        for (size_t l2idx = pte_entry(virt); (l2idx < N_L2_ENTRIES) && (virt < end); ++l2idx, virt += PAGE_SIZE)
+        {
+            if (l2[l2idx].is_present())
+            {
+                unmapped_frames(state, l2[l2idx].frame(), 1);
+                flush_global |= (l2[l2idx].flags() & page_t::global) != 0;
+                if (flush_each)
+                    nucleus::flush_tlb_entry(virt);
+            }
 
+            // Same as a freshly allocated L2 table entry.
+            l2[l2idx] = 0;
+            SHADOW(l2va)[l2idx].sid = 0;
+            SHADOW(l2va)[l2idx].flags = 0;
+        }
+
+        if (is_l2table_empty(l2va))
+        {
+            free_l2table(state, l2va, pde.frame());
+            pde = 0;
+            state->l1_virt[l1idx] = 0;
+            ++n_freed;
+
+            // The processor may still hold the PDE in its paging structure caches.
+            if (flush_each)
+                nucleus::flush_tlb_entry(next - superpage_size);
+        }
+    }
+
+    if (!flush_each)
+        nucleus::flush_tlb(flush_global);
+
+    logger::debug() << __FUNCTION__ << ": freed range [" << mem_range.start_addr << ".." << end << "), released " << n_freed << " L2 tables";
 }
 
 static protection_domain_v1::id mmu_v1_create_domain(mmu_v1::closure_t* self)
 {
     auto state = self->d_state;
 
-    uint16_t idx = alloc_pdidx(state);
+    uint32_t idx = alloc_pdidx(state);
+    if (idx == PDIDX_LIMIT)
+        return 0;
 
-    state->pdominfo[idx].refcnt = 0;
-    state->pdominfo[idx].stretch = state->stretch_allocator->create(sizeof(pdom_t), stretch_v1::right_none);
-    state->pdominfo[idx].gen++;
+    pdom_t* pdom = reinterpret_cast<pdom_t*>(pdom_pool_alloc(state, &state->pdom_pool));
+    if (!pdom)
+        return 0;
 
-    memory_v1::size sz;
-    pdom_t* base = reinterpret_cast<pdom_t*>(state->pdominfo[idx].stretch->info(&sz));
-    memutils::clear_memory(base, sz);
+    for (size_t i = 0; i < PDOM_CACHE_SIZE; ++i)
+        pdom->cache[i].sid = SID_NULL;
 
-    state->pdom_tbl[idx] = base;
+    state->pdominfo[idx].refcnt = 0;
+    state->pdominfo[idx].gen++;
+    state->pdominfo[idx].asn_gen = 0;
+    state->pdom_tbl[idx] = pdom;
 
     // Construct the pdid from the generation and the index.
     protection_domain_v1::id pdid = (uint32_t(state->pdominfo[idx].gen) << 16) | idx;
@@ -539,9 +1133,9 @@ static protection_domain_v1::id mmu_v1_create_domain(mmu_v1::closure_t* self)
 static void mmu_v1_retain_domain(mmu_v1::closure_t* self, protection_domain_v1::id dom_id)
 {
     auto state = self->d_state;
-    uint16_t idx = PDIDX(dom_id);
+    uint32_t idx = pdom_index(state, dom_id);
 
-    if ((idx >= PDIDX_MAX) || (state->pdom_tbl[idx] == NULL))
+    if (idx == PDIDX_LIMIT)
     {
         logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id;
         nucleus::debug_stop();
@@ -554,9 +1148,9 @@ static void mmu_v1_retain_domain(mmu_v1::closure_t* self, protection_domain_v1::
 static void mmu_v1_release_domain(mmu_v1::closure_t* self, protection_domain_v1::id dom_id)
 {
     auto state = self->d_state;
-    uint16_t idx = PDIDX(dom_id);
+    uint32_t idx = pdom_index(state, dom_id);
 
-    if ((idx >= PDIDX_MAX) || (state->pdom_tbl[idx] == NULL))
+    if (idx == PDIDX_LIMIT)
     {
         logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id;
         nucleus::debug_stop();
@@ -568,7 +1162,13 @@ static void mmu_v1_release_domain(mmu_v1::closure_t* self, protection_domain_v1:
 
     if (state->pdominfo[idx].refcnt == 0)
     {
-        state->stretch_allocator->destroy_stretch(state->pdominfo[idx].stretch);
+        pdom_t* pdom = state->pdom_tbl[idx];
+        for (size_t i = 0; i < PDOM_LEAVES; ++i)
+        {
+            if (pdom->leaves[i])
+                pdom_pool_free(&state->leaf_pool, pdom->leaves[i]);
+        }
+        pdom_pool_free(&state->pdom_pool, pdom);
         state->pdom_tbl[idx] = NULL;
     }
 }
@@ -576,26 +1176,46 @@ static void mmu_v1_release_domain(mmu_v1::closure_t* self, protection_domain_v1:
 static void mmu_v1_set_rights(mmu_v1::closure_t* self, protection_domain_v1::id dom_id, stretch_v1::closure_t* str, stretch_v1::rights rights)
 {
     auto state = self->d_state;
-    uint16_t idx = PDIDX(dom_id);
+    uint32_t idx = pdom_index(state, dom_id);
+    sid_t sid = str->d_state->sid;
 
-    if ((idx >= PDIDX_MAX) || (state->pdom_tbl[idx] == NULL))
+    if ((idx == PDIDX_LIMIT) || (sid >= SID_MAX))
     {
-        logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id;
+        logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id << " or sid " << sid;
         nucleus::debug_stop();
         return;
     }
 
+    sid_rights_revalidate(state, str);
     pdom_t* pdom = state->pdom_tbl[idx];
-    sid_t sid = str->d_state->sid;
 
-    logger::warning() << __FUNCTION__ << ": pdom " << pdom << ", sid " << sid << " " << rights;
+    logger::debug() << __FUNCTION__ << ": pdom " << pdom << ", sid " << sid << " " << rights;
 
-    uint8_t mask = sid & 1 ? 0xf0 : 0x0f;
     uint32_t val = rights;
+    pdom_leaf_t*& leaf = pdom->leaves[sid / PDOM_LEAF_SIDS];
+    if (!leaf)
+    {
+        // No rights is what a missing leaf means already.
+        if (val == 0)
+            return;
+
+        leaf = reinterpret_cast<pdom_leaf_t*>(pdom_pool_alloc(state, &state->leaf_pool));
+        if (!leaf)
+            return;
+    }
+
+    uint8_t mask = sid & 1 ? 0xf0 : 0x0f;
     if (sid & 1) val <<= 4;
-    pdom->rights[sid>>1] &= ~mask;
-    pdom->rights[sid>>1] |= val;
+    leaf->rights[(sid % PDOM_LEAF_SIDS) >> 1] &= ~mask;
+    leaf->rights[(sid % PDOM_LEAF_SIDS) >> 1] |= val;
+
+    for (size_t i = 0; i < PDOM_CACHE_SIZE; ++i)
+    {
+        if (pdom->cache[i].sid == sid)
+            pdom->cache[i].rights = uint32_t(rights);
+    }
 
+    // Rights are kept per stretch and a 4MB page never spans stretches, so there is nothing to split here.
     // Want to invalidate all non-global TB entries, but we can't
     // do that on Intel so just blow away the whole thing.
     // nucleus::flush_tlb();
@@ -603,13 +1223,52 @@ static void mmu_v1_set_rights(mmu_v1::closure_t* self, protection_domain_v1::id
 
 static stretch_v1::rights mmu_v1_query_rights(mmu_v1::closure_t* self, protection_domain_v1::id dom_id, stretch_v1::closure_t* str)
 {
-    return stretch_v1::rights();
+    auto state = self->d_state;
+    uint32_t idx = pdom_index(state, dom_id);
+
+    if (idx == PDIDX_LIMIT)
+    {
+        logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id;
+        return stretch_v1::rights();
+    }
+
+    sid_rights_revalidate(state, str);
+    return stretch_v1::rights(pdom_rights(state->pdom_tbl[idx], str->d_state->sid));
 }
 
-// No ASN supported on x86.
 static int32_t mmu_v1_query_asn(mmu_v1::closure_t* self, protection_domain_v1::id dom_id)
 {
-    return 0x666;
+    auto state = self->d_state;
+    uint32_t idx = pdom_index(state, dom_id);
+
+    if (idx == PDIDX_LIMIT)
+    {
+        logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id;
+        return -1;
+    }
+
+    return pdom_asn(state, idx);
+}
+
+static void mmu_v1_switch_domain(mmu_v1::closure_t* self, protection_domain_v1::id dom_id)
+{
+    auto state = self->d_state;
+    uint32_t idx = pdom_index(state, dom_id);
+
+    if (idx == PDIDX_LIMIT)
+    {
+        logger::warning() << __FUNCTION__ << ": bogus pdom id " << dom_id;
+        nucleus::debug_stop();
+        return;
+    }
+
+    // The nucleus ignores the ASN on 32 bit x86, it is passed on for a TLB that can use it.
+    uint32_t asn = pdom_asn(state, idx);
+    if (dom_id == state->current_pdom)
+        return;
+
+    state->current_pdom = dom_id;
+    nucleus::switch_address_space(state->l1_mapping_phys, asn);
 }
 
 static stretch_v1::rights mmu_v1_query_global_rights(mmu_v1::closure_t* self, stretch_v1::closure_t* str)
@@ -622,6 +1281,108 @@ static void mmu_v1_clone_rights(mmu_v1::closure_t* self, stretch_v1::closure_t*
 
 }
 
+/**
+ * Writable pages are made read-only and marked as migrating, so that remap_frame knows to make them writable again.
+ */
+static uint32_t mmu_v1_protect_frame(mmu_v1::closure_t* self, memory_v1::address frame)
+{
+    auto state = self->d_state;
+    uint32_t n_pages = 0;
+
+    for (size_t l1idx = 0; l1idx < N_L1_TABLES; ++l1idx)
+    {
+        if (!state->l1_mapping[l1idx].is_present())
+            continue;
+
+        if (state->l1_mapping[l1idx].is_4mb() && !demote_4mb_page_of(state, l1idx, frame))
+            continue;
+
+        page_t* l2 = reinterpret_cast<page_t*>(state->l1_virt[l1idx].frame());
+        for (size_t l2idx = 0; l2idx < N_L2_ENTRIES; ++l2idx)
+        {
+            if (l2[l2idx].is_present() && (l2[l2idx].frame() == frame))
+            {
+                if (l2[l2idx].is_writable())
+                {
+                    l2[l2idx] = (uint32_t(l2[l2idx]) & ~IA32_PAGE_WRITABLE) | IA32_PAGE_MIGRATING;
+                    nucleus::flush_tlb_entry((l1idx * N_L2_ENTRIES + l2idx) << PAGE_WIDTH);
+                }
+                ++n_pages;
+            }
+        }
+    }
+
+    logger::debug() << __FUNCTION__ << ": protected " << n_pages << " pages of frame " << frame;
+    return n_pages;
+}
+
+/**
+ * There is no reverse mapping from frames to pages, so look through all L2 tables.
+ */
+static uint32_t mmu_v1_remap_frame(mmu_v1::closure_t* self, memory_v1::address from, memory_v1::address to)
+{
+    auto state = self->d_state;
+    uint32_t n_pages = 0;
+
+    for (size_t l1idx = 0; l1idx < N_L1_TABLES; ++l1idx)
+    {
+        if (!state->l1_mapping[l1idx].is_present())
+            continue;
+
+        if (state->l1_mapping[l1idx].is_4mb() && !demote_4mb_page_of(state, l1idx, from))
+            continue;
+
+        page_t* l2 = reinterpret_cast<page_t*>(state->l1_virt[l1idx].frame());
+        for (size_t l2idx = 0; l2idx < N_L2_ENTRIES; ++l2idx)
+        {
+            if (l2[l2idx].is_present() && (l2[l2idx].frame() == from))
+            {
+                if (uint32_t(l2[l2idx]) & IA32_PAGE_MIGRATING)
+                    l2[l2idx] = (uint32_t(l2[l2idx]) & ~IA32_PAGE_MIGRATING) | IA32_PAGE_WRITABLE;
+                l2[l2idx].set_frame(to);
+                nucleus::flush_tlb_entry((l1idx * N_L2_ENTRIES + l2idx) << PAGE_WIDTH);
+                ++n_pages;
+            }
+        }
+    }
+
+    logger::debug() << __FUNCTION__ << ": remapped " << n_pages << " pages from " << from << " to " << to;
+    return n_pages;
+}
+
+/**
+ * Same scan as remap_frame, but the pages are marked invalid. Their sid stays in the shadow ptes, so the faults are
+ * delivered to the stretch driver.
+ */
+static uint32_t mmu_v1_unmap_frame(mmu_v1::closure_t* self, memory_v1::address frame)
+{
+    auto state = self->d_state;
+    uint32_t n_pages = 0;
+
+    for (size_t l1idx = 0; l1idx < N_L1_TABLES; ++l1idx)
+    {
+        if (!state->l1_mapping[l1idx].is_present())
+            continue;
+
+        if (state->l1_mapping[l1idx].is_4mb() && !demote_4mb_page_of(state, l1idx, frame))
+            continue;
+
+        page_t* l2 = reinterpret_cast<page_t*>(state->l1_virt[l1idx].frame());
+        for (size_t l2idx = 0; l2idx < N_L2_ENTRIES; ++l2idx)
+        {
+            if (l2[l2idx].is_present() && (l2[l2idx].frame() == frame))
+            {
+                l2[l2idx].set_flags(l2[l2idx].flags() | page_t::swapped);
+                nucleus::flush_tlb_entry((l1idx * N_L2_ENTRIES + l2idx) << PAGE_WIDTH);
+                ++n_pages;
+            }
+        }
+    }
+
+    logger::debug() << __FUNCTION__ << ": unmapped " << n_pages << " pages of frame " << frame;
+    return n_pages;
+}
+
 static const mmu_v1::ops_t mmu_v1_methods =
 {
     mmu_v1_start,
@@ -635,8 +1396,12 @@ static const mmu_v1::ops_t mmu_v1_methods =
     mmu_v1_set_rights,
     mmu_v1_query_rights,
     mmu_v1_query_asn,
+    mmu_v1_switch_domain,
     mmu_v1_query_global_rights,
-    mmu_v1_clone_rights
+    mmu_v1_clone_rights,
+    mmu_v1_protect_frame,
+    mmu_v1_remap_frame,
+    mmu_v1_unmap_frame
 };
 
 //======================================================================================================================
@@ -689,12 +1454,57 @@ static uint32_t ramtab_v1_get(ramtab_v1::closure_t* self, uint32_t frame, uint32
     return st->ramtab[frame].owner;
 }
 
+static void ramtab_v1_put_range(ramtab_v1::closure_t* self, uint32_t frame, uint32_t n_frames, uint32_t owner, uint32_t frame_width, ramtab_v1::state state)
+{
+    mmu_v1::state_t* st = reinterpret_cast<mmu_v1::state_t*>(self->d_state);
+    logger::trace() << __FUNCTION__ << ": " << n_frames << " frames from " << frame << " with owner " << owner << " and frame width " << int(frame_width) << " in state " << state;
+    if ((frame >= st->ramtab_size) || (n_frames > st->ramtab_size - frame))
+    {
+        logger::warning() << __FUNCTION__ << ": out of range frames " << frame << "+" << n_frames << ", max is " << st->ramtab_size;
+        nucleus::debug_stop();
+        return;
+    }
+
+    for (ramtab_entry_t* entry = &st->ramtab[frame]; entry != &st->ramtab[frame + n_frames]; ++entry)
+    {
+        entry->owner = owner;
+        entry->frame_width = frame_width;
+        entry->state = state;
+    }
+}
+
+static uint32_t ramtab_v1_get_range(ramtab_v1::closure_t* self, uint32_t frame, uint32_t n_frames, uint32_t* frame_width, ramtab_v1::state* state, uint32_t* n_same)
+{
+    mmu_v1::state_t* st = reinterpret_cast<mmu_v1::state_t*>(self->d_state);
+    if (frame >= st->ramtab_size)
+    {
+        logger::warning() << __FUNCTION__ << ": out of range frame " << frame << ", max is " << st->ramtab_size;
+        nucleus::debug_stop();
+        *n_same = 0;
+        return 0xdeadd00d;
+    }
+
+    const ramtab_entry_t* first = &st->ramtab[frame];
+    const ramtab_entry_t* end = first + std::min<size_t>(n_frames, st->ramtab_size - frame);
+    const ramtab_entry_t* entry = first + 1;
+    while ((entry < end) && (entry->owner == first->owner) && (entry->frame_width == first->frame_width) && (entry->state == first->state))
+        ++entry;
+
+    *frame_width = first->frame_width;
+    *state = ramtab_v1::state(first->state);
+    *n_same = entry - first;
+    logger::trace() << __FUNCTION__ << ": " << *n_same << " frames from " << frame << " with owner " << first->owner << " and frame width " << int(*frame_width) << " in state " << *state;
+    return first->owner;
+}
+
 static const ramtab_v1::ops_t ramtab_v1_methods =
 {
     ramtab_v1_size,
     ramtab_v1_base,
     ramtab_v1_put,
-    ramtab_v1_get
+    ramtab_v1_get,
+    ramtab_v1_put_range,
+    ramtab_v1_get_range
 };
 
 //======================================================================================================================
@@ -752,9 +1562,6 @@ static size_t memory_required(bootinfo_t* bi, size_t& n_l2_tables)
 
     size_t res = sizeof(mmu_v1::state_t);   /* state includes the level 1 page table */
 
-    // Account for L2 infos
-    res += n_l2_tables * sizeof(l2_info);
-
     logger::debug() << "Got " << int(nptabs) << " nptabs";
 
     return res;
@@ -782,52 +1589,75 @@ static inline bool is_non_cacheable(uint32_t type)
 static void enter_mappings(mmu_v1::state_t* state)
 {
     bootinfo_t* bi = new(bootinfo_t::ADDRESS) bootinfo_t;
-    std::for_each(bi->vmap_begin(), bi->vmap_end(), [bi, state](const memory_v1::mapping* e)
-    {
-        logger::debug() << "Virtual mapping [" << e->virt << ", " << e->virt + (e->nframes << FRAME_WIDTH) << ") -> [" << e->phys << ", " << e->phys + (e->nframes << FRAME_WIDTH) << ")";
-        for (size_t j = 0; j < e->nframes; ++j)
-        {
-            address_t virt = e->virt + (j << FRAME_WIDTH);
-            address_t phys = e->phys + (j << FRAME_WIDTH);
 
-            uint32_t flags = page_t::writable;
+    auto mapping_flags = [bi, state](address_t virt, address_t phys)
+    {
+        uint32_t flags = page_t::writable;
 
-            /* We assume the frames used by the established mappings
-               are part of the image unless otherwise specified */
+        /* We assume the frames used by the established mappings
+           are part of the image unless otherwise specified */
 
-            /*
-            ** Generally we want to cache things, but in the case
-            ** of IO space we prefer not to.
-            */
-            std::for_each(bi->mmap_begin(), bi->mmap_end(), [phys, virt, &flags](const multiboot_t::mmap_entry_t* e)
+        /*
+        ** Generally we want to cache things, but in the case
+        ** of IO space we prefer not to.
+        */
+        std::for_each(bi->mmap_begin(), bi->mmap_end(), [phys, virt, &flags](const multiboot_t::mmap_entry_t* e)
+        {
+            if (is_non_cacheable(e->type()) && (e->address() <= phys) && (e->address() + e->size() > phys))
             {
-                if (is_non_cacheable(e->type()) && (e->address() <= phys) && (e->address() + e->size() > phys))
-                {
-                    logger::trace() << "Disabling cache for va=" << virt;
-                    flags |= page_t::cache_disable;
-                }
-            });
+                logger::trace() << "Disabling cache for va=" << virt;
+                flags |= page_t::cache_disable;
+            }
+        });
+
+        /* We lock the L1 page table into the TLB */
+        if(state->use_global_pages && (virt == reinterpret_cast<address_t>(&(state->l1_mapping))))
+            flags |= page_t::global;
 
-            /* We lock the L1 page table into the TLB */
-            if(state->use_global_pages && (virt == reinterpret_cast<address_t>(&(state->l1_mapping))))
-                flags |= page_t::global;
+        return flags;
+    };
+
+    std::for_each(bi->vmap_begin(), bi->vmap_end(), [state, &mapping_flags](const memory_v1::mapping* e)
+    {
+        logger::debug() << "Virtual mapping [" << e->virt << ", " << e->virt + (e->nframes << FRAME_WIDTH) << ") -> [" << e->phys << ", " << e->phys + (e->nframes << FRAME_WIDTH) << ")";
+        for (size_t j = 0; j < e->nframes; )
+        {
+            address_t virt = e->virt + (j << FRAME_WIDTH);
+            address_t phys = e->phys + (j << FRAME_WIDTH);
+            uint32_t flags = mapping_flags(virt, phys);
 
             page_t pte;
             pte = 0;
             pte.set_frame(phys);
             pte.set_flags(flags);
 
-            if (!add4k_page(state, virt, pte, SID_NULL))
+            // Map whole aligned 4MB areas of the image with a single 4MB page, unless their flags differ.
+            size_t n = 1;
+            if (state->use_4mb_pages && is_4mb_aligned(virt) && is_4mb_aligned(phys) && (e->nframes - j >= N_L2_ENTRIES))
+            {
+                n = N_L2_ENTRIES;
+                for (size_t k = 1; k < N_L2_ENTRIES; ++k)
+                {
+                    if (mapping_flags(virt + (k << FRAME_WIDTH), phys + (k << FRAME_WIDTH)) != flags)
+                    {
+                        n = 1;
+                        break;
+                    }
+                }
+            }
+
+            if (!((n == N_L2_ENTRIES) ? add4m_page(state, virt, pte, SID_NULL) : add4k_page(state, virt, pte, SID_NULL)))
             {
                 logger::fatal() << "enter_mappings: failed to add mapping " << virt << "->" << phys;
                 PANIC("enter_mappings failed!");
             }
 
-            state->ramtab_closure.put(phys_frame_number(phys), OWNER_SYSTEM, FRAME_WIDTH, ramtab_v1::state_mapped);
+            state->ramtab_closure.put_range(phys_frame_number(phys), n, OWNER_SYSTEM, FRAME_WIDTH, ramtab_v1::state_mapped);
+            j += n;
         }
     });
 
-    logger::debug() << "mmu_module_v1: enter_mappings required total of " << int(state->l2_next) << " new L2 tables.";
+    logger::debug() << "mmu_module_v1: enter_mappings required total of " << int(state->l2_max - state->l2_free) << " new L2 tables.";
 }
 
 static mmu_v1::closure_t*
@@ -908,34 +1738,48 @@ mmu_module_v1_create(mmu_module_v1::closure_t* self, uint32_t initial_reservatio
     logger::debug() << "mmu_module_v1: ramtab at " << state->ramtab << " with " << int(state->ramtab_size) << " entries.";
 
     // Initialise the protection domain tables
+    // They are allocated with the first domain, the heap is not there yet.
     state->next_pdidx = 0;
-    for(i = 0; i < PDIDX_MAX; i++) //--
-    {
-        state->pdom_tbl[i] = NULL;
-        state->pdominfo[i].refcnt  = 0;
-        state->pdominfo[i].gen     = 0;
-        state->pdominfo[i].stretch = NULL;
-    }
+    state->n_pdoms = 0;
+    state->pdom_tbl = NULL;
+    state->pdominfo = NULL;
+    state->pdom_pool.free = NULL;
+    state->pdom_pool.block_size = sizeof(pdom_t);
+    state->leaf_pool.free = NULL;
+    state->leaf_pool.block_size = sizeof(pdom_leaf_t);
+    state->current_pdom = 0;
+
+    // Generation 0 is never current, so that every new pdom gets an ASN on first use.
+    state->asn_gen = 1;
+    state->asn_next = 1;
+
+    // SIDs start at generation 0 in the stretch allocator, and no pdom holds rights yet.
+    memutils::clear_memory(state->sid_gen, sizeof(state->sid_gen));
 
     // And store a pointer to the pdom_tbl in the info page.
     INFO_PAGE.protection_domains = &(state->pdom_tbl);
 
     state->use_global_pages = (INFO_PAGE.cpu_features & X86_32_FEAT_PGE) != 0;
+    state->use_4mb_pages = (INFO_PAGE.cpu_features & X86_32_FEAT_PSE) != 0;
 
     // Intialise our closures, etc to NULL for now  // will be fixed by $Done later
     state->system_frame_allocator = NULL;
     state->heap = NULL;
     state->stretch_allocator = NULL;
 
-    state->l2_virt  = page_align_up(first_range + l2_tables_offset);
-    state->l2_phys  = page_align_up(state->l1_mapping_phys + l2_tables_offset);
-    state->l2_max  = n_l2_tables;
+    address_t l2_virt = page_align_up(first_range + l2_tables_offset);
+    address_t l2_phys = page_align_up(state->l1_mapping_phys + l2_tables_offset);
+
+    logger::debug() << "mmu_module_v1: " << int(n_l2_tables) << " L2 tables at va=" << l2_virt << ", pa=" << l2_phys;
 
-    logger::debug() << "mmu_module_v1: " << int(state->l2_max) << " L2 tables at va=" << state->l2_virt << ", pa=" << state->l2_phys;
+    state->l2_max = n_l2_tables;
+    state->l2_free = 0;
+    state->l2_free_list = NULL;
+    state->l2_growing = false;
 
-    state->l2_next = 0;
-    for(i = 0; i < state->l2_max; i++) //--
-        state->info[i] = L2FREE;
+    // Push in reverse, so that tables are handed out in address order.
+    for(i = n_l2_tables; i > 0; i--) //--
+        free_l2table(state, l2_virt + (i - 1) * L2SIZE, l2_phys + (i - 1) * L2SIZE);
 
     // Enter mappings for all the existing translations.
     // This call uses mappings in bootinfo_page,
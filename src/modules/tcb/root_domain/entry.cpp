@@ -234,14 +234,15 @@ create_address_space(system_frame_allocator_v1::closure_t* frames, mmu_v1::closu
  * maps a stretch over the existing heap.
  * This allows us to map it read/write for us, and read-only to everyone else.
  */
-static void map_initial_heap(heap_factory_v1::closure_t* heap_factory, heap_v1::closure_t* heap, size_t initial_heap_size, protection_domain_v1::id root_domain_pdid)
+static void map_initial_heap(heap_factory_v1::closure_t* heap_factory, heap_v1::closure_t* heap, size_t initial_heap_size, stretch_allocator_v1::closure_t* sysalloc, protection_domain_v1::id root_domain_pdid)
 {
     logger::debug() << "Mapping stretch over heap: " << int(initial_heap_size) << " bytes at " << heap;
     memory_v1::physmem_desc null_pmem; /// @todo We pass pmems by value in the interface atm... it's not even used!
 
     auto str = PVS(stretch_allocator)->create_over(initial_heap_size, stretch_v1::rights(stretch_v1::right_read), memory_v1::address(heap), memory_v1::attrs_regular, PAGE_WIDTH, null_pmem);
 
-    auto real_heap = heap_factory->realize(heap, str);
+    // Let the heap grow with nailed stretches, so it never faults.
+    auto real_heap = heap_factory->realize(heap, str, sysalloc, root_domain_pdid);
 
     if (real_heap != heap)
     {
@@ -322,7 +323,7 @@ init(bootimage_t& bootimg)
     auto heap = heap_factory->create_raw(next_free + required, initial_heap_size);
     PVS(heap) = heap;
 
-    frames_factory->finish_init(frames, heap);
+    frames_factory->finish_init(frames, heap, mmu);
 
 #if HEAP_DEBUG
     kconsole << " + Heap alloc test:";
@@ -374,7 +375,7 @@ init(bootimage_t& bootimg)
              << "====================================" << endl;
 
     auto root_domain_pdid = create_address_space(frames, mmu);
-    map_initial_heap(heap_factory, heap, initial_heap_size, root_domain_pdid);
+    map_initial_heap(heap_factory, heap, initial_heap_size, sysalloc, root_domain_pdid);
 
     /* Get an Exception System */
     kconsole << "============================" << endl
@@ -414,8 +415,11 @@ init(bootimage_t& bootimg)
     auto ts_factory = load_module<type_system_factory_v1::closure_t>(bootimg, "typesystem_factory", "exported_type_system_factory_rootdom");
     ASSERT(ts_factory);
 
+    // Interfaces are registered once here and never go away, so the type system lives in an arena of its own.
     logger::debug() << "Creating a new type system...";
-    auto ts = ts_factory->create(PVS(heap), lctmod, strmod);
+    auto ts_heap = heap_factory->create_arena(64*KiB);
+    ASSERT(ts_heap);
+    auto ts = ts_factory->create(ts_heap, lctmod, strmod);
     ASSERT(ts);
     PVS(types) = reinterpret_cast<type_system_v1::closure_t*>(ts);
     logger::debug() << "Done: typesystem is at " << ts;
@@ -2,6 +2,7 @@
 #include "doubly_linked_list.h"
 #include "thread_v1_interface.h"
 #include "vcpu_v1_interface.h"
+#include "vcpu_lock.h"
 #include "activation_dispatcher_v1_interface.h"
 #include "threads_manager_v1_interface.h"
 #include "thread_hooks_v1_interface.h"
@@ -106,50 +107,6 @@ struct instance_state_t
     events_v1::state_t*  exit_st;                    /// Events structure used for exit.
 };
 
-/**
- * vcpu critical sections.
- *
- * lock/unlock sections are nestable (@todo double check).
- *
- * If unlock enables activations, it should cause an activation if there
- * are pending events on incoming event channels, but neither lock nor
- * unlock should need a system call in the common case.
- *
- * lock/unlock sections protect vcpu state (such as context and
- * event allocation) as well as user-level scheduler state (such as the run and
- * blocked queues).
- */
-
-class vcpu_lock_t
-{
-    vcpu_v1::closure_t* vcpu;
-    bool reenable;
-public:
-    inline vcpu_lock_t(vcpu_v1::closure_t* vcpu_) : vcpu(vcpu_), reenable(false)
-    {
-        lock();
-    }
-    inline ~vcpu_lock_t()
-    {
-        unlock();
-    }
-    inline void lock()
-    {
-        reenable = vcpu->are_activations_enabled();
-        if (reenable)
-            vcpu->disable_activations();
-    }
-    inline void unlock()
-    {
-        if (reenable)
-        {
-            vcpu->enable_activations();
-            if (vcpu->are_events_pending())
-                vcpu->rfa();
-        }
-    }
-};
-
 //=====================================================================================================================
 // Events helper functions.
 //=====================================================================================================================
@@ -27,6 +27,9 @@
 #include "debugger.h"
 #include "nucleus.h"
 #include "infopage.h"
+#include "rbtree.h"
+#include "bit_ops.h"
+#include "logger.h"
 
 //======================================================================================================================
 // state structures
@@ -34,27 +37,63 @@
 
 // How many uint32_t's are needed to cover all SIDs
 #define SID_ARRAY_SZ (SID_MAX/32)
+// And how many to cover all of those
+#define SID_SUMMARY_SZ (SID_ARRAY_SZ/32)
 
-struct virtual_address_space_region : public dl_link_t<virtual_address_space_region>
+/**
+ * SIDs in use. A summary bit is set for each full word of the bitmap, so that a free SID is found with two
+ * find-first-zero scans. The generation of a SID is bumped when it is freed, rights given for an earlier
+ * generation do not apply to the stretch that gets the SID next. A SID whose generation would wrap stays in use
+ * for good, so no generation is ever handed out twice.
+ */
+struct sid_table_t
+{
+    uint32_t summary[SID_SUMMARY_SZ];
+    uint32_t used[SID_ARRAY_SZ];
+    uint32_t gen[SID_MAX];
+};
+
+/**
+ * Free region of virtual address space. Free regions are kept in a tree ordered by start address, each node also
+ * records the largest region in its subtree so that a fitting region is found without visiting the others.
+ */
+struct virtual_address_space_region : public rbtree_link_t<virtual_address_space_region>
 {
     memory_v1::virtmem_desc desc;
+    size_t                  max_pages; //!< Largest n_pages in the subtree rooted here.
 
-    // This doubly-linked list is very messy...
-    virtual_address_space_region() : dl_link_t<virtual_address_space_region>() {
-        init(this);
+    memory_v1::address end() const { return desc.start_addr + (desc.n_pages << desc.page_width); }
+};
+
+struct region_traits_t
+{
+    static bool less(const virtual_address_space_region* a, const virtual_address_space_region* b)
+    {
+        return a->desc.start_addr < b->desc.start_addr;
+    }
+
+    static void update(virtual_address_space_region* r)
+    {
+        r->max_pages = r->desc.n_pages;
+        if (r->left && (r->left->max_pages > r->max_pages))
+            r->max_pages = r->left->max_pages;
+        if (r->right && (r->right->max_pages > r->max_pages))
+            r->max_pages = r->right->max_pages;
     }
 };
 
+typedef intrusive_rbtree_t<virtual_address_space_region, region_traits_t> region_tree_t;
+
 //! Shared state.
 struct server_state_t
 {
-    virtual_address_space_region*                    regions;
+    region_tree_t                                    regions;      //!< Free virtual address space.
 
     frame_allocator_v1::closure_t*                   frames;       //!< Only in nailed sallocs.
     heap_v1::closure_t*                              heap;
     mmu_v1::closure_t*                               mmu;
 
-    uint32_t*                                        sids;         //!< Pointer to table of SIDs in use.
+    sid_table_t*                                     sids;         //!< Pointer to table of SIDs in use.
     stretch_v1::closure_t**                          stretch_tab;  //!< SID -> Stretch_clp mapping.
     dl_link_t<system_stretch_allocator_v1::state_t>  clients;      //!< list of all client states.
 };
@@ -63,6 +102,7 @@ struct server_state_t
 struct stretch_list_t : public dl_link_t<stretch_list_t>
 {
     stretch_v1::closure_t* stretch;
+    memory_v1::physmem_desc phys; //!< Backing frames, only in nailed sallocs.
 
     // This doubly-linked list is very messy...
     stretch_list_t() : dl_link_t<stretch_list_t>() {
@@ -97,17 +137,22 @@ struct system_stretch_allocator_v1::state_t : public stretch_allocator_v1::state
 
 static sid_t alloc_sid(server_state_t* state)
 {
-    for (size_t i = 0; i < SID_ARRAY_SZ; ++i)
+    sid_table_t* sids = state->sids;
+
+    for (size_t w = 0; w < SID_SUMMARY_SZ; ++w)
     {
-        uint32_t sid = state->sids[i];
-        if (sid != ~0U)
-        {
-            size_t k;
-            for (k = 0; (k < 32) && (sid & (1 << k)); ++k) {}
-            state->sids[i] = sid | (1 << k);
-            kconsole << __FUNCTION__ << ": allocated sid " << i * 32 + k << endl;
-            return i * 32 + k;
-        }
+        if (sids->summary[w] == ~0U)
+            continue;
+
+        size_t i = w * 32 + bit_ops::find_first_zero(sids->summary[w]);
+        size_t k = bit_ops::find_first_zero(sids->used[i]);
+
+        sids->used[i] |= 1U << k;
+        if (sids->used[i] == ~0U)
+            sids->summary[w] |= 1U << (i % 32);
+
+        logger::trace() << __FUNCTION__ << ": allocated sid " << i * 32 + k << ", generation " << sids->gen[i * 32 + k];
+        return i * 32 + k;
     }
     kconsole << __FUNCTION__ << ": sid allocation FAILED" << endl;
     return SID_NULL;
@@ -118,65 +163,118 @@ static void register_sid(server_state_t* state, sid_t sid, stretch_v1::closure_t
     state->stretch_tab[sid] = stretch;
 }
 
-// static void free_sid(server_state_t* state, sid_t sid)
-// {
-    // kconsole << __FUNCTION__ << ": deallocated sid " << sid << endl;
-    // state->sids[sid / 32] &= ~(1 << (sid % 32));
-// }
+static void free_sid(server_state_t* state, sid_t sid)
+{
+    if (sid >= SID_MAX)
+        return;
+
+    state->stretch_tab[sid] = NULL;
+    if (state->sids->gen[sid] == ~0U)
+    {
+        logger::warning() << __FUNCTION__ << ": sid " << sid << " ran out of generations, retired";
+        return;
+    }
+
+    logger::trace() << __FUNCTION__ << ": deallocated sid " << sid;
+    state->sids->used[sid / 32] &= ~(1U << (sid % 32));
+    state->sids->summary[sid / 1024] &= ~(1U << ((sid / 32) % 32));
+    ++state->sids->gen[sid];
+}
 
 #define SYSALLOC_VA_BASE ANY_ADDRESS
 // #define SYSALLOC_VA_BASE (256*MiB)
 #define SYSALLOC_VA_SIZE (256*MiB)
 
-inline console_t& operator << (console_t& con, virtual_address_space_region* region)
+static virtual_address_space_region*
+new_region(server_state_t* state, memory_v1::address start, size_t n_pages, size_t page_width, memory_v1::attrs attr)
 {
-    con << "region:" << endl
-        << "  START: " << region->desc.start_addr << "; start page: " << (region->desc.start_addr >> PAGE_WIDTH) << endl
-        << "  bytes: " << (region->desc.n_pages << region->desc.page_width) << "; PAGES: " << region->desc.n_pages << endl
-        << "  width bits: " << int(region->desc.page_width) << endl
-        << "  attrs: " << region->desc.attr << endl;
-    return con;
+    auto region = new(state->heap) virtual_address_space_region;
+    region->desc.start_addr = start;
+    region->desc.n_pages = n_pages;
+    region->desc.page_width = page_width;
+    region->desc.attr = attr;
+    state->regions.insert(region);
+    return region;
 }
 
-static bool vm_alloc(server_state_t* state, memory_v1::size size, memory_v1::address start, memory_v1::address* virt_addr, size_t* n_pages, size_t* page_width)
+static void delete_region(server_state_t* state, virtual_address_space_region* region)
 {
-    kconsole << __FUNCTION__ << " size " << size << ", start " << start << endl;
+    state->regions.remove(region);
+    state->heap->free(reinterpret_cast<memory_v1::address>(region));
+}
 
-    size_t npages = (size + PAGE_SIZE - 1) >> PAGE_WIDTH;
-    dl_link_t<virtual_address_space_region>* region;
+/**
+ * Lowest addressed free region of at least @a n_pages, found by descending into the leftmost subtree that has one.
+ */
+static virtual_address_space_region* first_fit(server_state_t* state, size_t n_pages)
+{
+    virtual_address_space_region* region = state->regions.root();
 
-    if (unaligned(start))
+    if (!region || (region->max_pages < n_pages))
+        return NULL;
+
+    for (;;)
     {
-        // no start address requested, allocate at start of any suitable region.
-        for (region = state->regions->next(); region != state->regions; region = region->next())
-        {
-            kconsole << *region;
+        if (region->left && (region->left->max_pages >= n_pages))
+            region = region->left;
+        else if (region->desc.n_pages >= n_pages)
+            return region;
+        else
+            region = region->right;
+    }
+}
 
-            if (npages <= (*region)->desc.n_pages)
-                break;
+/**
+ * Free region with the highest start address not above @a addr, or NULL.
+ */
+static virtual_address_space_region* region_at_or_below(server_state_t* state, memory_v1::address addr)
+{
+    virtual_address_space_region* region = state->regions.root();
+    virtual_address_space_region* found = NULL;
+
+    while (region)
+    {
+        if (region->desc.start_addr <= addr)
+        {
+            found = region;
+            region = region->right;
         }
+        else
+            region = region->left;
+    }
+    return found;
+}
 
-        kconsole << "found " << *region << endl;
+static bool vm_alloc(server_state_t* state, memory_v1::size size, memory_v1::address start, memory_v1::address* virt_addr, size_t* n_pages, size_t* page_width)
+{
+    size_t npages = (size + PAGE_SIZE - 1) >> PAGE_WIDTH;
+    virtual_address_space_region* region;
 
-        if (region == state->regions)
+    if (unaligned(start))
+    {
+        // no start address requested, allocate at start of any suitable region.
+        region = first_fit(state, npages);
+
+        if (!region)
         {
-            kconsole << __FUNCTION__ << ": no appropriate region found!" << endl;
+            kconsole << __FUNCTION__ << ": no appropriate region found for " << npages << " pages!" << endl;
             return false;
         }
 
-        *virt_addr  = (*region)->desc.start_addr;
+        *virt_addr  = region->desc.start_addr;
         *n_pages    = npages;
-        *page_width = (*region)->desc.page_width;
+        *page_width = region->desc.page_width;
 
-        if ((*region)->desc.n_pages > npages)
+        if (region->desc.n_pages > npages)
         {
-            (*region)->desc.start_addr += align_to_frame_width(size, (*region)->desc.page_width);
-            (*region)->desc.n_pages -= npages;
+            // Moving the start up keeps the region between its neighbours, so it stays in place in the tree.
+            region->desc.start_addr += align_to_frame_width(size, region->desc.page_width);
+            region->desc.n_pages -= npages;
+            state->regions.update_path(region);
         }
         else
         {
-            region->remove();
-            delete *region;
+            delete_region(state, region);
         }
     }
     else // aligned(start)
@@ -185,26 +283,24 @@ static bool vm_alloc(server_state_t* state, memory_v1::size size, memory_v1::add
         size_t start_page = (start + PAGE_SIZE - 1) >> PAGE_WIDTH;
         size_t region_start_page{0}, region_last_page{0}, region_page_offset{0};
 
-        for (region = state->regions->next(); region != state->regions; region = region->next())
-        {
-            // get the region start and end pages
-            region_start_page = ((*region)->desc.start_addr + PAGE_SIZE - 1) >> PAGE_WIDTH;
-            region_last_page = region_start_page + (*region)->desc.n_pages;
+        // Only the region starting at or below the requested address can contain it.
+        region = region_at_or_below(state, start_page << PAGE_WIDTH);
 
-            // check if we're within one region
-            if (start_page >= region_start_page && (start_page + npages) <= region_last_page)
-                break;
+        if (region)
+        {
+            region_start_page = (region->desc.start_addr + PAGE_SIZE - 1) >> PAGE_WIDTH;
+            region_last_page = region_start_page + region->desc.n_pages;
         }
 
-        if (region == state->regions)
+        if (!region || (start_page + npages) > region_last_page)
         {
-            kconsole << __FUNCTION__ << ": no appropriate region found!" << endl;
+            kconsole << __FUNCTION__ << ": no appropriate region found at " << start << "!" << endl;
             return false;
         }
 
-        if ((start & ((1UL << (*region)->desc.page_width) - 1)) != 0) // FIXME: check start_page alignment instead?
+        if ((start & ((1UL << region->desc.page_width) - 1)) != 0) // FIXME: check start_page alignment instead?
         {
-            kconsole << __FUNCTION__ << ": requested address " << start << " not aligned to region's page width " << (*region)->desc.page_width << endl;
+            kconsole << __FUNCTION__ << ": requested address " << start << " not aligned to region's page width " << region->desc.page_width << endl;
             nucleus::debug_stop();
         }
 
@@ -212,48 +308,87 @@ static bool vm_alloc(server_state_t* state, memory_v1::size size, memory_v1::add
 
         *virt_addr  = start_page << PAGE_WIDTH; // FIXME: use region page_width instead?
         *n_pages    = npages;
-        *page_width = (*region)->desc.page_width;
+        *page_width = region->desc.page_width;
 
         // Now take out the allocated region.
         if (region_page_offset == 0)
         {
             // allocating from the start of the region
-            if ((*region)->desc.n_pages > npages)
+            if (region->desc.n_pages > npages)
             {
-                (*region)->desc.start_addr += align_to_frame_width(size, (*region)->desc.page_width);
-                (*region)->desc.n_pages -= npages;
+                region->desc.start_addr += align_to_frame_width(size, region->desc.page_width);
+                region->desc.n_pages -= npages;
+                state->regions.update_path(region);
             }
             else
             {
-                region->remove();
-                delete *region; // FIXME: check that the right operator delete is called!
+                delete_region(state, region);
             }
         }
         else
         {
             // allocating from the end of the region
-            if ((region_page_offset + npages) == (*region)->desc.n_pages)
+            if ((region_page_offset + npages) == region->desc.n_pages)
             {
-                (*region)->desc.n_pages -= npages;
+                region->desc.n_pages -= npages;
+                state->regions.update_path(region);
             }
             else
             {
                 // allocating from the middle of the region
-                auto new_region = new(state->heap) virtual_address_space_region;
-                new_region->desc.start_addr = *virt_addr + align_to_frame_width(size, (*region)->desc.page_width);
-                new_region->desc.n_pages = (*region)->desc.n_pages - (npages + region_page_offset);
-                new_region->desc.page_width = (*region)->desc.page_width;
-                new_region->desc.attr = (*region)->desc.attr;
-                (*region)->desc.n_pages = region_page_offset;
-                region->insert_after(*new_region);
+                size_t tail_pages = region->desc.n_pages - (npages + region_page_offset);
+                region->desc.n_pages = region_page_offset;
+                state->regions.update_path(region);
+
+                new_region(state, *virt_addr + align_to_frame_width(size, region->desc.page_width), tail_pages,
+                    region->desc.page_width, region->desc.attr);
             }
         }
     }
 
-    kconsole << __FUNCTION__ << ": allocated [" << *virt_addr << ".." << *virt_addr + (*n_pages << *page_width) << ")" << endl;
+    logger::trace() << __FUNCTION__ << ": allocated [" << *virt_addr << ".." << *virt_addr + (*n_pages << *page_width) << ")";
     return true;
 }
 
+/**
+ * Return virtual memory range back to the free regions, merging it with adjacent free regions.
+ */
+static void vm_free(server_state_t* state, memory_v1::address start, size_t n_pages, size_t page_width)
+{
+    memory_v1::address end = start + (n_pages << page_width);
+
+    // Neighbours of the freed range.
+    virtual_address_space_region* before = region_at_or_below(state, start);
+    virtual_address_space_region* after = before ? region_tree_t::next(before) : state->regions.first();
+
+    bool merge_before = before && (before->end() == start);
+    bool merge_after = after && (after->desc.start_addr == end);
+
+    if (merge_before && merge_after)
+    {
+        before->desc.n_pages += n_pages + after->desc.n_pages;
+        delete_region(state, after);
+        state->regions.update_path(before);
+    }
+    else if (merge_before)
+    {
+        before->desc.n_pages += n_pages;
+        state->regions.update_path(before);
+    }
+    else if (merge_after)
+    {
+        after->desc.start_addr = start;
+        after->desc.n_pages += n_pages;
+        state->regions.update_path(after);
+    }
+    else
+    {
+        new_region(state, start, n_pages, page_width, memory_v1::attrs_regular);
+    }
+
+    logger::trace() << __FUNCTION__ << ": freed [" << start << ".." << end << ")";
+}
+
 static void set_default_rights(system_stretch_allocator_v1::state_t* state, stretch_v1::closure_t* stretch)
 {
     server_state_t* ss = state->shared_state;
@@ -333,6 +468,14 @@ static stretch_v1::state_t* create_stretch(server_state_t* state, address_t base
     stretch->sid = alloc_sid(state);
     stretch->mmu = state->mmu;
 
+    if (stretch->sid == SID_NULL)
+    {
+        state->heap->free(reinterpret_cast<memory_v1::address>(stretch));
+        return NULL;
+    }
+
+    stretch->sid_gen = state->sids->gen[stretch->sid];
+
     register_sid(state, stretch->sid, &stretch->closure);
 
     return stretch;
@@ -354,7 +497,8 @@ static stretch_v1::closure_t* stretch_allocator_v1_nailed_create(stretch_allocat
     auto state = reinterpret_cast<system_stretch_allocator_v1::state_t*>(self->d_state);
     server_state_t* ss = state->shared_state;
     
-    phys.start_addr = ss->frames->allocate(size, FRAME_WIDTH);
+    // Nailed stretches hold page tables, protection domains and DCBs, which all expect to start zeroed.
+    phys.start_addr = ss->frames->allocate_range(size, FRAME_WIDTH, ANY_ADDRESS, memory_v1::attrs_zeroed);
     if (phys.start_addr == NO_ADDRESS)
     {
         kconsole << __FUNCTION__ << ": Failed to get physmem" << endl;
@@ -378,6 +522,7 @@ static stretch_v1::closure_t* stretch_allocator_v1_nailed_create(stretch_allocat
     {
         kconsole << __FUNCTION__ << ": Failed to create_stretch" << endl;
         ss->frames->free(phys.start_addr, size);
+        vm_free(ss, virt.start_addr, virt.n_pages, virt.page_width);
         //raise(memory_v1_falure);
         return NULL;
     }
@@ -391,6 +536,7 @@ static stretch_v1::closure_t* stretch_allocator_v1_nailed_create(stretch_allocat
     //lock();
     stretch_list_t* link = new(ss->heap) stretch_list_t;
     link->stretch = &s->closure;
+    link->phys = phys;
     state->stretches.add_to_tail(*link);
     //unlock();
 
@@ -416,10 +562,46 @@ static stretch_v1::closure_t* stretch_allocator_v1_nailed_clone(stretch_allocato
     return 0;
 }
 
+/**
+ * Unmap the stretch and give its frames, virtual memory and SID back.
+ * The frames can only be freed after free_range() has unmapped them and put them back to unused in the ramtab, the
+ * frame allocator refuses frames that are still mapped. So this needs an MMU module with a working free_range().
+ */
 static void stretch_allocator_v1_nailed_destroy_stretch(stretch_allocator_v1::closure_t* self, stretch_v1::closure_t* stretch)
 {
-    kconsole << __FUNCTION__ << endl;
+    kconsole << __FUNCTION__ << ": stretch at " << stretch << endl;
+    auto state = reinterpret_cast<system_stretch_allocator_v1::state_t*>(self->d_state);
+    server_state_t* ss = state->shared_state;
+    stretch_v1::state_t* s = stretch->d_state;
+
+    //TODO: need locking here! at least lightweight
+    dl_link_t<stretch_list_t>* link;
+    for (link = state->stretches.next(); link && (link != &state->stretches); link = link->next())
+    {
+        if ((*link)->stretch == stretch)
+            break;
+    }
+
+    if (!link || (link == &state->stretches))
+    {
+        kconsole << __FUNCTION__ << ": stretch was not allocated here!" << endl;
+        return;
+    }
 
+    memory_v1::virtmem_desc virt;
+    virt.start_addr = s->base;
+    virt.n_pages = s->size >> PAGE_WIDTH;
+    virt.page_width = PAGE_WIDTH;
+    virt.attr = memory_v1::attrs_regular;
+
+    ss->mmu->free_range(virt);
+    ss->frames->free((*link)->phys.start_addr, s->size);
+    vm_free(ss, virt.start_addr, virt.n_pages, virt.page_width);
+    free_sid(ss, s->sid);
+
+    link->remove();
+    ss->heap->free(reinterpret_cast<memory_v1::address>(static_cast<stretch_list_t*>(*link)));
+    ss->heap->free(reinterpret_cast<memory_v1::address>(s));
 }
 
 static void stretch_allocator_v1_nailed_destroy(stretch_allocator_v1::closure_t* self)
@@ -472,18 +654,10 @@ system_stretch_allocator_v1_create_nailed(system_stretch_allocator_v1::closure_t
     shared_state->sids = orig_state->sids;
     shared_state->stretch_tab = orig_state->stretch_tab;
 
-    kconsole << __FUNCTION__ << ": creating regions" << endl;
-    shared_state->regions = new(heap) virtual_address_space_region;
-    shared_state->regions->init();
     shared_state->clients.init();
 
     kconsole << __FUNCTION__ << ": creating first region" << endl;
-    auto first = new(heap) virtual_address_space_region;
-    first->desc.start_addr = virt;
-    first->desc.n_pages = n_pages;
-    first->desc.page_width = page_width;
-    first->desc.attr = memory_v1::attrs_regular;
-    shared_state->regions->add_to_head(*first);
+    new_region(shared_state, virt, n_pages, page_width, memory_v1::attrs_regular);
 
     kconsole << __FUNCTION__ << ": creating client state" << endl;
     auto client_state = new(heap) system_stretch_allocator_v1::state_t;
@@ -591,14 +765,8 @@ stretch_allocator_module_v1_create(stretch_allocator_module_v1::closure_t* self,
     shared_state->mmu = mmu;
     shared_state->frames = NULL;
     shared_state->clients.init();
-    shared_state->regions = new(heap) virtual_address_space_region;
 
-    auto region = new(heap) virtual_address_space_region;
-    region->desc.start_addr = 0;
-    region->desc.n_pages = 0x100000; // 4GiB address space.
-    region->desc.page_width = PAGE_WIDTH;
-    region->desc.attr = memory_v1::attrs_regular;
-    shared_state->regions->add_to_tail(*region);
+    new_region(shared_state, 0, 0x100000, PAGE_WIDTH, memory_v1::attrs_regular); // 4GiB address space.
 
     // by this point allocated memory contains
     // @0x1000 PIP, 1 page
@@ -629,8 +797,8 @@ stretch_allocator_module_v1_create(stretch_allocator_module_v1::closure_t* self,
     });
 
     // Allocate space for SID allocation table.
-    shared_state->sids = new(heap) uint32_t [SID_ARRAY_SZ];
-    memutils::clear_memory(shared_state->sids, SID_ARRAY_SZ * sizeof(uint32_t));
+    shared_state->sids = new(heap) sid_table_t;
+    memutils::clear_memory(shared_state->sids, sizeof(sid_table_t));
 
     // Allocate space for SID->stretch mapping.
     shared_state->stretch_tab = new(heap) stretch_v1::closure_t* [SID_MAX];
@@ -41,6 +41,32 @@ namespace nucleus
         return 0;
     }
 
+    /**
+     * Flush all TLB entries, including global ones if @a global is set.
+     * No console output here, TLB flushes are frequent.
+     */
+    inline void flush_tlb(bool global = false)
+    {
+        asm volatile ("int $99" :: "a"(4), "b"(uint32_t(global)));
+    }
+
+    /**
+     * Flush TLB entry for the page at virtual address @a va.
+     */
+    inline void flush_tlb_entry(address_t va)
+    {
+        asm volatile ("int $99" :: "a"(5), "b"(va));
+    }
+
+    /**
+     * Run on the page directory at @a pdba_phys tagged with address space number @a asn, without flushing the TLB.
+     * No console output here, this is on the domain switch path.
+     */
+    inline void switch_address_space(address_t pdba_phys, uint32_t asn)
+    {
+        asm volatile ("int $99" :: "a"(6), "b"(pdba_phys), "c"(asn));
+    }
+
     inline void debug_stop()
     {
         debugger_t::breakpoint();
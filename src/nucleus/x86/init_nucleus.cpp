@@ -98,6 +98,21 @@ public:
             interrupt_descriptor_table().set_irq_handler(regs->ebx, reinterpret_cast<interrupt_service_routine_t*>(regs->ecx));
         }
         else
+        if (regs->eax == 4)
+        {
+            ia32_mmu_t::flush_page_directory(regs->ebx != 0);
+        }
+        else
+        if (regs->eax == 5)
+        {
+            ia32_mmu_t::flush_page_directory_entry(regs->ebx);
+        }
+        else
+        if (regs->eax == 6)
+        {
+            ia32_mmu_t::switch_address_space(regs->ebx, regs->ecx);
+        }
+        else
         {
             kconsole << "unknown syscall " << regs->eax << endl;            
         }
@@ -75,6 +75,36 @@ public:
         logger::trace() << "heap_allocator::deallocate @ " << p << " from heap " << heap;
         heap->free(reinterpret_cast<memory_v1::address>(p));
     }
+
+    /**
+     * Resize storage at @a p holding @a old_n items to hold @a n items, keeping the first min(old_n, n) of them.
+     * Items past @a n must have been destroyed by the caller.
+     * Trivially copyable items are left to the heap, which resizes the block in place if it can. Other items are
+     * move constructed into new storage.
+     */
+    pointer reallocate(pointer p, size_type old_n, size_type n)
+    {
+        logger::trace() << "heap_allocator::reallocate @ " << p << " to " << n << " items of size " << sizeof(T) << " from heap " << heap;
+        return reallocate(p, old_n, n, std::is_trivially_copyable<T>());
+    }
+
+private:
+    pointer reallocate(pointer p, size_type, size_type n, std::true_type)
+    {
+        return reinterpret_cast<pointer>(heap->reallocate(reinterpret_cast<memory_v1::address>(p), n * sizeof(T)));
+    }
+
+    pointer reallocate(pointer p, size_type old_n, size_type n, std::false_type)
+    {
+        pointer q = allocate(n);
+        for (size_type i = 0; i < std::min(old_n, n); ++i)
+        {
+            ::new(static_cast<void*>(q + i)) T(std::move(p[i]));
+            p[i].~T();
+        }
+        deallocate(p, old_n);
+        return q;
+    }
 };
 
 /*  
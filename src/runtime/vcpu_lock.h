@@ -0,0 +1,58 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "vcpu_v1_interface.h"
+
+/**
+ * vcpu critical sections.
+ *
+ * lock/unlock sections are nestable (@todo double check).
+ *
+ * If unlock enables activations, it should cause an activation if there
+ * are pending events on incoming event channels, but neither lock nor
+ * unlock should need a system call in the common case.
+ *
+ * lock/unlock sections protect vcpu state (such as context and
+ * event allocation) as well as user-level scheduler state (such as the run and
+ * blocked queues).
+ *
+ * A NULL vcpu, as seen before the first domain is running, makes an empty section: there are no other threads yet.
+ * Unlocking an already unlocked section does nothing.
+ */
+class vcpu_lock_t
+{
+    vcpu_v1::closure_t* vcpu;
+    bool reenable;
+public:
+    inline vcpu_lock_t(vcpu_v1::closure_t* vcpu_) : vcpu(vcpu_), reenable(false)
+    {
+        lock();
+    }
+    inline ~vcpu_lock_t()
+    {
+        unlock();
+    }
+    inline void lock()
+    {
+        reenable = vcpu && vcpu->are_activations_enabled();
+        if (reenable)
+            vcpu->disable_activations();
+    }
+    inline void unlock()
+    {
+        if (reenable)
+        {
+            reenable = false;
+            vcpu->enable_activations();
+            if (vcpu->are_events_pending())
+                vcpu->rfa();
+        }
+    }
+};
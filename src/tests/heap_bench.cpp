@@ -0,0 +1,277 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Host benchmark for heap_t.
+ *
+ * Replays heap_v1 allocation traces against modules/heap_mod/heap.cpp running in a malloc'd arena and reports
+ * throughput, latency percentiles and peak fragmentation.
+ *
+ * Traces are captured on a HEAP_TRACE build with heap_v1.dump_trace(), the console log can be given to the tool as is:
+ * lines other than "heap_trace: <op> <size> <address> <timestamp>" are ignored. Aligned allocations are replayed
+ * with the largest power of two alignment of the recorded address, up to a page. Without a trace file a synthetic
+ * workload is generated.
+ *
+ * Usage: heap_bench [-a arena_MiB] [-r repeat] [trace_file]
+ */
+
+/*============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+#include "heap.h"
+#include "macros.h"
+#include "default_console.h"
+
+console_t kconsole;
+
+struct trace_op_t
+{
+    char     op;      // 'A' allocate, 'L' allocate aligned, 'F' free
+    size_t   size;
+    uint64_t address; // as recorded, used to pair frees with allocations
+};
+
+static bool load_trace(const char* file, std::vector<trace_op_t>& ops)
+{
+    FILE* f = fopen(file, "r");
+    if (!f)
+    {
+        perror(file);
+        return false;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        const char* rec = strstr(line, "heap_trace: ");
+        if (!rec)
+            continue;
+        rec += strlen("heap_trace: ");
+
+        char op = rec[0];
+        if ((op != 'A') && (op != 'L') && (op != 'F'))
+            continue;
+
+        char* end;
+        trace_op_t t;
+        t.op = op;
+        t.size = strtoull(rec + 1, &end, 0);
+        t.address = strtoull(end, &end, 0);
+        ops.push_back(t);
+    }
+
+    fclose(f);
+    return true;
+}
+
+/**
+ * Mostly small objects with a tail of larger buffers, allocated and freed in random order.
+ */
+static void synthetic_trace(std::vector<trace_op_t>& ops)
+{
+    std::vector<uint64_t> live;
+    uint64_t next_address = 1;
+
+    srand(1);
+    for (int i = 0; i < 1000000; ++i)
+    {
+        if ((live.size() < 4096) && (rand() % 2 || live.empty()))
+        {
+            trace_op_t t;
+            int r = rand() % 100;
+            t.op = (r == 0) ? 'L' : 'A';
+            t.size = (r < 80) ? rand() % 128 + 1 : (r < 98) ? rand() % 4096 + 1 : rand() % 65536 + 1;
+            t.address = (t.op == 'L') ? (next_address++ << 12) : (next_address++ << 3);
+            live.push_back(t.address);
+            ops.push_back(t);
+        }
+        else
+        {
+            size_t victim = rand() % live.size();
+            trace_op_t t = { 'F', 0, live[victim] };
+            live[victim] = live.back();
+            live.pop_back();
+            ops.push_back(t);
+        }
+    }
+}
+
+static inline size_t replay_alignment(uint64_t address)
+{
+    size_t alignment = address ? (address & -address) : 4096;
+    return std::min<size_t>(alignment, 4096);
+}
+
+struct report_t
+{
+    std::vector<uint64_t> latencies; // ns
+    uint64_t total_ns;
+    size_t   failed;
+    size_t   peak_live;
+    uint32_t peak_fragmentation;
+};
+
+static uint32_t fragmentation(heap_t& heap)
+{
+    uint64_t lengths[heap_t::FREE_LISTS];
+    size_t free_bytes, largest_free;
+    heap.free_list_stats(lengths, &free_bytes, &largest_free);
+    return free_bytes ? 100 - largest_free * 100 / free_bytes : 0;
+}
+
+static void replay(heap_t& heap, const std::vector<trace_op_t>& ops, report_t& report)
+{
+    typedef std::chrono::steady_clock clock;
+    std::unordered_map<uint64_t, void*> live;
+    size_t live_bytes = 0;
+
+    heap.lock();
+    for (size_t i = 0; i < ops.size(); ++i)
+    {
+        const trace_op_t& t = ops[i];
+        void* p = NULL;
+
+        if (t.op != 'F')
+        {
+            // Free of this address happened before the trace window, release the old block untimed.
+            auto it = live.find(t.address);
+            if (it != live.end())
+            {
+                live_bytes -= heap.block_size(it->second);
+                heap.free(it->second);
+                live.erase(it);
+            }
+        }
+        else
+        {
+            auto it = live.find(t.address);
+            if (it == live.end())
+                continue; // Allocated before the trace window.
+            p = it->second;
+            live_bytes -= heap.block_size(p);
+            live.erase(it);
+        }
+
+        clock::time_point start = clock::now();
+        if (t.op == 'A')
+            p = heap.allocate(t.size);
+        else if (t.op == 'L')
+            p = heap.allocate_aligned(t.size, replay_alignment(t.address));
+        else
+            heap.free(p);
+        clock::time_point end = clock::now();
+
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        report.latencies.push_back(ns);
+        report.total_ns += ns;
+
+        if (t.op != 'F')
+        {
+            if (!p)
+            {
+                ++report.failed;
+                continue;
+            }
+            live[t.address] = p;
+            live_bytes += heap.block_size(p);
+            report.peak_live = std::max(report.peak_live, live_bytes);
+        }
+
+        if (i % 256 == 0)
+            report.peak_fragmentation = std::max(report.peak_fragmentation, fragmentation(heap));
+    }
+
+    report.peak_fragmentation = std::max(report.peak_fragmentation, fragmentation(heap));
+
+    for (auto& block : live)
+        heap.free(block.second);
+    heap.unlock();
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min<size_t>(sorted.size() - 1, size_t(sorted.size() * p / 100.0))];
+}
+
+int main(int argc, char** argv)
+{
+    size_t arena_size = 64;
+    int repeat = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:r:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                arena_size = atoi(optarg);
+                break;
+            case 'r':
+                repeat = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-a arena_MiB] [-r repeat] [trace_file]\n", argv[0]);
+                return 1;
+        }
+    }
+    arena_size *= MiB;
+
+    std::vector<trace_op_t> ops;
+    if (optind < argc)
+    {
+        if (!load_trace(argv[optind], ops))
+            return 1;
+    }
+    else
+        synthetic_trace(ops);
+
+    void* arena = malloc(arena_size);
+    if (!arena)
+    {
+        fprintf(stderr, "Cannot allocate %zu bytes arena\n", arena_size);
+        return 1;
+    }
+
+    heap_t heap(reinterpret_cast<address_t>(arena), reinterpret_cast<address_t>(arena) + arena_size);
+
+    report_t report;
+    report.total_ns = 0;
+    report.failed = 0;
+    report.peak_live = 0;
+    report.peak_fragmentation = 0;
+
+    for (int i = 0; i < repeat; ++i)
+        replay(heap, ops, report);
+
+    std::sort(report.latencies.begin(), report.latencies.end());
+
+    printf("operations:          %zu (%zu failed)\n", report.latencies.size(), report.failed);
+    printf("throughput:          %.0f ops/s\n", report.total_ns ? report.latencies.size() * 1e9 / report.total_ns : 0.0);
+    printf("latency p50/p90/p99: %llu/%llu/%llu ns\n",
+        (unsigned long long)percentile(report.latencies, 50),
+        (unsigned long long)percentile(report.latencies, 90),
+        (unsigned long long)percentile(report.latencies, 99));
+    printf("latency p99.9/max:   %llu/%llu ns\n",
+        (unsigned long long)percentile(report.latencies, 99.9),
+        (unsigned long long)(report.latencies.empty() ? 0 : report.latencies.back()));
+    printf("peak live:           %zu bytes\n", report.peak_live);
+    printf("peak fragmentation:  %u%%\n", report.peak_fragmentation);
+
+    free(arena);
+    return 0;
+}
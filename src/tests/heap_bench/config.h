@@ -0,0 +1,12 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+// Host build replacements for the kernel headers used by modules/heap_mod/heap.cpp.
+#pragma once
+
+#define HEAP_DEBUG 0
@@ -0,0 +1,24 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+enum Color { LIGHTRED, WHITE };
+enum console_endl_t { endl };
+
+/**
+ * Console output of the heap is discarded, the benchmark prints its own report.
+ */
+class console_t
+{
+public:
+    template <typename T>
+    console_t& operator << (const T&) { return *this; }
+};
+
+extern console_t kconsole;
@@ -0,0 +1,24 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+/**
+ * The benchmark is single threaded, the lock only has to satisfy heap_t lock assertions.
+ */
+class lockable_t
+{
+public:
+    inline lockable_t() : locked(false) {}
+    inline void lock() { locked = true; }
+    inline void unlock() { locked = false; }
+    inline bool has_lock() { return locked; }
+
+private:
+    bool locked;
+};
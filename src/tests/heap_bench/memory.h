@@ -0,0 +1,18 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "types.h"
+#include "macros.h"
+
+template <typename T, typename U>
+inline T align_up(T addr, U size)
+{
+    return (addr + T(size) - 1) & ~(T(size) - 1);
+}
@@ -0,0 +1,17 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "macros.h"
+
+#define PANIC(msg) do { fprintf(stderr, "PANIC: %s at %s:%d\n", msg, __FILE__, __LINE__); abort(); } while (0)
+#define ASSERT(b) assert(b)
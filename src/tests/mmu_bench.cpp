@@ -0,0 +1,223 @@
+//
+// Part of Metta OS. Check https://atta-metta.net for latest version.
+//
+// Copyright 2007 - 2017, Stanislav Karchebnyy <berkus@atta-metta.net>
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See file LICENSE_1_0.txt or a copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+/**
+ * @brief Host benchmark for page table policies.
+ *
+ * Runs synthetic workloads against soft_mmu_t from the hosted mmu_mod and reports TLB misses, page walk
+ * references, flushes and L2 table allocations, comparing:
+ *  - a heap mapped with 4K pages and with 4MB pages, as add_mapped_range does for aligned ranges;
+ *  - domains switching on an untagged TLB and on one tagged with ASNs;
+ *  - free_range invalidating page by page up to a threshold and flushing the whole TLB above it.
+ *
+ * Usage: mmu_bench [-s tlb_sets] [-w tlb_ways] [-n accesses]
+ */
+
+/*============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "soft_mmu.h"
+#include "macros.h"
+
+static void* host_alloc(void*, size_t size)
+{
+    return malloc(size);
+}
+
+static void host_free(void*, void* p)
+{
+    free(p);
+}
+
+static const size_t   PAGE = 4*KiB;
+static const addr32_t HEAP_BASE = 0x40000000;
+static const addr32_t FRAME_BASE = 0x10000000;
+static const uint32_t RW = soft_mmu_t::present | soft_mmu_t::writable | soft_mmu_t::user;
+
+static size_t tlb_sets = 16;
+static size_t tlb_ways = 4;
+static size_t n_accesses = 1000000;
+
+static void print_header(const char* title)
+{
+    printf("\n%s\n", title);
+    printf("%-24s %10s %10s %10s %10s %8s %8s %6s\n", "", "accesses", "misses", "walk refs", "faults", "flushes", "invlpg", "L2s");
+}
+
+static void print_counters(const char* name, const soft_mmu_t::counters_t& c)
+{
+    printf("%-24s %10llu %10llu %10llu %10llu %8llu %8llu %6llu\n", name,
+        (unsigned long long)c.accesses, (unsigned long long)c.tlb_misses, (unsigned long long)c.walk_refs,
+        (unsigned long long)c.faults, (unsigned long long)c.flushes, (unsigned long long)c.invalidations,
+        (unsigned long long)c.l2_allocs);
+}
+
+static bool touch(soft_mmu_t& mmu, addr32_t va, bool write)
+{
+    addr32_t pa;
+    return mmu.translate(va, write, &pa);
+}
+
+/**
+ * Random accesses over a 64MB heap, with a quarter of them going to a hot 256KB region.
+ */
+static void heap_workload(bool superpages)
+{
+    const size_t heap_pages = 64 * MiB / PAGE;
+    soft_mmu_t mmu(tlb_sets, tlb_ways, true, host_alloc, host_free, NULL);
+
+    for (size_t i = 0; i < heap_pages; )
+    {
+        addr32_t va = HEAP_BASE + i * PAGE;
+        addr32_t pa = FRAME_BASE + i * PAGE;
+        if (superpages && (heap_pages - i >= soft_mmu_t::N_L2_ENTRIES) && mmu.map_4m(va, pa, RW))
+            i += soft_mmu_t::N_L2_ENTRIES;
+        else if (mmu.map_4k(va, pa, RW))
+            ++i;
+        else
+            return;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < n_accesses; ++i)
+    {
+        size_t page = (rand() % 4) ? rand() % heap_pages : rand() % 64;
+        touch(mmu, HEAP_BASE + page * PAGE + rand() % PAGE, rand() % 2);
+    }
+
+    print_counters(superpages ? "4MB pages" : "4K pages", mmu.counters(0));
+}
+
+/**
+ * Domains taking turns, each touching its own 16 page working set for a short time slice.
+ */
+static void switch_workload(bool tagged)
+{
+    const size_t n_domains = 4;
+    const size_t working_set = 16;
+    const size_t slice = 64;
+    soft_mmu_t mmu(tlb_sets, tlb_ways, tagged, host_alloc, host_free, NULL);
+
+    for (size_t d = 0; d < n_domains; ++d)
+    {
+        for (size_t p = 0; p < working_set; ++p)
+        {
+            addr32_t va = HEAP_BASE + (d * working_set + p) * PAGE;
+            mmu.map_4k(va, FRAME_BASE + (d * working_set + p) * PAGE, RW);
+        }
+    }
+
+    srand(1);
+    for (size_t i = 0; i < n_accesses; ++i)
+    {
+        size_t d = (i / slice) % n_domains;
+        if (i % slice == 0)
+            mmu.switch_domain(d + 1, d + 1);
+        touch(mmu, HEAP_BASE + (d * working_set + rand() % working_set) * PAGE, false);
+    }
+
+    printf("%s TLB:\n", tagged ? "tagged" : "untagged");
+    for (size_t d = 0; d < n_domains; ++d)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "  pdom %zu", d + 1);
+        print_counters(name, mmu.counters(d + 1));
+    }
+}
+
+/**
+ * Stretches of varying size are created, touched and freed while a hot working set is in use, freeing with
+ * invlpg per page up to @a threshold pages and with a full flush above it.
+ */
+static void free_range_workload(size_t threshold)
+{
+    const size_t hot_pages = 32;
+    const addr32_t scratch = HEAP_BASE + 64 * MiB;
+    soft_mmu_t mmu(tlb_sets, tlb_ways, true, host_alloc, host_free, NULL);
+
+    for (size_t p = 0; p < hot_pages; ++p)
+        mmu.map_4k(HEAP_BASE + p * PAGE, FRAME_BASE + p * PAGE, RW);
+
+    srand(1);
+    for (size_t i = 0; i < n_accesses; )
+    {
+        size_t n_pages = size_t(1) << (rand() % 10);
+
+        for (size_t p = 0; p < n_pages; ++p)
+            mmu.map_4k(scratch + p * PAGE, FRAME_BASE + (hot_pages + p) * PAGE, RW);
+
+        for (size_t p = 0; p < n_pages; ++p, ++i)
+            touch(mmu, scratch + p * PAGE, true);
+
+        for (size_t k = 0; k < 4 * hot_pages; ++k, ++i)
+            touch(mmu, HEAP_BASE + (rand() % hot_pages) * PAGE, false);
+
+        for (size_t p = 0; p < n_pages; ++p)
+        {
+            mmu.unmap(scratch + p * PAGE);
+            if (n_pages <= threshold)
+                mmu.invalidate(scratch + p * PAGE);
+        }
+        if (n_pages > threshold)
+            mmu.flush();
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "threshold %zu", threshold);
+    print_counters(name, mmu.counters(0));
+}
+
+int main(int argc, char** argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:w:n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                tlb_sets = atoi(optarg);
+                break;
+            case 'w':
+                tlb_ways = atoi(optarg);
+                break;
+            case 'n':
+                n_accesses = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s tlb_sets] [-w tlb_ways] [-n accesses]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (!tlb_sets || !tlb_ways)
+    {
+        fprintf(stderr, "TLB needs at least one set and one way\n");
+        return 1;
+    }
+
+    printf("TLB: %zu sets of %zu ways\n", tlb_sets, tlb_ways);
+
+    print_header("Heap mapping");
+    heap_workload(false);
+    heap_workload(true);
+
+    print_header("Domain switches");
+    switch_workload(false);
+    switch_workload(true);
+
+    print_header("Freeing ranges");
+    free_range_workload(0);
+    free_range_workload(32);
+    free_range_workload(1024);
+
+    return 0;
+}